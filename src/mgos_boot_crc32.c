@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_crc32.h"
+
+#include <string.h>
+
+#include "common/cs_crc32.h"
+
+#include "mgos_boot_hal.h"
+#include "mgos_hal.h"
+
+bool __attribute__((weak))
+mgos_boot_hw_crc32(uint32_t *crc32, const void *data, size_t len) {
+  (void) crc32;
+  (void) data;
+  (void) len;
+  return false;
+}
+
+#if MGOS_BOOT_CRC32_SB8
+
+/*
+ * Slice-by-8: processes 8 bytes per iteration using 8 lookup tables.
+ * Tables take 8K. They are computed on first use rather than stored,
+ * so they end up in RAM (.bss) and take no space in flash.
+ * Assumes little-endian CPU.
+ */
+static uint32_t s_crc32_tab[8][256];
+static bool s_crc32_tab_inited = false;
+
+static void crc32_init_tab(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+    }
+    s_crc32_tab[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t c = s_crc32_tab[k - 1][i];
+      s_crc32_tab[k][i] = (c >> 8) ^ s_crc32_tab[0][c & 0xff];
+    }
+  }
+  s_crc32_tab_inited = true;
+}
+
+IRAM static uint32_t crc32_sb8(uint32_t crc32, const uint8_t *p, size_t len) {
+  const uint32_t(*t)[256] = s_crc32_tab;
+  uint32_t c = ~crc32;
+  while (len > 0 && ((uintptr_t) p & 3) != 0) {
+    c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    uint32_t a, b;
+    memcpy(&a, p, 4);
+    memcpy(&b, p + 4, 4);
+    a ^= c;
+    c = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^
+        t[4][a >> 24] ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^
+        t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    len--;
+  }
+  return ~c;
+}
+
+#endif /* MGOS_BOOT_CRC32_SB8 */
+
+IRAM uint32_t mgos_boot_crc32(uint32_t crc32, const void *data, size_t len) {
+  if (mgos_boot_hw_crc32(&crc32, data, len)) return crc32;
+#if MGOS_BOOT_CRC32_SB8
+  if (!s_crc32_tab_inited) crc32_init_tab();
+  return crc32_sb8(crc32, (const uint8_t *) data, len);
+#else
+  return cs_crc32(crc32, data, len);
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Use slice-by-8 software implementation (takes 8K of RAM for tables).
+ * Enabled per platform in mos.yml, where there is no hardware CRC.
+ */
+#ifndef MGOS_BOOT_CRC32_SB8
+#define MGOS_BOOT_CRC32_SB8 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * CRC32 used for image verification, same result as cs_crc32.
+ * Uses hardware CRC unit if the platform provides one
+ * (see mgos_boot_hw_crc32), fast software implementation otherwise.
+ */
+uint32_t mgos_boot_crc32(uint32_t crc32, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_delta.h"
+
+#include <string.h>
+
+#include "mgos_utils.h"
+
+#include "mgos_boot_log.h"
+
+bool mgos_boot_delta_read_hdr(struct mgos_boot_stream *patch,
+                              struct mgos_boot_delta_hdr *hdr) {
+  if (!patch->read(patch, hdr, sizeof(*hdr))) return false;
+  if (hdr->magic != MGOS_BOOT_DELTA_MAGIC) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: not a patch\n", patch->name));
+    return false;
+  }
+  return true;
+}
+
+static bool delta_base_read(struct mgos_boot_delta_stream *ds, uint32_t off,
+                            size_t len, void *buf) {
+  enum mgos_vfs_dev_err r;
+  if (off > ds->hdr.base_len || len > ds->hdr.base_len - off) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Invalid patch op @ %lu\n",
+                             (unsigned long) ds->out_pos));
+    return false;
+  }
+  r = mgos_vfs_dev_read(ds->base, off, len, buf);
+  if (r != 0) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Read err %s @ %lu: %d\n", ds->base->name,
+                             (unsigned long) off, r));
+    return false;
+  }
+  return true;
+}
+
+static bool delta_stream_read(struct mgos_boot_stream *s, void *buf,
+                              size_t len) {
+  struct mgos_boot_delta_stream *ds = (struct mgos_boot_delta_stream *) s;
+  uint8_t *p = (uint8_t *) buf;
+  while (len > 0) {
+    struct mgos_boot_delta_op *op = &ds->op;
+    if (op->len == 0) {
+      if (!ds->patch->read(ds->patch, op, sizeof(*op))) return false;
+      continue;
+    }
+    size_t n = MIN(len, op->len);
+    switch (op->op) {
+      case MGOS_BOOT_DELTA_OP_COPY:
+        if (!delta_base_read(ds, op->off, n, p)) return false;
+        break;
+      case MGOS_BOOT_DELTA_OP_INSERT:
+        if (!ds->patch->read(ds->patch, p, n)) return false;
+        break;
+      case MGOS_BOOT_DELTA_OP_ADD: {
+        uint8_t diff[64];
+        n = MIN(n, sizeof(diff));
+        if (!delta_base_read(ds, op->off, n, p) ||
+            !ds->patch->read(ds->patch, diff, n)) {
+          return false;
+        }
+        for (size_t i = 0; i < n; i++) p[i] += diff[i];
+        break;
+      }
+      default:
+        MGOS_BOOT_LOG(LL_ERROR, ("Invalid patch op %d @ %lu\n", op->op,
+                                 (unsigned long) ds->out_pos));
+        return false;
+    }
+    op->off += n;
+    op->len -= n;
+    ds->out_pos += n;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+void mgos_boot_delta_stream_init(struct mgos_boot_delta_stream *ds,
+                                 struct mgos_boot_stream *patch,
+                                 const struct mgos_boot_delta_hdr *hdr,
+                                 struct mgos_vfs_dev *base) {
+  memset(ds, 0, sizeof(*ds));
+  ds->s.name = patch->name;
+  ds->s.read = delta_stream_read;
+  ds->patch = patch;
+  ds->base = base;
+  ds->hdr = *hdr;
+}
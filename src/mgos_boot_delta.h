@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Differential updates. A slot with MGOS_BOOT_APP_F_DELTA set in app_flags
+ * contains a patch against an image in another slot (the base), identified
+ * by its length and CRC32. The new image is produced while copying.
+ * Patches are produced by tools/mgos_boot_img.py.
+ *
+ * Patch format (all integers are little-endian):
+ *   struct mgos_boot_delta_hdr
+ *   ops: struct mgos_boot_delta_op, followed by data for INSERT and ADD.
+ *     COPY:   copy len bytes from the base at off.
+ *     INSERT: len bytes of data follow.
+ *     ADD:    len bytes follow, these are added (mod 256) to the base
+ *             bytes at off. Good for code that moved, where only
+ *             addresses change.
+ * Ops are applied in sequence until out_len bytes of output are produced.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_boot_stream.h"
+#include "mgos_vfs_dev.h"
+
+#define MGOS_BOOT_DELTA_MAGIC 0x5044474d /* "MGDP" */
+
+#define MGOS_BOOT_DELTA_OP_COPY 1
+#define MGOS_BOOT_DELTA_OP_INSERT 2
+#define MGOS_BOOT_DELTA_OP_ADD 3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_boot_delta_hdr {
+  uint32_t magic;
+  uint32_t base_len;
+  uint32_t base_crc32;
+  uint32_t out_len;
+  uint32_t out_crc32;
+};
+
+struct mgos_boot_delta_op {
+  uint8_t op;
+  uint8_t reserved[3];
+  uint32_t off; /* For COPY and ADD. */
+  uint32_t len;
+};
+
+struct mgos_boot_delta_stream {
+  struct mgos_boot_stream s;
+  struct mgos_boot_stream *patch;
+  struct mgos_vfs_dev *base;
+  struct mgos_boot_delta_hdr hdr;
+  /* Current op, len is the remaining length. */
+  struct mgos_boot_delta_op op;
+  uint32_t out_pos;
+};
+
+/* Read and check patch header. */
+bool mgos_boot_delta_read_hdr(struct mgos_boot_stream *patch,
+                              struct mgos_boot_delta_hdr *hdr);
+
+/* Set up a stream that produces the new image. Header must be read first. */
+void mgos_boot_delta_stream_init(struct mgos_boot_delta_stream *ds,
+                                 struct mgos_boot_stream *patch,
+                                 const struct mgos_boot_delta_hdr *hdr,
+                                 struct mgos_vfs_dev *base);
+
+#ifdef __cplusplus
+}
+#endif
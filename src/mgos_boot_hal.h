@@ -21,6 +21,7 @@
 
 #include "mgos_boot_cfg.h"
 #include "mgos_boot_dbg.h"
+#include "mgos_vfs_dev.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -76,11 +77,101 @@ void mgos_boot_cfg_set_default_slots(struct mgos_boot_cfg *cfg);
 bool mgos_boot_dbg_setup(void);
 
 /*
- * mgos_boot_dbg_putc should output one character of debugging output,
+ * mgos_boot_dbg_uart_putc should output one character of debugging output,
  * typically to UART. Note: make sure character is really sent, i.e.
  * flush buffers and FIFO (if any) before returning.
+ * Output goes through the log, see mgos_boot_log.h.
  */
-void mgos_boot_dbg_putc(char c);
+void mgos_boot_dbg_uart_putc(char c);
+
+/*
+ * Optional debug UART input, for recovery (see mgos_boot_recover.h).
+ * mgos_boot_dbg_uart_getc should return the next received character or -1
+ * if there is none, without waiting. Characters that arrive while the
+ * loader is busy elsewhere may be lost. Default never receives anything.
+ */
+int mgos_boot_dbg_uart_getc(void);
+
+/*
+ * Optional asynchronous device I/O, used to overlap reading of the source
+ * with programming and erasing of the destination during copy.
+ * mgos_boot_dev_read_async and mgos_boot_dev_erase_async should start the
+ * operation and return true, or return false if the device does not support
+ * background operations, in which case the caller falls back to synchronous
+ * access. At most one operation is started per device at a time and
+ * mgos_boot_dev_wait is always called to wait for it and get the result.
+ * Platforms that don't support async I/O need not implement these.
+ */
+bool mgos_boot_dev_read_async(struct mgos_vfs_dev *dev, size_t offset,
+                              size_t len, void *dst);
+bool mgos_boot_dev_erase_async(struct mgos_vfs_dev *dev, size_t offset,
+                               size_t len);
+enum mgos_vfs_dev_err mgos_boot_dev_wait(struct mgos_vfs_dev *dev);
+
+/*
+ * Optional device geometry, used to avoid unnecessary erases.
+ * mgos_boot_dev_get_sector should return the erase sector that contains
+ * offset. Default implementation assumes uniform sectors of the smallest
+ * erase size, platforms with non-uniform layout (STM32F internal flash)
+ * must override it for such devices.
+ * mgos_boot_dev_can_overwrite should return true if bits of already
+ * programmed data can be changed from 1 to 0 without erase, as on plain
+ * NOR flash. Flash with ECC and NAND can't do that, default is false.
+ * mgos_boot_dev_get_write_size should return the smallest unit that can
+ * be programmed once between erases: page on NAND, ECC word on internal
+ * flash. Default is 16, enough for STM32 internal flash.
+ */
+bool mgos_boot_dev_get_sector(struct mgos_vfs_dev *dev, size_t offset,
+                              size_t *start, size_t *size);
+bool mgos_boot_dev_can_overwrite(struct mgos_vfs_dev *dev);
+size_t mgos_boot_dev_get_write_size(struct mgos_vfs_dev *dev);
+
+/*
+ * Optional memory-mapped access. mgos_boot_dev_map should return the
+ * address at which contents of the device can be read directly, as with
+ * internal flash or QSPI flash in auto (XIP) mode, or NULL (default).
+ * Reads through the mapping must see the results of completed writes and
+ * erases. Mapped data is copied to a buffer before being written to
+ * another device, so it need not be readable while writing is in progress.
+ */
+const void *mgos_boot_dev_map(struct mgos_vfs_dev *dev);
+
+/*
+ * Optional hardware CRC32 unit. Should update *crc32 with data, producing
+ * the same result as cs_crc32(*crc32, data, len), and return true.
+ * If there's no suitable hardware, return false and software
+ * implementation will be used.
+ */
+bool mgos_boot_hw_crc32(uint32_t *crc32, const void *data, size_t len);
+
+/*
+ * Optional time source for the boot trace, see mgos_boot_trace.h.
+ * Should return monotonic time in microseconds, it is only used for
+ * intervals so the starting point doesn't matter, but it must keep going
+ * across clock changes in mgos_boot_init. It is called at least every
+ * 64K of data copied or checksummed, so a cycle counter that wraps can be
+ * extended in software. Default returns 0.
+ */
+uint32_t mgos_boot_time_us(void);
+
+/*
+ * Optional storage that survives a system reset and is not used by the
+ * app, such as RTC backup registers. Holds the warm boot record, see
+ * mgos_boot_warm.h, len is at most 80 bytes. Reads of storage that was
+ * lost should still succeed, the record is checked. Default has no
+ * storage and returns false, which disables warm boot.
+ */
+bool mgos_boot_retained_read(void *data, size_t len);
+bool mgos_boot_retained_write(const void *data, size_t len);
+
+/*
+ * Optional RAM for hot sections, see mgos_boot_hot.h. Should return true
+ * if the range is RAM that can be written right before the jump to the
+ * app, i.e. it is not used by the loader after restart. Boot state records
+ * are checked by the caller, the stack is up to the platform. Default
+ * returns false, which disables loading of hot sections.
+ */
+bool mgos_boot_hot_mem_ok(uintptr_t addr, size_t len);
 
 #ifdef __cplusplus
 }
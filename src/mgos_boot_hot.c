@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_hot.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "mgos_boot_cfg.h"
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_hal.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_trace.h"
+
+struct mgos_boot_hot g_boot_hot
+#if MGOS_BOOT_STATE_SECTION
+    __attribute__((section(".boot_state.hot")))
+#endif
+    ;
+
+extern struct mgos_boot_state g_boot_state;
+
+bool __attribute__((weak)) mgos_boot_hot_mem_ok(uintptr_t addr, size_t len) {
+  (void) addr;
+  (void) len;
+  return false;
+}
+
+static uint32_t hot_crc32(const struct mgos_boot_hot *h) {
+  return mgos_boot_crc32(0, h, offsetof(struct mgos_boot_hot, crc32));
+}
+
+static bool hot_overlaps(uint32_t addr, uint32_t len, const void *p,
+                         size_t size) {
+  uintptr_t start = (uintptr_t) p;
+  return (addr < start + size && start < (uintptr_t) addr + len);
+}
+
+/* Boot state records are live while the ranges are being copied. */
+static bool hot_range_ok(uint32_t addr, uint32_t len) {
+  const struct mgos_boot_log *log = mgos_boot_log_get();
+  if (len == 0 || len > UINT32_MAX - addr ||
+      !mgos_boot_hot_mem_ok(addr, len) ||
+      hot_overlaps(addr, len, &g_boot_state, sizeof(g_boot_state)) ||
+      hot_overlaps(addr, len, &g_boot_trace, sizeof(g_boot_trace)) ||
+      hot_overlaps(addr, len, &g_boot_hot, sizeof(g_boot_hot))) {
+    return false;
+  }
+  return (log == NULL ||
+          !hot_overlaps(addr, len, log, sizeof(*log) + log->size));
+}
+
+void mgos_boot_hot_init(uintptr_t app_org, uint32_t app_len) {
+  struct mgos_boot_hot *h = &g_boot_hot;
+  const uint8_t *img = (const uint8_t *) app_org;
+  uint32_t offset, len, fw_end, total = 0;
+  memset(h, 0, sizeof(*h));
+  if (!mgos_boot_img_find_ext_mapped(img, app_len, MGOS_BOOT_IMG_EXT_HOT,
+                                     &offset, &len)) {
+    return;
+  }
+  if (len % sizeof(struct mgos_boot_img_hot) != 0 ||
+      len / sizeof(struct mgos_boot_img_hot) > MGOS_BOOT_HOT_MAX_RANGES) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Invalid hot table (%lu)\n",
+                             (unsigned long) len));
+    return;
+  }
+  /* Ranges are in the firmware, before the extension records. */
+  fw_end = offset - sizeof(struct mgos_boot_img_ext);
+  for (uint32_t i = 0; i < len / sizeof(struct mgos_boot_img_hot); i++) {
+    struct mgos_boot_img_hot e;
+    memcpy(&e, img + offset + i * sizeof(e), sizeof(e));
+    if (e.offset > fw_end || e.len > fw_end - e.offset ||
+        !hot_range_ok(e.addr, e.len)) {
+      MGOS_BOOT_LOG(LL_ERROR, ("Invalid hot range %lu @ 0x%lx -> 0x%lx\n",
+                               (unsigned long) e.len, (unsigned long) e.offset,
+                               (unsigned long) e.addr));
+      memset(h, 0, sizeof(*h));
+      return;
+    }
+    h->ranges[i].src = app_org + e.offset;
+    h->ranges[i].dst = e.addr;
+    h->ranges[i].len = e.len;
+    h->num_ranges++;
+    total += e.len;
+  }
+  h->magic = MGOS_BOOT_HOT_MAGIC;
+  h->app_org = app_org;
+  h->crc32 = hot_crc32(h);
+  MGOS_BOOT_LOG(LL_INFO, ("Hot: %u ranges, %lu bytes\n", h->num_ranges,
+                          (unsigned long) total));
+}
+
+void mgos_boot_hot_load(uintptr_t app_org) {
+  const struct mgos_boot_hot *h = &g_boot_hot;
+  if (!mgos_boot_hot_is_valid(h) || h->app_org != app_org) return;
+  for (int i = 0; i < h->num_ranges; i++) {
+    const struct mgos_boot_hot_range *r = &h->ranges[i];
+    memcpy((void *) (uintptr_t) r->dst, (const void *) (uintptr_t) r->src,
+           r->len);
+  }
+}
+
+bool mgos_boot_hot_is_valid(const struct mgos_boot_hot *h) {
+  return (h->magic == MGOS_BOOT_HOT_MAGIC &&
+          h->num_ranges <= MGOS_BOOT_HOT_MAX_RANGES &&
+          h->crc32 == hot_crc32(h));
+}
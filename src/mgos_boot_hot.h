@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hot sections. An image may list ranges of code and data that the app
+ * wants in RAM (MGOS_BOOT_IMG_EXT_HOT): ISRs, tight loops, lookup tables.
+ * These are linked to run from RAM and stored in the image, like .data.
+ * The loader copies them right before jumping to the app, so apps that
+ * execute in place from external flash get RAM-speed hot paths without
+ * an early init copy loop of their own.
+ *
+ * The table is read from the image on every boot that goes through the
+ * loader, checked and left for the app in g_boot_hot, in the boot state
+ * area (see mgos_boot_state_area.h). Ranges are copied after
+ * restart, when nothing but the stack and boot state records is live in
+ * RAM; the platform decides which RAM may be used, see
+ * mgos_boot_hot_mem_ok in mgos_boot_hal.h. Either all ranges are copied
+ * or none: if the record is not valid for the app being started, the app
+ * must copy the ranges itself.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MGOS_BOOT_HOT_MAGIC 0x5448424d /* "MBHT" */
+
+#ifndef MGOS_BOOT_HOT_MAX_RANGES
+#define MGOS_BOOT_HOT_MAX_RANGES 8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_boot_hot_range {
+  uint32_t src; /* In flash, app_org + offset in the image. */
+  uint32_t dst; /* In RAM. */
+  uint32_t len;
+};
+
+struct mgos_boot_hot {
+  uint32_t magic;
+  uint32_t app_org; /* App the ranges are of. */
+  uint8_t num_ranges;
+  uint8_t reserved[3];
+  struct mgos_boot_hot_range ranges[MGOS_BOOT_HOT_MAX_RANGES];
+  uint32_t crc32;
+};
+
+extern struct mgos_boot_hot g_boot_hot;
+
+/*
+ * Read and check the table of the image of app_len bytes at app_org,
+ * which must be mapped. The record is cleared if there is none.
+ */
+void mgos_boot_hot_init(uintptr_t app_org, uint32_t app_len);
+
+/* Copy the ranges if the record is valid for app_org. */
+void mgos_boot_hot_load(uintptr_t app_org);
+
+/* Check the record, for the app side. */
+bool mgos_boot_hot_is_valid(const struct mgos_boot_hot *h);
+
+#ifdef __cplusplus
+}
+#endif
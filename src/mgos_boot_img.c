@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_img.h"
+
+#include <string.h>
+
+#include "mgos_hal.h"
+#include "mgos_utils.h"
+
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_main.h"
+
+/* Find the end of data: skip erased space at the end of the device. */
+static bool img_find_data_end(struct mgos_vfs_dev *dev, size_t max_len,
+                              size_t *end) {
+  uint8_t buf[256];
+  size_t offset = max_len;
+  while (offset > 0) {
+    size_t len = MIN(offset, sizeof(buf));
+    offset -= len;
+    if (mgos_vfs_dev_read(dev, offset, len, buf) != 0) return false;
+    while (len > 0 && buf[len - 1] == 0xff) len--;
+    if (len > 0) {
+      *end = offset + len;
+      return true;
+    }
+    mgos_wdt_feed();
+  }
+  *end = 0;
+  return true;
+}
+
+bool mgos_boot_img_find_trailer(struct mgos_vfs_dev *dev, size_t max_len,
+                                struct mgos_boot_img_trailer *t,
+                                uint32_t *img_len) {
+  size_t end = 0;
+  if (!img_find_data_end(dev, max_len, &end)) return false;
+  /* Last byte of the trailer (magic2) is never 0xff. */
+  if (end < sizeof(*t) || end % 4 != 0) return false;
+  if (mgos_vfs_dev_read(dev, end - sizeof(*t), sizeof(*t), t) != 0) {
+    return false;
+  }
+  if (t->magic != MGOS_BOOT_IMG_MAGIC || t->magic2 != MGOS_BOOT_IMG_MAGIC2 ||
+      (uint64_t) t->fw_len + t->ext_len + sizeof(*t) != end) {
+    return false;
+  }
+  *img_len = end;
+  return true;
+}
+
+/* Read from the device or, if it is NULL, from the image in memory. */
+static bool img_read(struct mgos_vfs_dev *dev, const uint8_t *img,
+                     uint32_t offset, size_t len, void *buf) {
+  if (dev == NULL) {
+    memcpy(buf, img + offset, len);
+    return true;
+  }
+  return (mgos_vfs_dev_read(dev, offset, len, buf) == 0);
+}
+
+static bool img_find_ext(struct mgos_vfs_dev *dev, const uint8_t *img,
+                         uint32_t img_len, uint16_t type, uint32_t *offset,
+                         uint32_t *len) {
+  struct mgos_boot_img_trailer t;
+  struct mgos_boot_img_ext e;
+  uint32_t off, end;
+  if (img_len < sizeof(t) ||
+      !img_read(dev, img, img_len - sizeof(t), sizeof(t), &t) ||
+      t.magic != MGOS_BOOT_IMG_MAGIC || t.magic2 != MGOS_BOOT_IMG_MAGIC2 ||
+      (uint64_t) t.fw_len + t.ext_len + sizeof(t) != img_len) {
+    return false;
+  }
+  off = t.fw_len;
+  end = t.fw_len + t.ext_len;
+  while (end - off >= sizeof(e)) {
+    if (!img_read(dev, img, off, sizeof(e), &e)) return false;
+    off += sizeof(e);
+    if (e.len > end - off) break;
+    if (e.type == type) {
+      *offset = off;
+      *len = e.len;
+      return true;
+    }
+    /* Data is padded to 8 bytes. */
+    off += MIN(e.len + (-e.len & 7), end - off);
+  }
+  return false;
+}
+
+bool mgos_boot_img_find_ext(struct mgos_vfs_dev *dev, uint32_t img_len,
+                            uint16_t type, uint32_t *offset, uint32_t *len) {
+  return img_find_ext(dev, NULL, img_len, type, offset, len);
+}
+
+bool mgos_boot_img_find_ext_mapped(const void *img, uint32_t img_len,
+                                   uint16_t type, uint32_t *offset,
+                                   uint32_t *len) {
+  return img_find_ext(NULL, (const uint8_t *) img, img_len, type, offset,
+                      len);
+}
+
+bool mgos_boot_img_get_reloc(struct mgos_vfs_dev *dev, uint32_t img_len,
+                             uint32_t *org, uint32_t *offset, uint32_t *num) {
+  struct mgos_boot_img_reloc r;
+  uint32_t off, len;
+  if (!mgos_boot_img_find_ext(dev, img_len, MGOS_BOOT_IMG_EXT_RELOC, &off,
+                              &len) ||
+      len < sizeof(r) || (len - sizeof(r)) % 4 != 0 ||
+      mgos_vfs_dev_read(dev, off, sizeof(r), &r) != 0) {
+    return false;
+  }
+  *org = r.org;
+  *offset = off + sizeof(r);
+  *num = (len - sizeof(r)) / 4;
+  return true;
+}
+
+bool mgos_boot_img_get_info(struct mgos_vfs_dev *dev, uint32_t *app_len,
+                            uint32_t *app_crc32) {
+  struct mgos_boot_img_trailer t;
+  uint32_t img_len = 0;
+  size_t dev_size = mgos_vfs_dev_get_size(dev);
+  if (mgos_boot_img_find_trailer(dev, dev_size, &t, &img_len)) {
+    uint32_t crc32 = mgos_boot_checksum(dev, t.fw_len + t.ext_len);
+    if (crc32 == t.crc32) {
+      *app_len = img_len;
+      *app_crc32 = mgos_boot_crc32(crc32, &t, sizeof(t));
+      return true;
+    }
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: image CRC mismatch\n", dev->name));
+  }
+  /* We don't know the actual length of the FW. */
+  *app_len = dev_size;
+  *app_crc32 = mgos_boot_checksum(dev, dev_size);
+  return false;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Image format. An image is the firmware, optionally followed by extension
+ * records and a trailer. Images are produced by tools/mgos_boot_img.py.
+ *
+ *   +----------+------------+---------+
+ *   | firmware | extensions | trailer |
+ *   +----------+------------+---------+
+ *   0          fw_len                 img_len
+ *
+ * Firmware is padded to 8 bytes, trailer is the last thing in the image,
+ * the rest of the slot is expected to be erased (0xff). This allows the
+ * loader to find the actual length of an image in a slot.
+ * Images without the trailer are still supported, these are assumed to
+ * take up the whole slot.
+ *
+ * Extension records are a header (struct mgos_boot_img_ext) followed by
+ * data, padded to 8 bytes. Unknown record types are ignored.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_vfs_dev.h"
+
+#define MGOS_BOOT_IMG_MAGIC 0x5449474d  /* "MGIT" */
+#define MGOS_BOOT_IMG_MAGIC2 0x4549474d /* "MGIE" */
+
+/*
+ * Slot state app_flags used by the loader. Low bits are used by the
+ * boot config library, these are at the top.
+ */
+/* Slot contains a patch rather than an image, see mgos_boot_delta.h. */
+#define MGOS_BOOT_APP_F_DELTA (1UL << 24)
+/* Slot contents are compressed, see mgos_boot_lz.h. */
+#define MGOS_BOOT_APP_F_LZ (1UL << 25)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Manifest: CRC32 of each block of the firmware, which allows checking
+ * the data while copying, before it's written. Record data is
+ * struct mgos_boot_img_manifest followed by uint32_t crc32[num_blocks],
+ * where num_blocks is len / block_size rounded up.
+ */
+#define MGOS_BOOT_IMG_EXT_MANIFEST 1
+
+/*
+ * Relocations: offsets of the words of the firmware that hold absolute
+ * addresses, so the image can be run from an address other than the one
+ * it was linked at (see mgos_boot_copy_app). Record data is
+ * struct mgos_boot_img_reloc followed by uint32_t offset[], in ascending
+ * order. Checksums in the image (trailer, manifest) are of the image as
+ * linked.
+ */
+#define MGOS_BOOT_IMG_EXT_RELOC 2
+
+/*
+ * Hot sections: ranges of the firmware to be copied to RAM before the app
+ * is started, see mgos_boot_hot.h. Record data is
+ * struct mgos_boot_img_hot[].
+ */
+#define MGOS_BOOT_IMG_EXT_HOT 3
+
+struct mgos_boot_img_ext {
+  uint16_t type;
+  uint16_t reserved;
+  uint32_t len; /* Length of the data, excluding header and padding. */
+};
+
+struct mgos_boot_img_manifest {
+  uint32_t block_size;
+  uint32_t len; /* Length of the data covered, from the start. */
+};
+
+struct mgos_boot_img_reloc {
+  uint32_t org; /* Address the image was linked at. */
+};
+
+struct mgos_boot_img_hot {
+  uint32_t offset; /* In the image. */
+  uint32_t addr;   /* In RAM, where the range is linked to run. */
+  uint32_t len;
+};
+
+struct mgos_boot_img_trailer {
+  uint32_t magic;
+  uint32_t fw_len;  /* Length of the firmware, including padding. */
+  uint32_t ext_len; /* Length of the extension records. */
+  uint32_t flags;
+  uint32_t crc32; /* CRC32 of the firmware and extension records. */
+  uint32_t reserved[2];
+  uint32_t magic2;
+};
+
+/*
+ * Look for the image trailer in the first max_len bytes of the device.
+ * Returns true and fills in trailer and image length if found.
+ * Only the trailer itself is checked.
+ */
+bool mgos_boot_img_find_trailer(struct mgos_vfs_dev *dev, size_t max_len,
+                                struct mgos_boot_img_trailer *t,
+                                uint32_t *img_len);
+
+/*
+ * Find extension record of the given type in the image of img_len bytes
+ * at the start of the device. Returns offset and length of record data.
+ * Note that integrity of the image is not checked.
+ */
+bool mgos_boot_img_find_ext(struct mgos_vfs_dev *dev, uint32_t img_len,
+                            uint16_t type, uint32_t *offset, uint32_t *len);
+
+/* Same, for the image in memory (a mapped slot). */
+bool mgos_boot_img_find_ext_mapped(const void *img, uint32_t img_len,
+                                   uint16_t type, uint32_t *offset,
+                                   uint32_t *len);
+
+/*
+ * Find the relocation table of the image of img_len bytes at the start of
+ * the device. Returns the link address, offset of the table and number of
+ * entries in it.
+ */
+bool mgos_boot_img_get_reloc(struct mgos_vfs_dev *dev, uint32_t img_len,
+                             uint32_t *org, uint32_t *offset, uint32_t *num);
+
+/*
+ * Determine length and CRC32 of the image in a slot.
+ * If there is no valid trailer, the whole device is assumed to be the image.
+ */
+bool mgos_boot_img_get_info(struct mgos_vfs_dev *dev, uint32_t *app_len,
+                            uint32_t *app_crc32);
+
+#ifdef __cplusplus
+}
+#endif
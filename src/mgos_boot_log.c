@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_log.h"
+
+#include <string.h>
+
+#include "mgos_utils.h"
+
+#include "mgos_boot_hal.h"
+
+static bool log_is_valid(const struct mgos_boot_log *log) {
+  return (log->magic == MGOS_BOOT_LOG_MAGIC && log->size > 0);
+}
+
+#if MGOS_BOOT_LOG_RING_SIZE > 0
+/* Header followed by the buffer, word-aligned. */
+static uint32_t s_log_mem[(sizeof(struct mgos_boot_log) +
+                           MGOS_BOOT_LOG_RING_SIZE + 3) / 4]
+#if MGOS_BOOT_STATE_SECTION
+    __attribute__((section(".boot_state.log")))
+#endif
+    ;
+
+#define LOG ((struct mgos_boot_log *) s_log_mem)
+
+/*
+ * The ring is not initialized at startup and may hold a valid looking log
+ * left by an earlier boot (or garbage), it's only used once set up.
+ */
+static bool s_log_inited = false;
+
+void mgos_boot_log_init(void) {
+  memset(s_log_mem, 0, sizeof(s_log_mem));
+  LOG->magic = MGOS_BOOT_LOG_MAGIC;
+  LOG->size = MGOS_BOOT_LOG_RING_SIZE;
+  s_log_inited = true;
+}
+
+const struct mgos_boot_log *mgos_boot_log_get(void) {
+  return LOG;
+}
+
+void mgos_boot_dbg_putc(char c) {
+  struct mgos_boot_log *log = LOG;
+  if (s_log_inited) {
+    log->buf[log->len % MGOS_BOOT_LOG_RING_SIZE] = c;
+    log->len++;
+  }
+  /* Until the ring is set up, output goes to the UART regardless. */
+  if (MGOS_BOOT_LOG_UART || !s_log_inited) mgos_boot_dbg_uart_putc(c);
+}
+
+void mgos_boot_log_flush(void) {
+  const struct mgos_boot_log *log = LOG;
+  if (MGOS_BOOT_LOG_UART || !s_log_inited) return;
+  for (uint32_t i = log->len - MIN(log->len, log->size); i != log->len; i++) {
+    mgos_boot_dbg_uart_putc(log->buf[i % log->size]);
+  }
+}
+#else
+void mgos_boot_log_init(void) {
+}
+
+const struct mgos_boot_log *mgos_boot_log_get(void) {
+  return NULL;
+}
+
+void mgos_boot_dbg_putc(char c) {
+  mgos_boot_dbg_uart_putc(c);
+}
+
+void mgos_boot_log_flush(void) {
+}
+#endif
+
+size_t mgos_boot_log_read(const struct mgos_boot_log *log, char *buf,
+                          size_t len) {
+  if (log == NULL || !log_is_valid(log)) return 0;
+  uint32_t n = MIN(MIN(log->len, log->size), len), pos = log->len - n;
+  for (uint32_t i = 0; i < n; i++) {
+    buf[i] = log->buf[(pos + i) % log->size];
+  }
+  return n;
+}
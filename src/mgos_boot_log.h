@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Loader log. All debug output (mgos_boot_dbg_putc) goes to a RAM ring,
+ * which is handed to the app in the boot state area (see
+ * mgos_boot_state_area.h), and, unless MGOS_BOOT_LOG_UART is 0, to the
+ * debug UART. UART output is synchronous, so at 115200 it costs about
+ * 87 us per character; with MGOS_BOOT_LOG_UART set to 0 the loader does
+ * not wait for the UART at all, except when it fails to boot, in which
+ * case the ring is written out.
+ *
+ * Messages are emitted with MGOS_BOOT_LOG, those above
+ * MGOS_BOOT_LOG_LEVEL are compiled out.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/cs_dbg.h"
+
+#include "mgos_boot_dbg.h"
+
+/*
+ * Levels are the usual LL_*: LL_INFO is boot decisions and copies,
+ * LL_DEBUG adds config dumps, checksums and progress.
+ */
+#ifndef MGOS_BOOT_LOG_LEVEL
+#define MGOS_BOOT_LOG_LEVEL LL_DEBUG
+#endif
+
+/* Send output to the debug UART as well. */
+#ifndef MGOS_BOOT_LOG_UART
+#define MGOS_BOOT_LOG_UART 1
+#endif
+
+/* Size of the RAM ring, 0 to disable. */
+#ifndef MGOS_BOOT_LOG_RING_SIZE
+#define MGOS_BOOT_LOG_RING_SIZE 2048
+#endif
+
+#define MGOS_BOOT_LOG_MAGIC 0x474c424d /* "MBLG" */
+
+/* Usage: MGOS_BOOT_LOG(LL_INFO, ("fmt", args...)); */
+#define MGOS_BOOT_LOG(l, x)           \
+  do {                                \
+    if ((l) <= MGOS_BOOT_LOG_LEVEL) { \
+      mgos_boot_dbg_printf x;         \
+    }                                 \
+  } while (0)
+
+/* Argument for mgos_boot_cfg_write. */
+#define MGOS_BOOT_LOG_CFG_DUMP (MGOS_BOOT_LOG_LEVEL >= LL_DEBUG)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_boot_log {
+  uint32_t magic;
+  uint32_t size; /* Of buf. */
+  /* Total characters written, buf contains the last size of them. */
+  uint32_t len;
+  char buf[];
+};
+
+/* Start a new log. Output before this point only goes to the UART. */
+void mgos_boot_log_init(void);
+
+/* Write out the ring to the UART, if it was not being sent there. */
+void mgos_boot_log_flush(void);
+
+/* Pointer to the log, NULL if the ring is disabled. */
+const struct mgos_boot_log *mgos_boot_log_get(void);
+
+/*
+ * Copy contents of the log (oldest first) to buf, for the app side.
+ * Returns the number of characters copied, 0 if log is not valid.
+ */
+size_t mgos_boot_log_read(const struct mgos_boot_log *log, char *buf,
+                          size_t len);
+
+#ifdef __cplusplus
+}
+#endif
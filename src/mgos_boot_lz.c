@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_lz.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos_boot_log.h"
+
+bool mgos_boot_lz_read_hdr(struct mgos_boot_stream *in,
+                           struct mgos_boot_lz_hdr *hdr) {
+  if (!in->read(in, hdr, sizeof(*hdr))) return false;
+  if (hdr->magic != MGOS_BOOT_LZ_MAGIC) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: not compressed\n", in->name));
+    return false;
+  }
+  if (hdr->window_bits < 4 ||
+      hdr->window_bits > MGOS_BOOT_LZ_MAX_WINDOW_BITS ||
+      hdr->lookahead_bits < 3 || hdr->lookahead_bits >= hdr->window_bits) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: unsupported params (%d %d)\n", in->name,
+                             hdr->window_bits, hdr->lookahead_bits));
+    return false;
+  }
+  return true;
+}
+
+/* Returns the value or -1 on error. */
+static int lz_get_bits(struct mgos_boot_lz_stream *ls, int n) {
+  int v = 0;
+  while (n-- > 0) {
+    if (ls->bit_mask == 0) {
+      if (!ls->in->read(ls->in, &ls->bits, 1)) return -1;
+      ls->bit_mask = 0x80;
+    }
+    v = (v << 1) | ((ls->bits & ls->bit_mask) ? 1 : 0);
+    ls->bit_mask >>= 1;
+  }
+  return v;
+}
+
+static bool lz_stream_read(struct mgos_boot_stream *s, void *buf,
+                           size_t len) {
+  struct mgos_boot_lz_stream *ls = (struct mgos_boot_lz_stream *) s;
+  const uint32_t mask = (1U << ls->hdr.window_bits) - 1;
+  uint8_t *p = (uint8_t *) buf;
+  while (len > 0) {
+    uint8_t c;
+    if (ls->ref_len > 0) {
+      c = ls->window[(ls->out_pos - ls->ref_off) & mask];
+      ls->ref_len--;
+    } else {
+      int tag = lz_get_bits(ls, 1);
+      if (tag < 0) return false;
+      if (tag) {
+        int v = lz_get_bits(ls, 8);
+        if (v < 0) return false;
+        c = (uint8_t) v;
+      } else {
+        int off = lz_get_bits(ls, ls->hdr.window_bits);
+        int cnt = lz_get_bits(ls, ls->hdr.lookahead_bits);
+        if (off < 0 || cnt < 0) return false;
+        if ((uint32_t) off >= ls->out_pos) {
+          MGOS_BOOT_LOG(LL_ERROR, ("Invalid backref @ %lu\n",
+                                   (unsigned long) ls->out_pos));
+          return false;
+        }
+        ls->ref_off = off + 1;
+        ls->ref_len = cnt + 1;
+        continue;
+      }
+    }
+    ls->window[ls->out_pos & mask] = c;
+    ls->out_pos++;
+    *p++ = c;
+    len--;
+  }
+  return true;
+}
+
+bool mgos_boot_lz_stream_init(struct mgos_boot_lz_stream *ls,
+                              struct mgos_boot_stream *in,
+                              const struct mgos_boot_lz_hdr *hdr) {
+  memset(ls, 0, sizeof(*ls));
+  ls->s.name = in->name;
+  ls->s.read = lz_stream_read;
+  ls->in = in;
+  ls->hdr = *hdr;
+  ls->window = (uint8_t *) malloc(1U << hdr->window_bits);
+  if (ls->window == NULL) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: no memory for window\n", in->name));
+    return false;
+  }
+  return true;
+}
+
+void mgos_boot_lz_stream_deinit(struct mgos_boot_lz_stream *ls) {
+  free(ls->window);
+  ls->window = NULL;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compressed images. A slot with MGOS_BOOT_APP_F_LZ set in app_flags
+ * contains an image (or a patch, see mgos_boot_delta.h) compressed with
+ * LZSS, decompressed while copying. Compressed data is produced by
+ * tools/mgos_boot_img.py.
+ *
+ * Format: struct mgos_boot_lz_hdr followed by a heatshrink-compatible
+ * bit stream (MSB first):
+ *   1, 8 bits                 - literal byte.
+ *   0, W bits off, L bits len - copy len + 1 bytes from off + 1 bytes back.
+ * where W and L are window_bits and lookahead_bits from the header.
+ * Decompression needs a window of 2^W bytes, allocated from the heap for
+ * the duration of the copy.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_boot_stream.h"
+
+#define MGOS_BOOT_LZ_MAGIC 0x5a4c474d /* "MGLZ" */
+
+/* Largest window supported by the decompressor, determines RAM usage. */
+#ifndef MGOS_BOOT_LZ_MAX_WINDOW_BITS
+#define MGOS_BOOT_LZ_MAX_WINDOW_BITS 11
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_boot_lz_hdr {
+  uint32_t magic;
+  uint32_t out_len;
+  uint32_t out_crc32;
+  uint8_t window_bits;
+  uint8_t lookahead_bits;
+  uint16_t reserved;
+  /* Slot app_flags for the decompressed data, i.e. MGOS_BOOT_APP_F_DELTA. */
+  uint32_t flags;
+};
+
+struct mgos_boot_lz_stream {
+  struct mgos_boot_stream s;
+  struct mgos_boot_stream *in;
+  struct mgos_boot_lz_hdr hdr;
+  uint32_t out_pos;
+  /* Bit reader state. */
+  uint8_t bits, bit_mask;
+  /* Back reference being copied. */
+  uint16_t ref_off, ref_len;
+  uint8_t *window;
+};
+
+/* Read and check the header. */
+bool mgos_boot_lz_read_hdr(struct mgos_boot_stream *in,
+                           struct mgos_boot_lz_hdr *hdr);
+
+/*
+ * Set up a stream that produces decompressed data. Returns false if the
+ * window can't be allocated. Must be followed by mgos_boot_lz_stream_deinit.
+ */
+bool mgos_boot_lz_stream_init(struct mgos_boot_lz_stream *ls,
+                              struct mgos_boot_stream *in,
+                              const struct mgos_boot_lz_hdr *hdr);
+
+/* Free the window. Safe to call on a zeroed or already freed stream. */
+void mgos_boot_lz_stream_deinit(struct mgos_boot_lz_stream *ls);
+
+#ifdef __cplusplus
+}
+#endif
@@ -17,8 +17,8 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "common/cs_crc32.h"
 #include "common/str_util.h"
 
 #include "mgos_hal.h"
@@ -27,12 +27,38 @@
 #include "mgos_vfs_dev.h"
 
 #include "mgos_boot_cfg.h"
-#include "mgos_boot_dbg.h"
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_delta.h"
 #include "mgos_boot_hal.h"
+#include "mgos_boot_hot.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_lz.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_plan.h"
+#include "mgos_boot_recover.h"
+#include "mgos_boot_stream.h"
+#include "mgos_boot_swap.h"
+#include "mgos_boot_trace.h"
+#include "mgos_boot_warm.h"
+#include "mgos_boot_xcfg.h"
 
-/* This size is chosen to suit AES alignment and size and also
- * to match NAND flash page size. */
-#define STM32_BOOT_IO_SIZE 2048
+/*
+ * I/O chunk size limits. Minimum is chosen to suit AES alignment and size
+ * and also to match NAND flash page size, chunks are always a power of two
+ * multiple of it. Larger chunks mean fewer driver calls and less per-chunk
+ * overhead, size is chosen per operation, see io_chunk_size.
+ */
+#ifndef MGOS_BOOT_IO_MIN_SIZE
+#define MGOS_BOOT_IO_MIN_SIZE 2048
+#endif
+#ifndef MGOS_BOOT_IO_MAX_SIZE
+#define MGOS_BOOT_IO_MAX_SIZE 16384
+#endif
+/* Heap that must remain available after allocating I/O buffers. */
+#ifndef MGOS_BOOT_IO_HEAP_RESERVE
+#define MGOS_BOOT_IO_HEAP_RESERVE 8192
+#endif
 
 extern const char *build_version, *build_id;
 
@@ -56,96 +82,1047 @@ void mgos_unlock(void) __attribute__((alias("mgos_ints_enable")));
 
 extern bool mgos_root_devtab_init(void);
 
-static uint8_t io_buf[STM32_BOOT_IO_SIZE];
+/* Two buffers, so that next chunk can be read while current one is
+ * being written. Allocated from heap on first use. */
+static uint8_t *io_bufs[2];
+static size_t s_io_buf_size = 0;
 
 void mgos_usleep(uint32_t usecs) {
   (*mgos_nsleep100)(usecs * 10);
 }
 
-uint32_t mgos_boot_checksum(struct mgos_vfs_dev *src, size_t len) {
-  bool res = false;
-  size_t l = 0;
-  uint32_t offset = 0, crc32 = 0;
-  mgos_boot_dbg_printf("Checksum %s (%lu): ", src->name, (unsigned long) len);
+/* Default implementations: no async I/O, everything is synchronous. */
+bool __attribute__((weak))
+mgos_boot_dev_read_async(struct mgos_vfs_dev *dev, size_t offset, size_t len,
+                         void *dst) {
+  (void) dev;
+  (void) offset;
+  (void) len;
+  (void) dst;
+  return false;
+}
+
+bool __attribute__((weak))
+mgos_boot_dev_erase_async(struct mgos_vfs_dev *dev, size_t offset,
+                          size_t len) {
+  (void) dev;
+  (void) offset;
+  (void) len;
+  return false;
+}
+
+enum mgos_vfs_dev_err __attribute__((weak))
+mgos_boot_dev_wait(struct mgos_vfs_dev *dev) {
+  (void) dev;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+bool __attribute__((weak))
+mgos_boot_dev_get_sector(struct mgos_vfs_dev *dev, size_t offset,
+                         size_t *start, size_t *size) {
+  size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  mgos_vfs_dev_get_erase_sizes(dev, erase_sizes);
+  if (erase_sizes[0] == 0) return false;
+  *start = offset - offset % erase_sizes[0];
+  *size = erase_sizes[0];
+  return true;
+}
+
+bool __attribute__((weak))
+mgos_boot_dev_can_overwrite(struct mgos_vfs_dev *dev) {
+  (void) dev;
+  return false;
+}
+
+size_t __attribute__((weak))
+mgos_boot_dev_get_write_size(struct mgos_vfs_dev *dev) {
+  (void) dev;
+  return 16;
+}
+
+const void *__attribute__((weak)) mgos_boot_dev_map(struct mgos_vfs_dev *dev) {
+  (void) dev;
+  return NULL;
+}
+
+/*
+ * Largest buffers that leave the reserve available. Minimum size buffers
+ * are taken regardless of the reserve, fails only if even these can't be
+ * allocated.
+ */
+static bool io_bufs_init(void) {
+  if (s_io_buf_size != 0) return true;
+  for (size_t size = MGOS_BOOT_IO_MAX_SIZE; size >= MGOS_BOOT_IO_MIN_SIZE;
+       size /= 2) {
+    uint8_t *p = (uint8_t *) malloc(2 * size);
+    void *reserve = NULL;
+    if (size > MGOS_BOOT_IO_MIN_SIZE) {
+      reserve = malloc(MGOS_BOOT_IO_HEAP_RESERVE);
+      free(reserve);
+    }
+    if (p != NULL && (reserve != NULL || size == MGOS_BOOT_IO_MIN_SIZE)) {
+      io_bufs[0] = p;
+      io_bufs[1] = p + size;
+      s_io_buf_size = size;
+      return true;
+    }
+    free(p);
+  }
+  MGOS_BOOT_LOG(LL_ERROR, ("Not enough memory for I/O buffers\n"));
+  return false;
+}
+
+/*
+ * Chunk size for transfer to dst (NULL if data is only read): as large as
+ * buffers allow, but not larger than the erase sector of dst, so that
+ * sectors consist of whole chunks. 0 if there are no buffers.
+ */
+static size_t io_chunk_size(struct mgos_vfs_dev *dst) {
+  size_t size, erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  if (!io_bufs_init()) return 0;
+  size = s_io_buf_size;
+  if (dst != NULL) mgos_vfs_dev_get_erase_sizes(dst, erase_sizes);
+  while (size > MGOS_BOOT_IO_MIN_SIZE && erase_sizes[0] != 0 &&
+         (size > erase_sizes[0] || erase_sizes[0] % size != 0)) {
+    size /= 2;
+  }
+  return size;
+}
+
+/* Start reading a chunk: in the background if the device supports it,
+ * otherwise right away. Result is collected by io_read_finish. */
+static enum mgos_vfs_dev_err io_read_start(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len,
+                                           void *buf, bool *pending) {
+  *pending = mgos_boot_dev_read_async(dev, offset, len, buf);
+  if (*pending) return MGOS_VFS_DEV_ERR_NONE;
+  return mgos_vfs_dev_read(dev, offset, len, buf);
+}
+
+static enum mgos_vfs_dev_err io_read_finish(struct mgos_vfs_dev *dev,
+                                            enum mgos_vfs_dev_err r,
+                                            bool *pending) {
+  if (!*pending) return r;
+  *pending = false;
+  return mgos_boot_dev_wait(dev);
+}
+
+/* Called every 64K of data processed. */
+static void io_progress(void) {
+  if (MGOS_BOOT_LOG_LEVEL >= LL_DEBUG) mgos_boot_dbg_putc('.');
+  /* Time source may be a counter that wraps, see mgos_boot_time_us. */
+  mgos_boot_time_us();
+}
+
+/* Continue crc32 over len bytes at offset. Returns 0 on error. */
+static uint32_t checksum_range(struct mgos_vfs_dev *src, size_t offset,
+                               size_t len, uint32_t crc32) {
+  bool res = false, rd_pending = false;
+  size_t l = 0, io_len = io_chunk_size(NULL);
+  int bi = 0;
+  enum mgos_vfs_dev_err r = MGOS_VFS_DEV_ERR_NONE;
+  struct mgos_boot_trace_span sp;
+  /* If the device is mapped, data is processed in place. */
+  const uint8_t *map = (const uint8_t *) mgos_boot_dev_map(src);
+  if (io_len == 0) return 0;
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_CHECKSUM, src->name);
+  MGOS_BOOT_LOG(LL_DEBUG, ("Checksum %s (%lu): ", src->name,
+                           (unsigned long) len));
+  if (map == NULL) {
+    r = io_read_start(src, offset, MIN(len, io_len), io_bufs[bi],
+                     &rd_pending);
+  }
   while (l < len) {
-    size_t io_len = sizeof(io_buf);
+    const uint8_t *data = io_bufs[bi];
     size_t data_len = MIN(len - l, io_len);
-    /* Always read in fixed size chunks. */
-    enum mgos_vfs_dev_err r = mgos_vfs_dev_read(src, offset, io_len, io_buf);
-    if (r != 0) {
-      crc32 = 0;
-      mgos_boot_dbg_printf("Read err %s @ %lu: %d\n", src->name,
-                           (unsigned long) offset, r);
-      goto out;
+    if (map != NULL) {
+      data = map + offset;
+    } else {
+      r = io_read_finish(src, r, &rd_pending);
+      if (r != 0) {
+        crc32 = 0;
+        MGOS_BOOT_LOG(LL_ERROR, ("Read err %s @ %lu: %d\n", src->name,
+                                 (unsigned long) offset, r));
+        goto out;
+      }
+      /* Read ahead while we are crunching this chunk. */
+      if (l + data_len < len) {
+        r = io_read_start(src, offset + data_len,
+                          MIN(len - l - data_len, io_len), io_bufs[bi ^ 1],
+                          &rd_pending);
+      }
     }
-    crc32 = cs_crc32(crc32, io_buf, data_len);
+    crc32 = mgos_boot_crc32(crc32, data, data_len);
     mgos_wdt_feed();
     offset += data_len;
     l += data_len;
-    if (l % 65536 == 0) mgos_boot_dbg_putc('.');
+    bi ^= 1;
+    if (l % 65536 == 0) io_progress();
   }
   res = true;
 out:
-  if (res) mgos_boot_dbg_printf(" 0x%08lx\n", (unsigned long) crc32);
+  if (rd_pending) mgos_boot_dev_wait(src);
+  if (res) MGOS_BOOT_LOG(LL_DEBUG, (" 0x%08lx\n", (unsigned long) crc32));
+  mgos_boot_trace_end(&sp, l);
   return crc32;
 }
 
-bool mgos_boot_copy_dev(struct mgos_vfs_dev *src, struct mgos_vfs_dev *dst,
-                        size_t len) {
-  bool res = false;
-  size_t l = 0;
-  uint32_t offset = 0, erased_until = 0;
-  mgos_boot_dbg_printf("%s --> %s (%lu): ", src->name, dst->name,
-                       (unsigned long) len);
+uint32_t mgos_boot_checksum(struct mgos_vfs_dev *src, size_t len) {
+  return checksum_range(src, 0, len, 0);
+}
+
+/*
+ * Compare-before-write. Before copying from a device, contents of each
+ * destination sector are compared with the data to be written. Sectors that
+ * already match are skipped, those that can be programmed without erase
+ * (erased chunks or, if the device allows, only 1 -> 0 changes) are not
+ * erased. State is kept per I/O chunk, chunks past the first one that needs
+ * erase in a sector are not examined.
+ */
+#ifndef MGOS_BOOT_COPY_COMPARE
+#define MGOS_BOOT_COPY_COMPARE 1
+#endif
+#define MGOS_BOOT_COPY_MAX_CHUNKS 1024
+
+enum copy_chunk_state {
+  COPY_CHUNK_WRITE = 0, /* Needs erase and write, or not examined. */
+  COPY_CHUNK_PROG = 1,  /* Can be programmed without erase. */
+  COPY_CHUNK_SAME = 2,  /* Already contains the data. */
+};
+
+/* 2 bits per chunk. */
+static uint8_t s_chunk_states[MGOS_BOOT_COPY_MAX_CHUNKS / 4];
+
+static enum copy_chunk_state copy_get_chunk_state(size_t i) {
+  return (enum copy_chunk_state)((s_chunk_states[i / 4] >> ((i % 4) * 2)) & 3);
+}
+
+static void copy_set_chunk_state(size_t i, enum copy_chunk_state st) {
+  s_chunk_states[i / 4] &= ~(3 << ((i % 4) * 2));
+  s_chunk_states[i / 4] |= (st << ((i % 4) * 2));
+}
+
+/* Destination sector and the least favorable state of its chunks. */
+struct copy_unit {
+  size_t start, end;
+  enum copy_chunk_state state;
+};
+
+/* Copy destination starts at base and ends at end, offset is absolute. */
+static bool copy_get_unit(struct mgos_vfs_dev *dst, size_t base, size_t end,
+                          size_t offset, size_t io_len, struct copy_unit *u) {
+  size_t start, size;
+  if (!mgos_boot_dev_get_sector(dst, offset, &start, &size)) return false;
+  /* Sectors must consist of whole chunks. */
+  if (start < base || (start - base) % io_len != 0 || size % io_len != 0) {
+    return false;
+  }
+  u->start = start;
+  u->end = start + size;
+  u->state = COPY_CHUNK_SAME;
+  for (size_t o = start; o < u->end && o < end; o += io_len) {
+    enum copy_chunk_state st = copy_get_chunk_state((o - base) / io_len);
+    if (st < u->state) u->state = st;
+  }
+  return true;
+}
+
+/* Source data is data_len bytes, the rest of the chunk is padded with 0xff,
+ * the same way it is written. */
+static bool copy_compare_chunk(struct mgos_vfs_dev *src, size_t src_offset,
+                               struct mgos_vfs_dev *dst, size_t dst_offset,
+                               size_t data_len, size_t io_len, bool overwrite,
+                               enum copy_chunk_state *st) {
+  const uint8_t *sp = io_bufs[0], *dp = io_bufs[1];
+  bool same = true, erased = true, prog = overwrite;
+  if (mgos_vfs_dev_read(src, src_offset, data_len, io_bufs[0]) != 0 ||
+      mgos_vfs_dev_read(dst, dst_offset, io_len, io_bufs[1]) != 0) {
+    return false;
+  }
+  memset(io_bufs[0] + data_len, 0xff, io_len - data_len);
+  for (size_t i = 0; i < io_len; i++) {
+    same &= (sp[i] == dp[i]);
+    erased &= (dp[i] == 0xff);
+    prog &= ((sp[i] & dp[i]) == sp[i]);
+  }
+  if (same) {
+    *st = COPY_CHUNK_SAME;
+  } else if (erased || prog) {
+    *st = COPY_CHUNK_PROG;
+  } else {
+    *st = COPY_CHUNK_WRITE;
+  }
+  return true;
+}
+
+/* Returns false if comparison is not possible, everything will be written. */
+static bool copy_compare(struct mgos_vfs_dev *src, size_t src_off,
+                         struct mgos_vfs_dev *dst, size_t dst_off, size_t len,
+                         size_t io_len) {
+  int num_units = 0, num_same = 0, num_prog = 0;
+  bool overwrite = mgos_boot_dev_can_overwrite(dst);
+  size_t offset = dst_off, end = dst_off + len;
+  if (!MGOS_BOOT_COPY_COMPARE || len > MGOS_BOOT_COPY_MAX_CHUNKS * io_len) {
+    return false;
+  }
+  memset(s_chunk_states, 0, sizeof(s_chunk_states));
+  while (offset < end) {
+    struct copy_unit u;
+    if (!copy_get_unit(dst, dst_off, end, offset, io_len, &u) ||
+        u.start != offset) {
+      return false;
+    }
+    u.state = COPY_CHUNK_SAME;
+    for (size_t o = u.start; o < u.end && o < end; o += io_len) {
+      enum copy_chunk_state st;
+      if (!copy_compare_chunk(src, src_off + (o - dst_off), dst, o,
+                              MIN(end - o, io_len), io_len, overwrite, &st)) {
+        return false;
+      }
+      copy_set_chunk_state((o - dst_off) / io_len, st);
+      if (st < u.state) u.state = st;
+      if (st == COPY_CHUNK_WRITE) break;
+    }
+    num_units++;
+    if (u.state == COPY_CHUNK_SAME) num_same++;
+    if (u.state == COPY_CHUNK_PROG) num_prog++;
+    offset = u.end;
+    mgos_wdt_feed();
+  }
+  MGOS_BOOT_LOG(LL_INFO, ("%d/%d sectors same, %d w/o erase; ", num_same,
+                          num_units, num_prog));
+  return true;
+}
+
+/*
+ * Erase plan: ranges of sectors of the destination that need erasing.
+ * Sectors that are already blank (or, when comparing, don't need erase)
+ * are skipped. Sectors erased in advance (see mgos_boot_xcfg_erased) are
+ * only spot-checked: MGOS_BOOT_COPY_SPOT_CHECK_SIZE bytes at the start
+ * and the end. Ranges are erased in the largest naturally aligned
+ * operations the device supports. Plan is computed up-front for as many
+ * ranges as fit and extended as the copy goes.
+ */
+#define MGOS_BOOT_COPY_MAX_ERASE_RANGES 16
+#define MGOS_BOOT_COPY_SPOT_CHECK_SIZE 64
+
+struct copy_erase_ctx {
+  struct mgos_vfs_dev *dev;
+  size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES];
+  /* Multi-sector erase failed, only erase individual sectors. */
+  bool no_blocks;
+  /* Use compare results instead of blank check. */
+  bool cmp;
+  size_t base, end, io_len;
+  /* Erased in advance. */
+  size_t erased_start, erased_end;
+  struct {
+    size_t start, end;
+  } ranges[MGOS_BOOT_COPY_MAX_ERASE_RANGES];
+  int num_ranges, cur_range;
+  size_t planned_until;
+  /* Erase running in the background, if any. */
+  bool pending;
+  size_t pending_size;
+  int num_skipped;
+};
+
+static bool copy_is_blank(struct mgos_vfs_dev *dev, size_t offset,
+                          size_t len) {
+  uint32_t buf[32];
+  while (len > 0) {
+    size_t n = MIN(len, sizeof(buf));
+    if (mgos_vfs_dev_read(dev, offset, n, buf) != 0) return false;
+    for (size_t i = 0; i < n / sizeof(buf[0]); i++) {
+      if (buf[i] != 0xffffffff) return false;
+    }
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* A few bytes at both ends of a sector that is supposed to be erased. */
+static bool copy_spot_check(struct mgos_vfs_dev *dev, size_t offset,
+                            size_t len) {
+  size_t n = MIN(len, MGOS_BOOT_COPY_SPOT_CHECK_SIZE);
+  return (copy_is_blank(dev, offset, n) &&
+          copy_is_blank(dev, offset + len - n, n));
+}
+
+static bool copy_erase_plan(struct copy_erase_ctx *ec) {
+  ec->num_ranges = ec->cur_range = 0;
+  while (ec->planned_until < ec->end) {
+    size_t start, size;
+    bool need_erase;
+    if (!mgos_boot_dev_get_sector(ec->dev, ec->planned_until, &start,
+                                  &size) ||
+        start != ec->planned_until) {
+      MGOS_BOOT_LOG(LL_ERROR, ("%s: no sector @ %lu\n", ec->dev->name,
+                               (unsigned long) ec->planned_until));
+      return false;
+    }
+    if (ec->cmp) {
+      struct copy_unit u;
+      need_erase = (!copy_get_unit(ec->dev, ec->base, ec->end, start,
+                                   ec->io_len, &u) ||
+                    u.state == COPY_CHUNK_WRITE);
+    } else if (start >= ec->erased_start && start + size <= ec->erased_end &&
+               copy_spot_check(ec->dev, start, size)) {
+      need_erase = false;
+    } else {
+      need_erase = !copy_is_blank(ec->dev, start, size);
+    }
+    if (!need_erase) {
+      ec->num_skipped++;
+    } else if (ec->num_ranges > 0 &&
+               ec->ranges[ec->num_ranges - 1].end == start) {
+      ec->ranges[ec->num_ranges - 1].end = start + size;
+    } else if (ec->num_ranges < (int) ARRAY_SIZE(ec->ranges)) {
+      ec->ranges[ec->num_ranges].start = start;
+      ec->ranges[ec->num_ranges].end = start + size;
+      ec->num_ranges++;
+    } else {
+      break;
+    }
+    ec->planned_until = start + size;
+  }
+  return true;
+}
+
+static bool copy_erase_init(struct copy_erase_ctx *ec,
+                            struct mgos_vfs_dev *dev, size_t offset,
+                            size_t len, size_t io_len, bool cmp,
+                            const struct mgos_boot_xcfg_erased *erased) {
+  memset(ec, 0, sizeof(*ec));
+  ec->dev = dev;
+  ec->base = ec->planned_until = offset;
+  ec->end = offset + len;
+  ec->io_len = io_len;
+  ec->cmp = cmp;
+  if (erased != NULL) {
+    ec->erased_start = erased->offset;
+    ec->erased_end = erased->offset + erased->len;
+  }
+  mgos_vfs_dev_get_erase_sizes(dev, ec->erase_sizes);
+  return copy_erase_plan(ec);
+}
+
+/* Start of the next range to erase, (size_t) -1 if there's nothing left. */
+static bool copy_erase_next(struct copy_erase_ctx *ec, size_t *start) {
+  *start = (size_t) -1;
+  if (ec->cur_range == ec->num_ranges && ec->planned_until < ec->end) {
+    if (!copy_erase_plan(ec)) return false;
+  }
+  if (ec->cur_range < ec->num_ranges) {
+    *start = ec->ranges[ec->cur_range].start;
+  }
+  return true;
+}
+
+/*
+ * Size of the next erase: the sector or the largest naturally aligned
+ * block of whole sectors that is within the range.
+ */
+static size_t copy_erase_next_size(struct copy_erase_ctx *ec) {
+  size_t start = ec->ranges[ec->cur_range].start;
+  size_t end = ec->ranges[ec->cur_range].end, res = 0, ss, bs;
+  if (!mgos_boot_dev_get_sector(ec->dev, start, &ss, &res)) return 0;
+  for (int i = 0; i < (int) ARRAY_SIZE(ec->erase_sizes) && !ec->no_blocks;
+       i++) {
+    size_t size = ec->erase_sizes[i], ls;
+    if (size <= res || start % size != 0 || start + size > end) continue;
+    if (!mgos_boot_dev_get_sector(ec->dev, start + size - 1, &ls, &bs) ||
+        ls + bs != start + size) {
+      continue;
+    }
+    res = size;
+  }
+  return res;
+}
+
+static void copy_erase_advance(struct copy_erase_ctx *ec, size_t size) {
+  mgos_boot_trace_io(0, size);
+  ec->ranges[ec->cur_range].start += size;
+  if (ec->ranges[ec->cur_range].start >= ec->ranges[ec->cur_range].end) {
+    ec->cur_range++;
+  }
+}
+
+/* Wait for the background erase to complete, if any. */
+static void copy_erase_finish(struct copy_erase_ctx *ec) {
+  if (!ec->pending) return;
+  ec->pending = false;
+  if (mgos_boot_dev_wait(ec->dev) == 0) {
+    copy_erase_advance(ec, ec->pending_size);
+  }
+  /* If it failed, synchronous erase will retry and report the error. */
+}
+
+/* Make sure the device is erased up to the specified offset. */
+static bool copy_erase(struct copy_erase_ctx *ec, size_t until) {
+  size_t start;
+  copy_erase_finish(ec);
+  while (true) {
+    if (!copy_erase_next(ec, &start)) return false;
+    if (start >= until) break;
+    size_t size = copy_erase_next_size(ec), ss, sector_size = 0;
+    enum mgos_vfs_dev_err r = mgos_vfs_dev_erase(ec->dev, start, size);
+    mgos_boot_dev_get_sector(ec->dev, start, &ss, &sector_size);
+    if (r != 0 && size > sector_size) {
+      /* Block is not aligned on the chip, perhaps. Fall back to sectors. */
+      ec->no_blocks = true;
+      size = sector_size;
+      r = mgos_vfs_dev_erase(ec->dev, start, size);
+    }
+    if (r != 0 || size == 0) {
+      MGOS_BOOT_LOG(LL_ERROR, ("Erase err %s @ %lu: %d\n", ec->dev->name,
+                               (unsigned long) start, r));
+      return false;
+    }
+    copy_erase_advance(ec, size);
+  }
+  return true;
+}
+
+/* Start erasing ahead in the background, if the device can do that. */
+static void copy_erase_ahead(struct copy_erase_ctx *ec, size_t until) {
+  size_t start;
+  if (ec->pending || !copy_erase_next(ec, &start) || start >= until) return;
+  ec->pending_size = copy_erase_next_size(ec);
+  if (ec->pending_size == 0) return;
+  ec->pending = mgos_boot_dev_erase_async(ec->dev, start, ec->pending_size);
+}
+
+/*
+ * Copies of the app record checkpoints in the xcfg journal: offset and
+ * checksum of the data before it, at sector boundaries, at most every
+ * MGOS_BOOT_COPY_CKPT_INTERVAL bytes. If the copy is interrupted,
+ * the next attempt of the same copy continues from the last checkpoint.
+ */
+#ifndef MGOS_BOOT_COPY_CKPT_INTERVAL
+#define MGOS_BOOT_COPY_CKPT_INTERVAL 65536
+#endif
+
+static bool copy_is_sector_start(struct mgos_vfs_dev *dev, size_t offset) {
+  size_t start, size;
+  return (mgos_boot_dev_get_sector(dev, offset, &start, &size) &&
+          start == offset);
+}
+
+/*
+ * Manifest of the source image, see mgos_boot_img.h. If present, source
+ * data is checked block by block before it's written and the copy is
+ * abandoned at the first bad block, instead of after the whole image has
+ * been written and read back. Checksum of a block is computed as its data
+ * passes through the copy buffers, across chunks.
+ */
+struct copy_manifest {
+  struct mgos_vfs_dev *dev;
+  uint32_t crc_offset; /* Offset of the checksum array on dev. */
+  uint32_t block_size, len;
+  uint32_t offset; /* Data before this offset has been seen. */
+  uint32_t crc32;  /* Of the block that offset is in, up to offset. */
+};
+
+/*
+ * Look for the manifest in the image of img_len bytes on dev. Copy starts
+ * at offset: if that's in the middle of a block, the start of the block is
+ * read now.
+ */
+static bool copy_manifest_init(struct copy_manifest *mf,
+                               struct mgos_vfs_dev *dev, uint32_t img_len,
+                               uint32_t offset) {
+  struct mgos_boot_img_manifest m;
+  uint32_t off, len, start;
+  if (!mgos_boot_img_find_ext(dev, img_len, MGOS_BOOT_IMG_EXT_MANIFEST, &off,
+                              &len) ||
+      len < sizeof(m) || mgos_vfs_dev_read(dev, off, sizeof(m), &m) != 0) {
+    return false;
+  }
+  if (m.block_size == 0 || m.len > img_len ||
+      (len - sizeof(m)) / 4 < (m.len + m.block_size - 1) / m.block_size) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: invalid manifest\n", dev->name));
+    return false;
+  }
+  mf->dev = dev;
+  mf->crc_offset = off + sizeof(m);
+  mf->block_size = m.block_size;
+  mf->len = m.len;
+  mf->offset = offset;
+  mf->crc32 = 0;
+  start = offset - offset % m.block_size;
+  if (offset < m.len && start < offset) {
+    mf->crc32 = checksum_range(dev, start, offset - start, 0);
+  }
+  return true;
+}
+
+/* Fold the len bytes at offset, which are in buf, into block checksums. */
+static bool copy_manifest_check(struct copy_manifest *mf, uint32_t offset,
+                                const uint8_t *buf, size_t len) {
+  if (mf->offset >= mf->len) return true;
+  /* Data comes in order. */
+  if (offset != mf->offset) return false;
+  while (mf->offset < offset + len && mf->offset < mf->len) {
+    uint32_t b = mf->offset / mf->block_size;
+    uint32_t end = MIN((b + 1) * mf->block_size, mf->len);
+    uint32_t n = MIN(end, offset + len) - mf->offset, exp_crc32 = 0;
+    mf->crc32 = mgos_boot_crc32(mf->crc32, buf + (mf->offset - offset), n);
+    mf->offset += n;
+    if (mf->offset < end) break;
+    if (mgos_vfs_dev_read(mf->dev, mf->crc_offset + b * 4, 4, &exp_crc32) !=
+        0) {
+      return false;
+    }
+    if (mf->crc32 != exp_crc32) {
+      MGOS_BOOT_LOG(LL_ERROR, ("%s: block %lu is corrupt\n", mf->dev->name,
+                               (unsigned long) b));
+      return false;
+    }
+    mf->crc32 = 0;
+  }
+  return true;
+}
+
+/*
+ * Relocation of the image being copied, see MGOS_BOOT_IMG_EXT_RELOC.
+ * Words listed in the table are adjusted by the difference between the
+ * destination and the source address. Since the data written differs
+ * from the source, source checksum is computed separately, as it goes.
+ */
+struct copy_reloc {
+  struct mgos_vfs_dev *dev; /* Source, the table is read from it. */
+  uint32_t tab_offset, num;
+  uint32_t next; /* First entry that has not been applied yet. */
+  uint32_t delta;
+  uint32_t src_crc32;
+  /* Entries read ahead. */
+  uint32_t cache[32];
+  uint32_t cache_start, cache_len;
+};
+
+static bool copy_reloc_get(struct copy_reloc *rl, uint32_t i,
+                           uint32_t *offset) {
+  if (i < rl->cache_start || i >= rl->cache_start + rl->cache_len) {
+    uint32_t n = MIN(rl->num - i, ARRAY_SIZE(rl->cache));
+    if (mgos_vfs_dev_read(rl->dev, rl->tab_offset + i * 4, n * 4,
+                          rl->cache) != 0) {
+      return false;
+    }
+    rl->cache_start = i;
+    rl->cache_len = n;
+  }
+  *offset = rl->cache[i - rl->cache_start];
+  return true;
+}
+
+/*
+ * Set up relocation of the image in slot src, if it has a table and needs
+ * it to run from dst. Copy of the image starts at offset. Address the
+ * image was linked at is returned in org, if known.
+ */
+static bool copy_reloc_init(struct copy_reloc *rl,
+                            const struct mgos_boot_cfg *cfg, int src, int dst,
+                            struct mgos_vfs_dev *src_dev, uint32_t offset,
+                            uint32_t *org) {
+  const struct mgos_boot_slot_state *sss = &cfg->slots[src].state;
+  uint32_t map_addr = cfg->slots[dst].cfg.app_map_addr, off = 0;
+  memset(rl, 0, sizeof(*rl));
+  if ((sss->app_flags & (MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ)) ||
+      !mgos_boot_img_get_reloc(src_dev, sss->app_len, org, &rl->tab_offset,
+                               &rl->num) ||
+      map_addr == 0 || map_addr == sss->app_org) {
+    return false;
+  }
+  rl->dev = src_dev;
+  rl->delta = map_addr - sss->app_org;
+  while (rl->next < rl->num && copy_reloc_get(rl, rl->next, &off) &&
+         off < offset) {
+    rl->next++;
+  }
+  if (offset > 0) rl->src_crc32 = checksum_range(src_dev, 0, offset, 0);
+  MGOS_BOOT_LOG(LL_INFO, ("Relocating 0x%lx -> 0x%lx (linked at 0x%lx)\n",
+                          (unsigned long) sss->app_org,
+                          (unsigned long) map_addr, (unsigned long) *org));
+  return true;
+}
+
+/* Relocate len bytes of the image at offset, which are in buf. */
+static bool copy_reloc_apply(struct copy_reloc *rl, uint32_t offset,
+                             uint8_t *buf, size_t len) {
+  uint32_t off, w;
+  rl->src_crc32 = mgos_boot_crc32(rl->src_crc32, buf, len);
+  for (; rl->next < rl->num; rl->next++) {
+    if (!copy_reloc_get(rl, rl->next, &off)) return false;
+    if (off >= offset + len) break;
+    if (off < offset || off % 4 != 0 || off + 4 > offset + len) {
+      MGOS_BOOT_LOG(LL_ERROR, ("%s: invalid relocation %lu\n", rl->dev->name,
+                               (unsigned long) off));
+      return false;
+    }
+    memcpy(&w, buf + (off - offset), sizeof(w));
+    w += rl->delta;
+    memcpy(buf + (off - offset), &w, sizeof(w));
+  }
+  return true;
+}
+
+/*
+ * Optional parts of a copy, for copies of the app:
+ *  - journal: checkpoints are recorded, this requires crc32.
+ *  - mf: device source data is checked against the manifest.
+ *  - erased: range of dst that has been erased in advance.
+ *  - rl: source is relocated.
+ */
+struct copy_opts {
+  bool journal;
+  struct copy_manifest *mf;
+  const struct mgos_boot_xcfg_erased *erased;
+  struct copy_reloc *rl;
+};
+
+/*
+ * The copy is pipelined: while a chunk is being programmed into dst,
+ * the next one is being read from src and once it's written, erase of
+ * the next dst sector is started (if needed), again overlapping with
+ * the read. Devices that don't support async operations are accessed
+ * synchronously, this reduces to the simple read-erase-write loop.
+ * Data comes either from a device (src_dev) or a stream (src_stream),
+ * streams are read synchronously. opts may be NULL.
+ */
+static bool copy_data(struct mgos_vfs_dev *src_dev, size_t src_off,
+                      struct mgos_boot_stream *src_stream,
+                      struct mgos_vfs_dev *dst, size_t dst_off, size_t len,
+                      uint32_t *crc32, const struct copy_opts *opts) {
+  static const struct copy_opts s_no_opts = {.journal = false};
+  const struct mgos_boot_xcfg_erased *erased;
+  struct copy_manifest *mf;
+  struct copy_reloc *rl;
+  bool res = false, rd_pending = false, cmp = false;
+  size_t l = 0, io_len = io_chunk_size(dst), ckpt_offset = dst_off;
+  uint32_t offset = 0;
+  int bi = 0;
+  enum mgos_vfs_dev_err r, rr = MGOS_VFS_DEV_ERR_NONE;
+  struct copy_erase_ctx ec;
+  struct copy_unit u = {.end = 0};
+  struct mgos_boot_trace_span sp;
+  const char *src_name = (src_dev != NULL ? src_dev->name : src_stream->name);
+  const uint8_t *src_map =
+      (src_dev != NULL ? (const uint8_t *) mgos_boot_dev_map(src_dev) : NULL);
+  if (io_len == 0) return false;
+  if (opts == NULL) opts = &s_no_opts;
+  erased = opts->erased;
+  mf = opts->mf;
+  rl = opts->rl;
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_COPY, dst->name);
+  MGOS_BOOT_LOG(LL_INFO, ("%s --> %s (%lu): ", src_name, dst->name,
+                          (unsigned long) len));
+  if (erased != NULL && erased->offset <= dst_off &&
+      erased->offset + erased->len >= dst_off + len) {
+    /* Nothing to compare with. */
+    MGOS_BOOT_LOG(LL_INFO, ("pre-erased; "));
+  } else if (src_dev != NULL && rl == NULL) {
+    cmp = copy_compare(src_dev, src_off, dst, dst_off, len, io_len);
+  }
+  if (!copy_erase_init(&ec, dst, dst_off, len, io_len, cmp, erased)) {
+    mgos_boot_trace_end(&sp, 0);
+    return false;
+  }
+  /* Always write in fixed size chunks, the last one is padded. */
+  if (src_dev != NULL && src_map == NULL) {
+    rr = io_read_start(src_dev, src_off, MIN(len, io_len), io_bufs[bi],
+                       &rd_pending);
+  }
   while (l < len) {
-    enum mgos_vfs_dev_err r;
-    size_t io_len = sizeof(io_buf);
+    uint8_t *buf = io_bufs[bi];
+    size_t dst_offset = dst_off + offset;
     size_t data_len = MIN(len - l, io_len);
-    /* Always read and write in fixed size chunks. */
-    r = mgos_vfs_dev_read(src, offset, io_len, io_buf);
-    if (r != 0) {
-      mgos_boot_dbg_printf("Read err %s @ %lu: %d\n", src->name,
-                           (unsigned long) offset, r);
-      goto out;
+    bool last = (l + data_len >= len);
+    if (src_dev != NULL) {
+      if (src_map != NULL) {
+        /* Still goes through the buffer, see mgos_boot_dev_map. */
+        memcpy(buf, src_map + src_off + offset, data_len);
+        memset(buf + data_len, 0xff, io_len - data_len);
+      } else {
+        rr = io_read_finish(src_dev, rr, &rd_pending);
+        if (rr != 0) {
+          MGOS_BOOT_LOG(LL_ERROR, ("Read err %s @ %lu: %d\n", src_dev->name,
+                                   (unsigned long) (src_off + offset), rr));
+          goto out;
+        }
+        memset(buf + data_len, 0xff, io_len - data_len);
+      }
+      if (mf != NULL &&
+          !copy_manifest_check(mf, src_off + offset, buf, data_len)) {
+        goto out;
+      }
+      if (rl != NULL &&
+          !copy_reloc_apply(rl, src_off + offset, buf, data_len)) {
+        goto out;
+      }
+      if (src_map == NULL && !last) {
+        rr = io_read_start(src_dev, src_off + offset + data_len,
+                           MIN(len - l - data_len, io_len), io_bufs[bi ^ 1],
+                           &rd_pending);
+      }
+    } else {
+      if (!src_stream->read(src_stream, buf, data_len)) goto out;
+      memset(buf + data_len, 0xff, io_len - data_len);
     }
-    if (offset + io_len > erased_until) {
-      int i = 0, j = 0;
-      size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES];
-      mgos_vfs_dev_get_erase_sizes(dst, erase_sizes);
-      /*
-       * Erase is complicated. Devices have different erase sizes and some
-       * (STM32F flash) have non-uniform layout with varying sector size.
-       */
-      while (i < (int) ARRAY_SIZE(erase_sizes) && erase_sizes[i] > 0 &&
-             erase_sizes[i] < len) {
-        j = i++;
+    enum copy_chunk_state st = COPY_CHUNK_WRITE;
+    if (cmp) {
+      if (dst_offset >= u.end &&
+          !copy_get_unit(dst, dst_off, dst_off + len, dst_offset, io_len,
+                         &u)) {
+        goto out;
       }
-      while (j >= 0) {
-        size_t erase_size = erase_sizes[j];
-        if (mgos_vfs_dev_erase(dst, offset, erase_size) == 0) {
-          erased_until = offset + erase_size;
-          break;
-        }
-        j--;
+      /* Chunks of sectors that are erased must all be written. */
+      if (u.state != COPY_CHUNK_WRITE) {
+        st = copy_get_chunk_state(offset / io_len);
       }
     }
-    r = mgos_vfs_dev_write(dst, offset, io_len, io_buf);
-    if (r != 0) {
-      mgos_boot_dbg_printf("Write err %s @ %lu: %d\n", dst->name,
-                           (unsigned long) offset, r);
-      goto out;
+    if (st != COPY_CHUNK_SAME) {
+      if (!copy_erase(&ec, dst_offset + io_len)) goto out;
+      r = mgos_vfs_dev_write(dst, dst_offset, io_len, buf);
+      if (r != 0) {
+        MGOS_BOOT_LOG(LL_ERROR, ("Write err %s @ %lu: %d\n", dst->name,
+                                 (unsigned long) dst_offset, r));
+        goto out;
+      }
+      mgos_boot_trace_io(io_len, 0);
+    }
+    if (crc32 != NULL && st == COPY_CHUNK_SAME) {
+      /* Destination was found to be identical to the source. */
+      *crc32 = mgos_boot_crc32(*crc32, buf, data_len);
+    } else if (crc32 != NULL) {
+      /* Read back what was just written while it's fresh and fold it into
+       * the checksum, this saves a separate verification pass. */
+      r = mgos_vfs_dev_read(dst, dst_offset, io_len, buf);
+      if (r != 0) {
+        MGOS_BOOT_LOG(LL_ERROR, ("Read err %s @ %lu: %d\n", dst->name,
+                                 (unsigned long) dst_offset, r));
+        goto out;
+      }
+      *crc32 = mgos_boot_crc32(*crc32, buf, data_len);
+    }
+    if (opts->journal && !last &&
+        dst_offset + io_len - ckpt_offset >= MGOS_BOOT_COPY_CKPT_INTERVAL &&
+        copy_is_sector_start(dst, dst_offset + io_len)) {
+      /* Everything before this point has been written and read back.
+       * Failure to record is not fatal, the copy just can't resume. */
+      ckpt_offset = dst_offset + io_len;
+      mgos_boot_xcfg_journal_add(ckpt_offset, *crc32);
     }
+    if (!last) copy_erase_ahead(&ec, dst_offset + data_len + io_len);
     mgos_wdt_feed();
     offset += data_len;
     l += data_len;
-    if (l % 65536 == 0) mgos_boot_dbg_putc('.');
+    bi ^= 1;
+    if (l % 65536 == 0) io_progress();
+  }
+  res = true;
+out:
+  if (rd_pending) mgos_boot_dev_wait(src_dev);
+  copy_erase_finish(&ec);
+  if (res) {
+    if (crc32 != NULL) {
+      MGOS_BOOT_LOG(LL_INFO, (" ok 0x%08lx\n", (unsigned long) *crc32));
+    } else {
+      MGOS_BOOT_LOG(LL_INFO, (" ok\n"));
+    }
+  }
+  mgos_boot_trace_end(&sp, l);
+  return res;
+}
+
+bool mgos_boot_copy_dev(struct mgos_vfs_dev *src, struct mgos_vfs_dev *dst,
+                        size_t len, uint32_t *crc32) {
+  return copy_data(src, 0, NULL, dst, 0, len, crc32, NULL);
+}
+
+bool mgos_boot_copy_dev_range(struct mgos_vfs_dev *src, size_t src_off,
+                              struct mgos_vfs_dev *dst, size_t dst_off,
+                              size_t len, uint32_t *crc32) {
+  return copy_data(src, src_off, NULL, dst, dst_off, len, crc32, NULL);
+}
+
+bool mgos_boot_copy_stream(struct mgos_boot_stream *src,
+                           struct mgos_vfs_dev *dst, size_t len,
+                           uint32_t *crc32) {
+  return copy_data(NULL, 0, src, dst, 0, len, crc32, NULL);
+}
+
+/* Find the base image for a patch, in a slot that is not being written. */
+static int find_delta_base(const struct mgos_boot_cfg *cfg, int src, int dst,
+                           const struct mgos_boot_delta_hdr *hdr) {
+  for (int i = 0; i < cfg->num_slots; i++) {
+    const struct mgos_boot_slot *s = &cfg->slots[i];
+    if (i == src || i == dst || !(s->cfg.flags & MGOS_BOOT_SLOT_F_VALID) ||
+        (s->state.app_flags & (MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ))) {
+      continue;
+    }
+    if (s->state.app_len == hdr->base_len &&
+        s->state.app_crc32 == hdr->base_crc32) {
+      return i;
+    }
+  }
+  MGOS_BOOT_LOG(LL_ERROR, ("No base for the patch (%lu 0x%08lx)\n",
+                           (unsigned long) hdr->base_len,
+                           (unsigned long) hdr->base_crc32));
+  return -1;
+}
+
+/* Consume len bytes of the stream. */
+static bool stream_skip(struct mgos_boot_stream *st, size_t len) {
+  while (len > 0) {
+    size_t n = MIN(len, io_chunk_size(NULL));
+    if (n == 0 || !st->read(st, io_bufs[0], n)) return false;
+    len -= n;
+    mgos_wdt_feed();
+  }
+  return true;
+}
+
+/*
+ * Produce the image from a compressed image and/or a patch in slot src
+ * (possibly both: a compressed patch) and write it to dst, starting at
+ * offset (data before it is produced but not written). Range of dst
+ * erased in advance, if not empty, is passed on to copy_data.
+ */
+static bool copy_app_stream(struct mgos_boot_cfg *cfg, int src, int dst,
+                            struct mgos_vfs_dev *src_dev,
+                            struct mgos_vfs_dev *dst_dev, uint32_t offset,
+                            const struct mgos_boot_xcfg_erased *erased,
+                            uint32_t *app_len, uint32_t *app_crc32) {
+  bool res = false;
+  const struct mgos_boot_slot_state *sss = &cfg->slots[src].state;
+  struct mgos_vfs_dev *base_dev = NULL;
+  struct mgos_boot_dev_stream ps;
+  struct mgos_boot_lz_stream ls = {.window = NULL};
+  struct mgos_boot_delta_stream ds;
+  struct mgos_boot_stream *st = &ps.s;
+  struct copy_opts opts = {.journal = true, .erased = erased};
+  uint32_t out_len = 0, out_crc32 = 0;
+  mgos_boot_dev_stream_init(&ps, src_dev, sss->app_len);
+  if (sss->app_flags & MGOS_BOOT_APP_F_LZ) {
+    struct mgos_boot_lz_hdr hdr;
+    if (!mgos_boot_lz_read_hdr(st, &hdr) ||
+        !mgos_boot_lz_stream_init(&ls, st, &hdr)) {
+      goto out;
+    }
+    st = &ls.s;
+    out_len = hdr.out_len;
+    out_crc32 = hdr.out_crc32;
+  }
+  if (sss->app_flags & MGOS_BOOT_APP_F_DELTA) {
+    struct mgos_boot_delta_hdr hdr;
+    int base_slot;
+    if (!mgos_boot_delta_read_hdr(st, &hdr)) goto out;
+    base_slot = find_delta_base(cfg, src, dst, &hdr);
+    if (base_slot < 0) goto out;
+    MGOS_BOOT_LOG(LL_INFO, ("Patch base is in slot %d\n", base_slot));
+    base_dev = mgos_vfs_dev_open(cfg->slots[base_slot].cfg.app_dev);
+    if (base_dev == NULL) goto out;
+    mgos_boot_delta_stream_init(&ds, st, &hdr, base_dev);
+    st = &ds.s;
+    out_len = hdr.out_len;
+    out_crc32 = hdr.out_crc32;
+  }
+  if (offset > out_len || !stream_skip(st, offset) ||
+      !copy_data(NULL, 0, st, dst_dev, offset, out_len - offset, app_crc32,
+                 &opts)) {
+    goto out;
+  }
+  /* Source must have been consumed entirely (compressed data may have
+   * a few padding bits at the end) and be intact. */
+  if (!mgos_boot_dev_stream_finish(
+          &ps, (sss->app_flags & MGOS_BOOT_APP_F_LZ) ? 1 : 0) ||
+      (sss->app_crc32 != 0 && ps.crc32 != sss->app_crc32)) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: invalid data\n", src_dev->name));
+    goto out;
   }
+  if (*app_crc32 != out_crc32) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Image CRC mismatch\n"));
+    goto out;
+  }
+  *app_len = out_len;
   res = true;
 out:
-  if (res) mgos_boot_dbg_putl(" ok");
+  mgos_boot_lz_stream_deinit(&ls);
+  mgos_vfs_dev_close(base_dev);
   return res;
 }
 
+/*
+ * Config changes made by mgos_boot_select_slot are not written right away,
+ * but with the next write by mgos_boot_make_bootable. Until then, boot
+ * repeats the same decision, so an interrupted copy is resumed.
+ */
+static bool s_cfg_pending = false;
+
+static bool cfg_write(struct mgos_boot_cfg *cfg, bool dump) {
+  if (!mgos_boot_cfg_write(cfg, dump)) return false;
+  s_cfg_pending = false;
+  return true;
+}
+
+/*
+ * If the same copy (same config generation, slots and source) has been
+ * interrupted before, returns the offset to continue from and checksum of
+ * the data before it. Data before the last checkpoint was verified as it
+ * was written, only the last unit is read back to check that it is still
+ * intact, if it's not, it is copied again. Otherwise, records the start of
+ * a new copy and takes the range of dst erased in advance, if any: it is
+ * cleared in the same write.
+ */
+static void copy_app_begin(const struct mgos_boot_cfg *cfg, int src, int dst,
+                           struct mgos_vfs_dev *dst_dev, uint32_t *offset,
+                           uint32_t *crc32,
+                           struct mgos_boot_xcfg_erased *erased) {
+  struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  const struct mgos_boot_slot_state *sss = &cfg->slots[src].state;
+  struct mgos_boot_xcfg_op *op;
+  uint32_t off, crc, prev_off, prev_crc;
+  *offset = 0;
+  *crc32 = 0;
+  memset(erased, 0, sizeof(*erased));
+  if (xcfg == NULL) return;
+  op = &xcfg->op;
+  if (op->type == MGOS_BOOT_XCFG_OP_COPY && op->cfg_seq == cfg->seq &&
+      op->a == src && op->b == dst && op->len == sss->app_len &&
+      op->src_crc32 == sss->app_crc32) {
+    prev_off = off = op->offset;
+    prev_crc = crc = op->value;
+    if (mgos_boot_xcfg_journal_get(0, &off, &crc)) {
+      mgos_boot_xcfg_journal_get(1, &prev_off, &prev_crc);
+    }
+    if (off > prev_off &&
+        checksum_range(dst_dev, prev_off, off - prev_off, prev_crc) != crc) {
+      off = prev_off;
+      crc = prev_crc;
+    }
+    if (off > 0) {
+      MGOS_BOOT_LOG(LL_INFO, ("Resuming copy %d -> %d @ %lu\n", src, dst,
+                              (unsigned long) off));
+    }
+    *offset = off;
+    *crc32 = crc;
+    return;
+  }
+  memset(op, 0, sizeof(*op));
+  op->type = MGOS_BOOT_XCFG_OP_COPY;
+  op->cfg_seq = cfg->seq;
+  op->a = src;
+  op->b = dst;
+  op->len = sss->app_len;
+  op->src_crc32 = sss->app_crc32;
+  *erased = xcfg->erased[dst];
+  memset(&xcfg->erased[dst], 0, sizeof(xcfg->erased[dst]));
+  /* Not fatal, the copy just can't be resumed. Range is not trusted. */
+  if (!mgos_boot_xcfg_write()) memset(erased, 0, sizeof(*erased));
+}
+
 bool mgos_boot_copy_app(struct mgos_boot_cfg *cfg, int src, int dst) {
   bool res = false;
   const struct mgos_boot_slot_cfg *ssc = &cfg->slots[src].cfg;
@@ -157,41 +1134,230 @@ bool mgos_boot_copy_app(struct mgos_boot_cfg *cfg, int src, int dst) {
     src_app_dev = mgos_vfs_dev_open(ssc->app_dev);
     dst_app_dev = mgos_vfs_dev_open(dsc->app_dev);
     if (src_app_dev == NULL || dst_app_dev == NULL) {
-      mgos_boot_dbg_printf("Error opening %s %s\n", ssc->app_dev, dsc->app_dev);
+      MGOS_BOOT_LOG(LL_ERROR, ("Error opening %s %s\n", ssc->app_dev,
+                               dsc->app_dev));
       goto out;
     }
-    if (!mgos_boot_copy_dev(src_app_dev, dst_app_dev, sss->app_len)) goto out;
-    uint32_t app_crc32 = mgos_boot_checksum(dst_app_dev, sss->app_len);
-    if (sss->app_crc32 != 0 && sss->app_crc32 != app_crc32) goto out;
-    dss->app_len = sss->app_len;
-    dss->app_org = sss->app_org;
+    uint32_t app_len = sss->app_len, app_crc32 = 0, offset = 0;
+    uintptr_t app_org = sss->app_org;
+    struct mgos_boot_xcfg_erased erased;
+    copy_app_begin(cfg, src, dst, dst_app_dev, &offset, &app_crc32, &erased);
+    if (sss->app_flags & (MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ)) {
+      if (!copy_app_stream(cfg, src, dst, src_app_dev, dst_app_dev, offset,
+                           &erased, &app_len, &app_crc32)) {
+        goto out;
+      }
+    } else {
+      struct copy_manifest mf;
+      struct copy_reloc rl;
+      struct copy_opts opts = {.journal = true, .erased = &erased};
+      uint32_t link_org = sss->app_org;
+      if (copy_reloc_init(&rl, cfg, src, dst, src_app_dev, offset,
+                          &link_org)) {
+        opts.rl = &rl;
+        app_org = dsc->app_map_addr;
+      }
+      /* Manifest is of the image as linked, it is checked before the data
+       * is relocated. */
+      if (link_org == sss->app_org &&
+          copy_manifest_init(&mf, src_app_dev, app_len, offset)) {
+        opts.mf = &mf;
+      }
+      if (offset > app_len ||
+          !copy_data(src_app_dev, offset, NULL, dst_app_dev, offset,
+                     app_len - offset, &app_crc32, &opts)) {
+        goto out;
+      }
+      if (sss->app_crc32 != 0 &&
+          sss->app_crc32 != (opts.rl != NULL ? rl.src_crc32 : app_crc32)) {
+        goto out;
+      }
+    }
+    dss->app_len = app_len;
+    dss->app_org = app_org;
     dss->app_crc32 = app_crc32;
-    dss->app_flags = sss->app_flags;
+    dss->app_flags =
+        sss->app_flags & ~(MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ);
   }
   res = true;
 out:
   if (!res) {
     dss->err_count++;
-    mgos_boot_cfg_write(cfg, true /* dump */);
+    cfg_write(cfg, MGOS_BOOT_LOG_CFG_DUMP);
   }
   mgos_vfs_dev_close(src_app_dev);
   mgos_vfs_dev_close(dst_app_dev);
   return res;
 }
 
+/*
+ * Checksum of the first and last chunk of the image. These contain vectors
+ * and the end of the image, which is where incomplete writes would show.
+ * Sample size is fixed, the result is stored in xcfg.
+ */
+static uint32_t sample_checksum(struct mgos_vfs_dev *dev, size_t len) {
+  uint32_t crc32 = 0;
+  size_t io_len = MGOS_BOOT_IO_MIN_SIZE;
+  if (!io_bufs_init()) return 0;
+  size_t first_len = MIN(len, io_len), last_len = MIN(len - first_len, io_len);
+  if (mgos_vfs_dev_read(dev, 0, first_len, io_bufs[0]) != 0) return 0;
+  crc32 = mgos_boot_crc32(crc32, io_bufs[0], first_len);
+  if (last_len > 0) {
+    if (mgos_vfs_dev_read(dev, len - last_len, last_len, io_bufs[0]) != 0) {
+      return 0;
+    }
+    crc32 = mgos_boot_crc32(crc32, io_bufs[0], last_len);
+  }
+  return crc32;
+}
+
+bool mgos_boot_verify_app(struct mgos_boot_cfg *cfg, bool full) {
+  bool res = false;
+  int slot = cfg->active_slot;
+  const struct mgos_boot_slot *as = &cfg->slots[slot];
+  const struct mgos_boot_slot_state *ss = &as->state;
+  uint32_t sample_crc32 = 0;
+  struct mgos_vfs_dev *app_dev = mgos_vfs_dev_open(as->cfg.app_dev);
+  if (app_dev == NULL) goto out;
+  if (!full && mgos_boot_xcfg_is_verified(cfg, slot, &sample_crc32)) {
+    if (sample_checksum(app_dev, ss->app_len) == sample_crc32) {
+      MGOS_BOOT_LOG(LL_DEBUG, ("Slot %d verified before, skipping checksum\n",
+                               slot));
+      mgos_boot_xcfg_add_fast_boot();
+      res = true;
+      goto out;
+    }
+    MGOS_BOOT_LOG(LL_WARN, ("Sample mismatch\n"));
+  }
+  if (mgos_boot_checksum(app_dev, ss->app_len) != ss->app_crc32) {
+    MGOS_BOOT_LOG(LL_ERROR, ("App CRC mismatch!\n"));
+    goto out;
+  }
+  mgos_boot_xcfg_set_verified(cfg, slot, sample_checksum(app_dev, ss->app_len));
+  res = true;
+out:
+  mgos_vfs_dev_close(app_dev);
+  return res;
+}
+
 void mgos_cd_putc(int c) {
   mgos_boot_dbg_putc(c);
 }
 
-static void swap_fs_devs(struct mgos_boot_cfg *cfg, int8_t a, int8_t b) {
+void mgos_boot_swap_fs_devs(struct mgos_boot_cfg *cfg, int a, int b) {
   char temp_fs_dev[8];
   strcpy(temp_fs_dev, cfg->slots[a].cfg.fs_dev);
   strcpy(cfg->slots[a].cfg.fs_dev, cfg->slots[b].cfg.fs_dev);
   strcpy(cfg->slots[b].cfg.fs_dev, temp_fs_dev);
 }
 
+bool mgos_boot_select_slot(struct mgos_boot_cfg *cfg) {
+  if (!(cfg->flags & MGOS_BOOT_F_COMMITTED)) {
+    if (!(cfg->flags & MGOS_BOOT_F_FIRST_BOOT_B)) {
+      MGOS_BOOT_LOG(LL_WARN, ("Reboot without commit - reverting to %d\n",
+                              cfg->revert_slot));
+      cfg->active_slot = cfg->revert_slot;
+      cfg->revert_slot = -1;
+      cfg->flags |= MGOS_BOOT_F_COMMITTED;
+      cfg->flags &= ~(MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_MERGE_FS);
+    } else {
+      /* This is the first reboot after update, flip our flag. */
+      cfg->flags &= ~MGOS_BOOT_F_FIRST_BOOT_B;
+      MGOS_BOOT_LOG(LL_INFO, ("First boot of slot %d\n", cfg->active_slot));
+    }
+    s_cfg_pending = true;
+  }
+  return true;
+}
+
+bool mgos_boot_make_bootable(struct mgos_boot_cfg *cfg) {
+  bool res = false;
+  /*
+   * We have decided which slot to boot.
+   * It it is not directly bootable, a swap is required.
+   */
+  struct mgos_boot_slot *as = &cfg->slots[cfg->active_slot];
+  if (as->cfg.app_map_addr != as->state.app_org) {
+    struct mgos_boot_plan plan;
+    if (!mgos_boot_plan_bootable(cfg, &plan)) {
+      MGOS_BOOT_LOG(LL_ERROR, ("No slot available @ 0x%lx!\n",
+                               (unsigned long) as->state.app_org));
+      goto out;
+    }
+    if (plan.stage) {
+      MGOS_BOOT_LOG(LL_WARN, ("Slot %d is not bootable, "
+                              "will relocate it via %d\n",
+                              cfg->active_slot, plan.temp));
+      /* Move the image out of the way first, it is relocated on the way
+       * back. The config is committed in between, so that it is not lost
+       * if the second copy is interrupted. */
+      if (!plan.temp_same &&
+          !mgos_boot_copy_app(cfg, cfg->active_slot, plan.temp)) {
+        goto out;
+      }
+      mgos_boot_swap_fs_devs(cfg, cfg->active_slot, plan.temp);
+      cfg->active_slot = plan.temp;
+      if (!cfg_write(cfg, false /* dump */)) goto out;
+      plan.temp = -1;
+    } else {
+      MGOS_BOOT_LOG(LL_WARN, ("Slot %d is not bootable, will use %d\n",
+                              cfg->active_slot, plan.dst));
+    }
+    /* If the bootable slot is the revert slot, it is valuable
+     * and we need to make a backup of it. */
+    if (plan.temp >= 0) {
+      MGOS_BOOT_LOG(LL_INFO, ("Slot %d contains useful data, "
+                              "will make a backup of it in slot %d\n",
+                              plan.dst, plan.temp));
+      /* If the temp slot is too small for a backup, swap using it as
+       * scratch space. This leaves the old image in the active slot. */
+      if (plan.swap) {
+        res = mgos_boot_swap_slots(cfg, cfg->active_slot, plan.dst,
+                                   plan.temp);
+        /* Config has been written when the swap finished. */
+        if (res) s_cfg_pending = false;
+        goto out;
+      }
+      if (!plan.temp_same &&
+          !mgos_boot_copy_app(cfg, plan.dst, plan.temp)) {
+        goto out;
+      }
+      cfg->revert_slot = plan.temp;
+      if (plan.temp != cfg->active_slot) {
+        mgos_boot_swap_fs_devs(cfg, plan.temp, plan.dst);
+      }
+      /* Commit this config. This is a stable configuration and we need to
+       * preserve it in case the subsequent copy is interrupted. If the
+       * backup was there already, the same plan is made again from the
+       * config as it is (slot dst is not read for it), so this can wait
+       * for the final write. */
+      if (!plan.dst_same && !plan.temp_same &&
+          !cfg_write(cfg, false /* dump */)) {
+        goto out;
+      }
+    }
+    if (!plan.dst_same &&
+        !mgos_boot_copy_app(cfg, cfg->active_slot, plan.dst)) {
+      goto out;
+    }
+    mgos_boot_swap_fs_devs(cfg, cfg->active_slot, plan.dst);
+    cfg->active_slot = plan.dst;
+    if (!cfg_write(cfg, MGOS_BOOT_LOG_CFG_DUMP)) goto out;
+  }
+  if (s_cfg_pending && !cfg_write(cfg, false /* dump */)) goto out;
+  res = true;
+out:
+  return res;
+}
+
 void mgos_boot_main(void) {
-  struct mgos_boot_cfg *cfg;
+  struct mgos_boot_cfg *cfg = NULL;
+  struct mgos_boot_trace_span sp;
+  uint32_t start_us = mgos_boot_time_us();
+  uintptr_t app_org;
+  uint32_t app_len;
+  int slot;
+  bool warm, warm_expired;
   mgos_wdt_enable();
   mgos_wdt_set_timeout(10 /* seconds */);
 
@@ -200,122 +1366,90 @@ void mgos_boot_main(void) {
   uintptr_t next_app_org = mgos_boot_get_next_app_org();
   if (next_app_org != 0) {
     mgos_boot_set_next_app_org(0);
+    mgos_boot_hot_load(next_app_org);
     mgos_boot_app(next_app_org);
     // Not reached.
     goto out;
   }
 
+  mgos_boot_trace_init(start_us);
+  mgos_boot_log_init();
+
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_CLOCK_INIT, NULL);
   mgos_boot_init();
   mgos_wdt_set_timeout(10 /* seconds */); // Reinit in case clock changed.
   mgos_boot_dbg_setup();
-  mgos_boot_dbg_printf("\n\nMongoose OS loader %s (%s)\n", build_version,
-                       build_id);
+  mgos_boot_trace_end(&sp, 0);
+  MGOS_BOOT_LOG(LL_INFO, ("\n\nMongoose OS loader %s (%s)\n", build_version,
+                          build_id));
+
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_WARM_CHECK, NULL);
+  warm = mgos_boot_warm_check(&slot, &app_org, &app_len, &warm_expired);
+  mgos_boot_trace_end(&sp, 0);
+  if (warm) {
+    mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_JUMP, NULL);
+    goto boot;
+  }
 
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_DEVS_INIT, NULL);
   if (!mgos_boot_devs_init()) {
-    mgos_boot_dbg_printf("%s init failed\n", "dev");
+    MGOS_BOOT_LOG(LL_ERROR, ("%s init failed\n", "dev"));
     goto out;
   }
+  mgos_boot_trace_end(&sp, 0);
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_DEVTAB_INIT, NULL);
   if (!mgos_root_devtab_init()) {
-    mgos_boot_dbg_printf("%s init failed\n", "devtab");
+    MGOS_BOOT_LOG(LL_ERROR, ("%s init failed\n", "devtab"));
     goto out;
   }
+  mgos_boot_trace_end(&sp, 0);
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_CFG_INIT, NULL);
   if (!mgos_boot_cfg_init()) {
-    mgos_boot_dbg_printf("%s init failed\n", "cfg");
+    MGOS_BOOT_LOG(LL_ERROR, ("%s init failed\n", "cfg"));
     goto out;
   }
   cfg = mgos_boot_cfg_get();
-  mgos_boot_cfg_dump(cfg);
+  if (MGOS_BOOT_LOG_CFG_DUMP) mgos_boot_cfg_dump(cfg);
+  mgos_boot_xcfg_init(); /* Optional */
+  mgos_boot_trace_end(&sp, 0);
   mgos_wdt_feed();
 
+  /* Slot swap interrupted by reset must be completed first. */
+  if (!mgos_boot_swap_resume(cfg)) goto out;
+
   /*
    * Before booting, we need to:
    * 1) Decide which slot to boot
    * 2) Make sure the desired boot slot is bootable
    */
+  if (!mgos_boot_select_slot(cfg)) goto out;
+  if (!mgos_boot_make_bootable(cfg)) goto out;
 
-  if (!(cfg->flags & MGOS_BOOT_F_COMMITTED)) {
-    if (!(cfg->flags & MGOS_BOOT_F_FIRST_BOOT_B)) {
-      mgos_boot_dbg_printf("Reboot without commit - reverting to %d\n",
-                           cfg->revert_slot);
-      cfg->active_slot = cfg->revert_slot;
-      cfg->revert_slot = -1;
-      cfg->flags |= MGOS_BOOT_F_COMMITTED;
-      cfg->flags &= ~(MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_MERGE_FS);
-    } else {
-      /* This is the first reboot after update, flip our flag. */
-      cfg->flags &= ~MGOS_BOOT_F_FIRST_BOOT_B;
-      mgos_boot_dbg_printf("First boot of slot %d\n", cfg->active_slot);
-    }
-    if (!mgos_boot_cfg_write(cfg, false /* dump */)) goto out;
-  }
-
-  /*
-   * We have decided which slot to boot.
-   * It it is not directly bootable, a swap is required.
-   */
-  struct mgos_boot_slot *as = &cfg->slots[cfg->active_slot];
-  if (as->cfg.app_map_addr != as->state.app_org) {
-    int bootable_slot = mgos_boot_cfg_find_slot(cfg, as->state.app_org,
-                                                false /* want_fs */, -1, -1);
-    mgos_boot_dbg_printf("Slot %d is not bootable, will use %d\n",
-                         cfg->active_slot, bootable_slot);
-    if (bootable_slot < 0) {
-      mgos_boot_dbg_printf("No slot available @ 0x%lx!\n",
-                           (unsigned long) as->state.app_org);
-      goto out;
-    }
-    /* We found a bootable slot. If it is the revert slot, it is valuable
-     * and we need to make a backup of it. */
-    if (bootable_slot == cfg->revert_slot) {
-      /* Find a temp slot. We don't need FS for the swap. */
-      int8_t temp_slot =
-          mgos_boot_cfg_find_slot(cfg, 0 /* map_addr */, false /* want_fs */,
-                                  bootable_slot, cfg->revert_slot);
-      mgos_boot_dbg_printf(
-          "Slot %d contains useful data, "
-          "will make a backup of it in slot %d\n",
-          bootable_slot, temp_slot);
-      if (temp_slot < 0) {
-        mgos_boot_dbg_printf("No suitable temp slot!\n");
-        goto out;
-      }
-      if (!mgos_boot_copy_app(cfg, bootable_slot, temp_slot)) goto out;
-      cfg->revert_slot = temp_slot;
-      swap_fs_devs(cfg, temp_slot, bootable_slot);
-      /* Commit this config. This is a stable configuration and we need to
-       * preserve it in case the subsequent copy is interrupted. */
-      if (!mgos_boot_cfg_write(cfg, false /* dump */)) goto out;
-    }
-    if (!mgos_boot_copy_app(cfg, cfg->active_slot, bootable_slot)) goto out;
-    swap_fs_devs(cfg, cfg->active_slot, bootable_slot);
-    cfg->active_slot = bootable_slot;
-    if (!mgos_boot_cfg_write(cfg, true /* dump */)) goto out;
-  }
-
-  /* cfg->active_slot may have changed. */
-  as = &cfg->slots[cfg->active_slot];
-
-  /* Verify app checksum. */
-  struct mgos_vfs_dev *app_dev = mgos_vfs_dev_open(as->cfg.app_dev);
-  uint32_t app_crc32 = mgos_boot_checksum(app_dev, as->state.app_len);
-  mgos_vfs_dev_close(app_dev);
-  if (app_crc32 != as->state.app_crc32) {
-    mgos_boot_dbg_printf("App CRC mismatch!\n");
-    goto out;
-  }
+  if (!mgos_boot_verify_app(cfg, warm_expired)) goto out;
 
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_JUMP, NULL);
+  mgos_boot_warm_save(cfg);
+  mgos_boot_xcfg_deinit();
   mgos_boot_cfg_deinit();
-  uintptr_t app_org = cfg->slots[cfg->active_slot].state.app_org;
-  mgos_boot_dbg_printf("Booting slot %d (%p)\r\n", cfg->active_slot,
-                       (void *) app_org);
+  slot = cfg->active_slot;
+  app_org = cfg->slots[slot].state.app_org;
+  app_len = cfg->slots[slot].state.app_len;
+boot:
+  MGOS_BOOT_LOG(LL_INFO, ("Booting slot %d (%p)\r\n", slot, (void *) app_org));
   mgos_boot_print_app_info(app_org);
+  mgos_boot_hot_init(app_org, app_len);
   mgos_boot_set_next_app_org(app_org);
   next_app_org = mgos_boot_get_next_app_org();
+  mgos_boot_trace_end(&sp, 0);
+  mgos_boot_trace_finish();
   mgos_boot_system_restart();
   // Not reached.
 
 out:
-  mgos_boot_dbg_printf("FAIL\n");
+  MGOS_BOOT_LOG(LL_ERROR, ("FAIL\n"));
+  mgos_boot_log_flush();
+  /* Only returns if there's no config to update. */
+  mgos_boot_recover(cfg);
   while (1) {
   }
 }
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Building blocks of the boot sequence, used by platform code. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mgos_boot_cfg.h"
+#include "mgos_boot_stream.h"
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compute CRC32 of the first len bytes of the device. Returns 0 on error. */
+uint32_t mgos_boot_checksum(struct mgos_vfs_dev *src, size_t len);
+
+/*
+ * Copy len bytes from src to dst, erasing dst as necessary.
+ * If crc32 is not NULL, each chunk is read back after writing and CRC32 of
+ * the data actually written is computed (in the same pass) and stored.
+ */
+bool mgos_boot_copy_dev(struct mgos_vfs_dev *src, struct mgos_vfs_dev *dst,
+                        size_t len, uint32_t *crc32);
+
+/*
+ * Same as mgos_boot_copy_dev, for a range of the device. dst_off must be at
+ * an erase sector boundary, the last sector is erased entirely.
+ */
+bool mgos_boot_copy_dev_range(struct mgos_vfs_dev *src, size_t src_off,
+                              struct mgos_vfs_dev *dst, size_t dst_off,
+                              size_t len, uint32_t *crc32);
+
+/* Same as mgos_boot_copy_dev, for data produced by a stream. */
+bool mgos_boot_copy_stream(struct mgos_boot_stream *src,
+                           struct mgos_vfs_dev *dst, size_t len,
+                           uint32_t *crc32);
+
+/*
+ * Copy and verify app from slot src to slot dst, update dst state.
+ * If src contains a patch or compressed data, it is applied or
+ * decompressed while copying. If dst is mapped at a different address and
+ * the image has a relocation table, it is relocated to run from there.
+ * Progress is recorded in xcfg, if available, and an interrupted copy is
+ * continued when repeated with the same config.
+ */
+bool mgos_boot_copy_app(struct mgos_boot_cfg *cfg, int src, int dst);
+
+/* Exchange fs devices of two slots. */
+void mgos_boot_swap_fs_devs(struct mgos_boot_cfg *cfg, int a, int b);
+
+/*
+ * Decide which slot to boot: on reboot without commit, revert to the
+ * previous slot. Changes are written by mgos_boot_make_bootable, together
+ * with its own, so it must follow.
+ */
+bool mgos_boot_select_slot(struct mgos_boot_cfg *cfg);
+
+/*
+ * Make sure the active slot is directly bootable, copying it to
+ * a bootable slot (with backup of the revert slot) if necessary.
+ */
+bool mgos_boot_make_bootable(struct mgos_boot_cfg *cfg);
+
+/*
+ * Verify the app in the active slot. Unless full is set, full checksum is
+ * skipped if the slot has been verified before and has not changed since,
+ * in which case only a sample is checked. See mgos_boot_xcfg.h.
+ */
+bool mgos_boot_verify_app(struct mgos_boot_cfg *cfg, bool full);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_plan.h"
+
+#include <string.h>
+
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_swap.h"
+
+#define PLAN_NO_COST UINT32_MAX
+
+static bool plan_slot_writeable(const struct mgos_boot_cfg *cfg, int slot) {
+  uint32_t flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
+  return ((cfg->slots[slot].cfg.flags & flags) == flags);
+}
+
+/*
+ * Whether contents of the slot match its state. Slots are read at most
+ * once per plan, the same slot is considered for several roles.
+ */
+enum plan_slot_check {
+  PLAN_SLOT_UNKNOWN = 0,
+  PLAN_SLOT_INTACT = 1,
+  PLAN_SLOT_BAD = 2,
+};
+
+static uint8_t s_slot_check[MGOS_BOOT_CFG_MAX_SLOTS];
+
+static bool plan_slot_intact(const struct mgos_boot_cfg *cfg, int slot) {
+  const struct mgos_boot_slot_state *ss = &cfg->slots[slot].state;
+  struct mgos_vfs_dev *dev;
+  bool res = false;
+  if (s_slot_check[slot] != PLAN_SLOT_UNKNOWN) {
+    return (s_slot_check[slot] == PLAN_SLOT_INTACT);
+  }
+  dev = mgos_vfs_dev_open(cfg->slots[slot].cfg.app_dev);
+  if (dev != NULL) {
+    res = (mgos_boot_checksum(dev, ss->app_len) == ss->app_crc32);
+  }
+  mgos_vfs_dev_close(dev);
+  s_slot_check[slot] = (res ? PLAN_SLOT_INTACT : PLAN_SLOT_BAD);
+  return res;
+}
+
+/* Slot b holds a copy of the image in slot a, checked by reading it. */
+static bool plan_has_copy(const struct mgos_boot_cfg *cfg, int a, int b) {
+  const struct mgos_boot_slot_state *sa = &cfg->slots[a].state;
+  const struct mgos_boot_slot_state *sb = &cfg->slots[b].state;
+  if (sa->app_len == 0 || sa->app_len != sb->app_len ||
+      sa->app_crc32 != sb->app_crc32 || sa->app_org != sb->app_org ||
+      ((sa->app_flags | sb->app_flags) &
+       (MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ))) {
+    return false;
+  }
+  return plan_slot_intact(cfg, b);
+}
+
+/* Bytes to copy on rollback if the revert image (of slot rs) is in slot. */
+static uint32_t plan_rollback_cost(const struct mgos_boot_cfg *cfg, int slot,
+                                   int rs) {
+  const struct mgos_boot_slot_state *rss = &cfg->slots[rs].state;
+  return (cfg->slots[slot].cfg.app_map_addr == rss->app_org ? 0
+                                                           : rss->app_len);
+}
+
+static size_t plan_slot_size(const struct mgos_boot_cfg *cfg, int slot) {
+  struct mgos_vfs_dev *dev = mgos_vfs_dev_open(cfg->slots[slot].cfg.app_dev);
+  size_t size = (dev != NULL ? mgos_vfs_dev_get_size(dev) : 0);
+  mgos_vfs_dev_close(dev);
+  return size;
+}
+
+/*
+ * Pick the backup slot for the revert image, which is in slot d.
+ * Returns total cost, including install, which is given.
+ */
+static uint32_t plan_backup(const struct mgos_boot_cfg *cfg, int d,
+                            uint32_t install, struct mgos_boot_plan *plan) {
+  int active = cfg->active_slot;
+  uint32_t len = cfg->slots[d].state.app_len, best = PLAN_NO_COST;
+  uint32_t swap_len = MAX(len, cfg->slots[active].state.app_len);
+  for (int t = 0; t < cfg->num_slots; t++) {
+    bool same, swap = false;
+    uint32_t cost;
+    if (t == d) continue;
+    same = plan_has_copy(cfg, d, t);
+    if (same) {
+      cost = install + plan_rollback_cost(cfg, t, d);
+    } else if (t == active || !plan_slot_writeable(cfg, t)) {
+      continue;
+    } else if (plan_slot_size(cfg, t) >= len) {
+      cost = install + len + plan_rollback_cost(cfg, t, d);
+    } else if (mgos_boot_swap_wanted(cfg, active, d, t)) {
+      /* Revert image ends up in the active slot. */
+      swap = true;
+      cost = 3 * swap_len + plan_rollback_cost(cfg, active, d);
+    } else {
+      continue;
+    }
+    if (cost < best) {
+      best = cost;
+      plan->temp = t;
+      plan->temp_same = same;
+      plan->swap = swap;
+    }
+  }
+  return best;
+}
+
+/* Plain image with a relocation table. */
+static bool plan_relocatable(const struct mgos_boot_cfg *cfg, int slot) {
+  const struct mgos_boot_slot_state *ss = &cfg->slots[slot].state;
+  struct mgos_vfs_dev *dev;
+  uint32_t org, offset, num;
+  bool res;
+  if (ss->app_len == 0 ||
+      (ss->app_flags & (MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ))) {
+    return false;
+  }
+  dev = mgos_vfs_dev_open(cfg->slots[slot].cfg.app_dev);
+  if (dev == NULL) return false;
+  res = mgos_boot_img_get_reloc(dev, ss->app_len, &org, &offset, &num);
+  mgos_vfs_dev_close(dev);
+  return res;
+}
+
+/* Pick the slot to stage the active image in, returns total cost. */
+static uint32_t plan_stage(const struct mgos_boot_cfg *cfg,
+                           struct mgos_boot_plan *plan) {
+  int active = cfg->active_slot, revert = cfg->revert_slot;
+  uint32_t len = cfg->slots[active].state.app_len, best = PLAN_NO_COST;
+  for (int t = 0; t < cfg->num_slots; t++) {
+    bool same;
+    uint32_t cost;
+    if (t == active || t == revert) continue;
+    same = plan_has_copy(cfg, active, t);
+    if (!same &&
+        (!plan_slot_writeable(cfg, t) || plan_slot_size(cfg, t) < len)) {
+      continue;
+    }
+    /* Revert image stays where it is. */
+    cost = (same ? 0 : len) + len +
+           (revert >= 0 ? plan_rollback_cost(cfg, revert, revert) : 0);
+    if (cost < best) {
+      best = cost;
+      plan->temp = t;
+      plan->temp_same = same;
+      plan->stage = true;
+    }
+  }
+  return best;
+}
+
+bool mgos_boot_plan_bootable(const struct mgos_boot_cfg *cfg,
+                             struct mgos_boot_plan *plan) {
+  int active = cfg->active_slot, revert = cfg->revert_slot;
+  const struct mgos_boot_slot_state *as = &cfg->slots[active].state;
+  bool reloc = plan_relocatable(cfg, active);
+  memset(s_slot_check, 0, sizeof(s_slot_check));
+  plan->cost = PLAN_NO_COST;
+  for (int d = 0; d < cfg->num_slots; d++) {
+    struct mgos_boot_plan p = {.dst = d, .temp = -1};
+    uintptr_t map_addr = cfg->slots[d].cfg.app_map_addr;
+    if (!plan_slot_writeable(cfg, d) || map_addr == 0 ||
+        (map_addr != as->app_org && !reloc)) {
+      continue;
+    }
+    if (d == active) {
+      p.cost = plan_stage(cfg, &p);
+      if (p.cost == PLAN_NO_COST) continue;
+      if (p.cost < plan->cost) *plan = p;
+      continue;
+    }
+    p.dst_same = plan_has_copy(cfg, active, d);
+    p.cost = (p.dst_same ? 0 : as->app_len);
+    if (d == revert) {
+      p.cost = plan_backup(cfg, d, p.cost, &p);
+      if (p.cost == PLAN_NO_COST) continue;
+    } else if (revert >= 0) {
+      p.cost += plan_rollback_cost(cfg, revert, revert);
+    }
+    if (p.cost < plan->cost) *plan = p;
+  }
+  if (plan->cost == PLAN_NO_COST) return false;
+  MGOS_BOOT_LOG(LL_DEBUG,
+                ("Plan: %d -> %d%s, %s %d%s%s, cost %lu\n", active,
+                 plan->dst, (plan->dst_same ? " (same)" : ""),
+                 (plan->stage ? "stage" : "backup"), plan->temp,
+                 (plan->temp_same ? " (same)" : ""),
+                 (plan->swap ? ", swap" : ""), (unsigned long) plan->cost));
+  return true;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Slot planner for mgos_boot_make_bootable. Instead of taking the first
+ * suitable slot (mgos_boot_cfg_find_slot), all candidates for the bootable
+ * slot and the backup of the revert image are considered, and the plan
+ * that writes the least is chosen, counting the copy back on rollback:
+ *  - A slot that already holds the same image (checked by reading it
+ *    back) needs no copy. This makes re-installing the current image
+ *    free, and so is the backup on the first update after a rollback.
+ *  - Where more than one slot is bootable at the image's address, the
+ *    one that does not hold the revert image is used, so the revert image
+ *    stays bootable and rollback needs no copy.
+ *  - A backup slot large enough for the whole image is preferred over
+ *    a swap (see mgos_boot_swap.h), which writes 3x instead of 2x.
+ *  - An image with a relocation table (see MGOS_BOOT_IMG_EXT_RELOC) can
+ *    run from any mapped slot, including the one it is in: it is staged
+ *    in a spare slot and relocated on the way back, which leaves the
+ *    revert image where it is.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_boot_cfg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_boot_plan {
+  /* Slot to run the active image from. */
+  int8_t dst;
+  /* Slot to keep the revert image in, if it is in dst, -1 otherwise.
+   * May be the active slot, if it holds the same image.
+   * When staging, slot to copy the image to first. */
+  int8_t temp;
+  /* dst already holds the active image. */
+  bool dst_same;
+  /* temp already holds the revert image. */
+  bool temp_same;
+  /* Install by swapping the active slot with dst, using temp as scratch. */
+  bool swap;
+  /* dst is the active slot, the image is relocated in place via temp. */
+  bool stage;
+  /* Bytes to write, now and on rollback. */
+  uint32_t cost;
+};
+
+/*
+ * Plan installation of the active image into a bootable slot.
+ * Returns false if there is no suitable slot.
+ */
+bool mgos_boot_plan_bootable(const struct mgos_boot_cfg *cfg,
+                             struct mgos_boot_plan *plan);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_recover.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos_hal.h"
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_delta.h"
+#include "mgos_boot_hal.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_lz.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_stream.h"
+#include "mgos_boot_xcfg.h"
+
+#if MGOS_BOOT_RECOVER_WINDOW > 32
+#error MGOS_BOOT_RECOVER_WINDOW must be 32 or less
+#endif
+
+#define FRAME_SIZE MGOS_BOOT_RECOVER_FRAME_SIZE
+#define WINDOW MGOS_BOOT_RECOVER_WINDOW
+#define HDR_SIZE sizeof(struct mgos_boot_recover_hdr)
+
+struct recover {
+  /* Data is read by the copy from this stream. */
+  struct mgos_boot_stream s;
+  /* Frame being received, word-aligned. */
+  uint32_t rx[(HDR_SIZE + FRAME_SIZE + 3) / 4];
+  size_t rx_len;
+  /* When the last byte and the last valid frame were received. */
+  uint32_t rx_us, valid_us;
+  /* Image being received. */
+  uint32_t len;
+  /* Frame and offset in it to be read next. */
+  uint32_t rd, rd_off;
+  /* Frames that may be sent, up to this one. */
+  uint32_t credit;
+  /* Bit i: frame rd + i has been received. */
+  uint32_t have;
+  /* Frames buffered, WINDOW or fewer if there's not enough memory. */
+  uint32_t window;
+  uint8_t data[];
+};
+
+int __attribute__((weak)) mgos_boot_dbg_uart_getc(void) {
+  return -1;
+}
+
+static uint32_t recover_frame_len(const struct recover *r, uint32_t n) {
+  return MIN(FRAME_SIZE, r->len - n * FRAME_SIZE);
+}
+
+static void recover_send(uint8_t type, uint32_t seq, const void *data,
+                         uint16_t len) {
+  struct mgos_boot_recover_hdr hdr = {
+      .magic = MGOS_BOOT_RECOVER_MAGIC, .type = type, .len = len, .seq = seq};
+  const uint8_t *p = (const uint8_t *) &hdr;
+  hdr.crc32 = mgos_boot_crc32(mgos_boot_crc32(0, &hdr, HDR_SIZE), data, len);
+  for (size_t i = 0; i < HDR_SIZE; i++) mgos_boot_dbg_uart_putc(p[i]);
+  p = (const uint8_t *) data;
+  for (size_t i = 0; i < len; i++) mgos_boot_dbg_uart_putc(p[i]);
+}
+
+/*
+ * Consume what has been received. Returns type of the frame that has been
+ * completed, which is then in r->rx, or 0 if there's none yet.
+ */
+static int recover_rx(struct recover *r) {
+  uint8_t *buf = (uint8_t *) r->rx;
+  struct mgos_boot_recover_hdr hdr;
+  uint32_t crc32;
+  int c;
+  while ((c = mgos_boot_dbg_uart_getc()) >= 0) {
+    r->rx_us = mgos_boot_time_us();
+    buf[r->rx_len++] = c;
+    if (r->rx_len <= 4) {
+      /* Look for the magic, which may start at any byte. */
+      if (c != ((MGOS_BOOT_RECOVER_MAGIC >> (8 * (r->rx_len - 1))) & 0xff)) {
+        r->rx_len = (c == (MGOS_BOOT_RECOVER_MAGIC & 0xff) ? 1 : 0);
+        buf[0] = c;
+      }
+      continue;
+    }
+    if (r->rx_len < HDR_SIZE) continue;
+    memcpy(&hdr, buf, HDR_SIZE);
+    if (hdr.len > FRAME_SIZE) {
+      r->rx_len = 0;
+      continue;
+    }
+    if (r->rx_len < HDR_SIZE + hdr.len) continue;
+    r->rx_len = 0;
+    crc32 = hdr.crc32;
+    hdr.crc32 = 0;
+    if (mgos_boot_crc32(mgos_boot_crc32(0, &hdr, HDR_SIZE), buf + HDR_SIZE,
+                        hdr.len) != crc32) {
+      continue;
+    }
+    r->valid_us = r->rx_us;
+    mgos_wdt_feed();
+    return hdr.type;
+  }
+  return 0;
+}
+
+/* First frame not received yet. */
+static uint32_t recover_base(const struct recover *r) {
+  uint32_t n = 0;
+  while (n < r->window && (r->have & (1UL << n))) n++;
+  return r->rd + n;
+}
+
+static void recover_sack(const struct recover *r) {
+  struct mgos_boot_recover_sack sack;
+  uint32_t n = recover_base(r) - r->rd;
+  sack.base = r->rd + n;
+  sack.mask = (n + 1 < 32 ? r->have >> (n + 1) : 0);
+  sack.credit = r->credit;
+  recover_send(MGOS_BOOT_RECOVER_SACK, 0, &sack, sizeof(sack));
+}
+
+static void recover_data(struct recover *r) {
+  const uint8_t *buf = (const uint8_t *) r->rx;
+  struct mgos_boot_recover_hdr hdr;
+  uint32_t i;
+  memcpy(&hdr, buf, HDR_SIZE);
+  i = hdr.seq - r->rd;
+  if (hdr.seq < r->rd || hdr.seq >= r->credit ||
+      hdr.len != recover_frame_len(r, hdr.seq) || (r->have & (1UL << i))) {
+    return;
+  }
+  memcpy(r->data + (hdr.seq % r->window) * FRAME_SIZE, buf + HDR_SIZE,
+         hdr.len);
+  r->have |= (1UL << i);
+}
+
+/*
+ * Grant credit for the frames up to the one with byte end - 1 (as many
+ * as fit in the window) and receive them. Missing frames are asked for
+ * when the line goes quiet.
+ */
+static bool recover_fill(struct recover *r, uint32_t end) {
+  uint32_t sack_us;
+  r->credit = MIN(r->rd + r->window, (end + FRAME_SIZE - 1) / FRAME_SIZE);
+  recover_sack(r);
+  sack_us = mgos_boot_time_us();
+  while (recover_base(r) < r->credit) {
+    int type = recover_rx(r);
+    uint32_t now = mgos_boot_time_us();
+    if (type == MGOS_BOOT_RECOVER_DATA) {
+      recover_data(r);
+      continue;
+    }
+    /* Host has started over. */
+    if (type == MGOS_BOOT_RECOVER_HELLO) return false;
+    if (now - r->valid_us > MGOS_BOOT_RECOVER_TIMEOUT_US) {
+      MGOS_BOOT_LOG(LL_ERROR, ("Recovery: timeout\n"));
+      return false;
+    }
+    if (now - r->rx_us > MGOS_BOOT_RECOVER_IDLE_US &&
+        now - sack_us > MGOS_BOOT_RECOVER_IDLE_US) {
+      recover_sack(r);
+      sack_us = now;
+    }
+  }
+  return true;
+}
+
+static bool recover_read(struct mgos_boot_stream *s, void *buf, size_t len) {
+  struct recover *r = (struct recover *) s;
+  uint8_t *p = (uint8_t *) buf;
+  while (len > 0) {
+    uint32_t off = r->rd * FRAME_SIZE + r->rd_off, n;
+    if (len > r->len - off) return false;
+    if (!(r->have & 1) && !recover_fill(r, off + len)) return false;
+    n = MIN(len, recover_frame_len(r, r->rd) - r->rd_off);
+    memcpy(p, r->data + (r->rd % r->window) * FRAME_SIZE + r->rd_off, n);
+    p += n;
+    len -= n;
+    r->rd_off += n;
+    if (r->rd_off == recover_frame_len(r, r->rd)) {
+      r->rd++;
+      r->rd_off = 0;
+      r->have >>= 1;
+    }
+  }
+  return true;
+}
+
+/* Set up slot state for the image that has been written to it. */
+static void recover_set_state(const struct mgos_boot_cfg *cfg,
+                              struct mgos_boot_slot *s,
+                              struct mgos_vfs_dev *dev,
+                              const struct mgos_boot_recover_begin *b,
+                              uint32_t crc32) {
+  struct mgos_boot_lz_hdr hdr;
+  uint32_t org, reloc_off, reloc_num;
+  memset(&s->state, 0, sizeof(s->state));
+  s->state.app_len = b->len;
+  s->state.app_crc32 = crc32;
+  if (b->org != 0) {
+    s->state.app_org = b->org;
+  } else if (mgos_boot_img_get_reloc(dev, b->len, &org, &reloc_off,
+                                     &reloc_num)) {
+    s->state.app_org = org;
+  } else if (s->cfg.app_map_addr != 0) {
+    s->state.app_org = s->cfg.app_map_addr;
+  } else {
+    s->state.app_org = cfg->slots[cfg->active_slot].state.app_org;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  if (mgos_vfs_dev_read(dev, 0, MIN(b->len, sizeof(hdr)), &hdr) != 0) return;
+  if (hdr.magic == MGOS_BOOT_DELTA_MAGIC) {
+    s->state.app_flags |= MGOS_BOOT_APP_F_DELTA;
+  } else if (b->len >= sizeof(hdr) && hdr.magic == MGOS_BOOT_LZ_MAGIC) {
+    s->state.app_flags |= (MGOS_BOOT_APP_F_LZ | hdr.flags);
+  }
+}
+
+/* Receive the image into the slot and make it active. */
+static int recover_write(struct mgos_boot_cfg *cfg, struct recover *r,
+                         const struct mgos_boot_recover_begin *b,
+                         uint32_t *crc32) {
+  int res = MGOS_BOOT_RECOVER_ERR_SLOT;
+  uint32_t flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
+  struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  struct mgos_vfs_dev *dev = NULL;
+  struct mgos_boot_slot *s;
+  if (b->slot >= cfg->num_slots ||
+      (cfg->slots[b->slot].cfg.flags & flags) != flags) {
+    goto out;
+  }
+  s = &cfg->slots[b->slot];
+  dev = mgos_vfs_dev_open(s->cfg.app_dev);
+  if (dev == NULL || b->len == 0 || b->len > mgos_vfs_dev_get_size(dev)) {
+    goto out;
+  }
+  MGOS_BOOT_LOG(LL_INFO, ("Recovery: %lu bytes to slot %d\n",
+                          (unsigned long) b->len, b->slot));
+  res = MGOS_BOOT_RECOVER_ERR_WRITE;
+  /* Slot is about to be written, it's no longer erased. */
+  if (xcfg != NULL && xcfg->erased[b->slot].len > 0 &&
+      !mgos_boot_xcfg_set_erased(b->slot, 0, 0)) {
+    goto out;
+  }
+  r->len = b->len;
+  r->rd = r->rd_off = r->credit = r->have = 0;
+  if (!mgos_boot_copy_stream(&r->s, dev, b->len, crc32)) goto out;
+  res = MGOS_BOOT_RECOVER_ERR_CRC;
+  if (*crc32 != b->crc32) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Image CRC mismatch\n"));
+    goto out;
+  }
+  res = MGOS_BOOT_RECOVER_ERR_CFG;
+  recover_set_state(cfg, s, dev, b, *crc32);
+  cfg->active_slot = b->slot;
+  cfg->revert_slot = -1;
+  cfg->flags &= ~(MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B);
+  cfg->flags |= MGOS_BOOT_F_COMMITTED;
+  if (!mgos_boot_cfg_write(cfg, MGOS_BOOT_LOG_CFG_DUMP)) goto out;
+  res = MGOS_BOOT_RECOVER_OK;
+out:
+  mgos_vfs_dev_close(dev);
+  return res;
+}
+
+void mgos_boot_recover(struct mgos_boot_cfg *cfg) {
+  struct recover *r = NULL;
+  const uint8_t *payload;
+  uint32_t window;
+  if (cfg == NULL) return;
+  for (window = WINDOW; window > 0; window /= 2) {
+    r = (struct recover *) calloc(1, sizeof(*r) + window * FRAME_SIZE);
+    if (r != NULL) break;
+  }
+  if (r == NULL) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Recovery: no memory\n"));
+    return;
+  }
+  r->window = window;
+  payload = (const uint8_t *) r->rx + HDR_SIZE;
+  r->s.name = "uart";
+  r->s.read = recover_read;
+  while (1) {
+    struct mgos_boot_recover_hdr hdr;
+    int type = recover_rx(r);
+    memcpy(&hdr, r->rx, HDR_SIZE);
+    if (type == MGOS_BOOT_RECOVER_HELLO) {
+      struct mgos_boot_recover_hello h = {
+          .version = MGOS_BOOT_RECOVER_VERSION,
+          .frame_size = FRAME_SIZE,
+          .window = r->window,
+          .num_slots = cfg->num_slots,
+      };
+      recover_send(MGOS_BOOT_RECOVER_HELLO, 0, &h, sizeof(h));
+    } else if (type == MGOS_BOOT_RECOVER_BEGIN &&
+               hdr.len == sizeof(struct mgos_boot_recover_begin)) {
+      struct mgos_boot_recover_begin b;
+      struct mgos_boot_recover_status st = {0};
+      memcpy(&b, payload, sizeof(b));
+      st.status = recover_write(cfg, r, &b, &st.crc32);
+      recover_send(MGOS_BOOT_RECOVER_STATUS, 0, &st, sizeof(st));
+      if (st.status == MGOS_BOOT_RECOVER_OK) mgos_boot_system_restart();
+    }
+  }
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Serial recovery. When the loader fails to boot, it listens on the debug
+ * UART for a host (tools/mgos_boot_recover.py) that writes an image into
+ * a slot, which then becomes active. Data goes straight to the slot
+ * through the copy machinery (mgos_boot_copy_stream), images may be
+ * compressed or patches, as with OTA.
+ *
+ * Everything is sent in frames: struct mgos_boot_recover_hdr followed by
+ * len bytes of payload. CRC32 covers the header (with crc32 = 0) and the
+ * payload. Anything that is not a valid frame is skipped, so loader log
+ * output can be interleaved with frames.
+ *
+ *   host                                   loader
+ *   HELLO                        -->
+ *                                <--       HELLO (struct ..._hello)
+ *   BEGIN (struct ..._begin)     -->
+ *                                <--       SACK (credit)
+ *   DATA [base, credit)          -->
+ *                                <--       SACK (base, mask, credit)
+ *   ...
+ *                                <--       STATUS (struct ..._status)
+ *
+ * DATA frame seq carries data at seq * frame_size. The host sends all the
+ * frames of the window it has not seen acknowledged, then waits for SACK.
+ * The loader polls the UART, so it only grants credit while receiving and
+ * only transmits when all of it has been used or the line has been idle
+ * for MGOS_BOOT_RECOVER_IDLE_US, which is when missing frames are asked
+ * for. Flash writes happen in between windows; with devices that support
+ * async erase, erase overlaps reception of the next window.
+ *
+ * The watchdog is only fed while a host is talking to the loader, so an
+ * unattended unit still resets and retries.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_boot_cfg.h"
+
+#define MGOS_BOOT_RECOVER_MAGIC 0x4352424d /* "MBRC" */
+#define MGOS_BOOT_RECOVER_VERSION 1
+
+/* Payload of DATA frames. */
+#ifndef MGOS_BOOT_RECOVER_FRAME_SIZE
+#define MGOS_BOOT_RECOVER_FRAME_SIZE 1024
+#endif
+
+/* Frames buffered, at most 32. Fewer if there's not enough heap. */
+#ifndef MGOS_BOOT_RECOVER_WINDOW
+#define MGOS_BOOT_RECOVER_WINDOW 8
+#endif
+
+/* Silence after which the loader repeats SACK. */
+#ifndef MGOS_BOOT_RECOVER_IDLE_US
+#define MGOS_BOOT_RECOVER_IDLE_US 50000
+#endif
+
+/* Silence after which the host is assumed to be gone. */
+#ifndef MGOS_BOOT_RECOVER_TIMEOUT_US
+#define MGOS_BOOT_RECOVER_TIMEOUT_US 5000000
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum mgos_boot_recover_type {
+  MGOS_BOOT_RECOVER_HELLO = 1,
+  MGOS_BOOT_RECOVER_BEGIN = 2,
+  MGOS_BOOT_RECOVER_DATA = 3,
+  MGOS_BOOT_RECOVER_SACK = 4,
+  MGOS_BOOT_RECOVER_STATUS = 5,
+};
+
+struct mgos_boot_recover_hdr {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t len; /* Of the payload. */
+  uint32_t seq;
+  uint32_t crc32;
+};
+
+struct mgos_boot_recover_hello {
+  uint16_t version;
+  uint16_t frame_size;
+  uint8_t window;
+  uint8_t num_slots;
+  uint16_t reserved;
+};
+
+struct mgos_boot_recover_begin {
+  uint8_t slot;
+  uint8_t reserved[3];
+  uint32_t len;
+  uint32_t crc32;
+  /* Address the image is built for, 0 for the one of the slot. */
+  uint32_t org;
+};
+
+struct mgos_boot_recover_sack {
+  /* All frames before base have been received. */
+  uint32_t base;
+  /* Bit i: frame base + 1 + i has been received. */
+  uint32_t mask;
+  /* Frames up to this one may be sent. */
+  uint32_t credit;
+};
+
+enum mgos_boot_recover_status_code {
+  MGOS_BOOT_RECOVER_OK = 0,
+  MGOS_BOOT_RECOVER_ERR_SLOT = 1,
+  MGOS_BOOT_RECOVER_ERR_WRITE = 2,
+  MGOS_BOOT_RECOVER_ERR_CRC = 3,
+  MGOS_BOOT_RECOVER_ERR_CFG = 4,
+};
+
+struct mgos_boot_recover_status {
+  uint32_t status;
+  uint32_t crc32; /* Of the data written. */
+};
+
+/*
+ * Wait for the host and serve it. Returns only if recovery is not
+ * possible (cfg is NULL), restarts the system after an image has been
+ * written successfully.
+ */
+void mgos_boot_recover(struct mgos_boot_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
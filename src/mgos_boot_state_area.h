@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Boot state area: RAM the loader hands over to the app. It holds
+ * g_boot_state and the loader's records (boot trace, hot section record
+ * and log), each at a fixed offset, so the app finds them without
+ * knowing the loader's memory layout.
+ *
+ * On STM32 the area takes the first MGOS_BOOT_STATE_AREA_SIZE bytes of
+ * SRAM, it is the .boot_state section of ld/mgos_boot_stm32.ld (which
+ * also exports the size as _boot_state_size). The app's ld script must
+ * reserve the same bytes at the start of SRAM, as a NOLOAD section that
+ * its .data and .bss follow, otherwise these overwrite the records before
+ * they are picked up. On RS14100 the area is the stash at 0x21f000.
+ */
+
+#pragma once
+
+#define MGOS_BOOT_STATE_AREA_SIZE 0x1000
+
+/* Offsets in the area. The log ring takes the rest of it, so with these
+ * MGOS_BOOT_LOG_RING_SIZE can be up to 2804 bytes. */
+#define MGOS_BOOT_STATE_OFF 0x000 /* struct mgos_boot_state */
+#define MGOS_BOOT_TRACE_OFF 0x040 /* struct mgos_boot_trace */
+#define MGOS_BOOT_HOT_OFF 0x400   /* struct mgos_boot_hot */
+#define MGOS_BOOT_LOG_OFF 0x500   /* struct mgos_boot_log and the ring */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_stream.h"
+
+#include <string.h>
+
+#include "mgos_utils.h"
+
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_log.h"
+
+static bool dev_stream_fill(struct mgos_boot_dev_stream *ds, void *buf,
+                            size_t len) {
+  enum mgos_vfs_dev_err r = mgos_vfs_dev_read(ds->dev, ds->offset, len, buf);
+  if (r != 0) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Read err %s @ %lu: %d\n", ds->dev->name,
+                             (unsigned long) ds->offset, r));
+    return false;
+  }
+  ds->crc32 = mgos_boot_crc32(ds->crc32, buf, len);
+  ds->offset += len;
+  return true;
+}
+
+static bool dev_stream_read(struct mgos_boot_stream *s, void *buf,
+                            size_t len) {
+  struct mgos_boot_dev_stream *ds = (struct mgos_boot_dev_stream *) s;
+  uint8_t *p = (uint8_t *) buf;
+  if (len > ds->buf_len + (ds->end - ds->offset)) {
+    MGOS_BOOT_LOG(LL_ERROR, ("%s: unexpected end of data\n", ds->dev->name));
+    return false;
+  }
+  while (len > 0) {
+    if (ds->buf_len > 0) {
+      size_t n = MIN(len, ds->buf_len);
+      memcpy(p, ds->buf + ds->buf_pos, n);
+      ds->buf_pos += n;
+      ds->buf_len -= n;
+      p += n;
+      len -= n;
+    } else if (len >= sizeof(ds->buf)) {
+      /* Large reads go directly to the destination. */
+      return dev_stream_fill(ds, p, len);
+    } else {
+      size_t n = MIN(sizeof(ds->buf), ds->end - ds->offset);
+      if (!dev_stream_fill(ds, ds->buf, n)) return false;
+      ds->buf_pos = 0;
+      ds->buf_len = n;
+    }
+  }
+  return true;
+}
+
+void mgos_boot_dev_stream_init(struct mgos_boot_dev_stream *ds,
+                               struct mgos_vfs_dev *dev, size_t len) {
+  memset(ds, 0, sizeof(*ds));
+  ds->s.name = dev->name;
+  ds->s.read = dev_stream_read;
+  ds->dev = dev;
+  ds->end = len;
+}
+
+bool mgos_boot_dev_stream_finish(struct mgos_boot_dev_stream *ds,
+                                 size_t max_len) {
+  uint8_t buf[8];
+  size_t len = ds->buf_len + (ds->end - ds->offset);
+  if (len > max_len) return false;
+  while (len > 0) {
+    size_t n = MIN(len, sizeof(buf));
+    if (!ds->s.read(&ds->s, buf, n)) return false;
+    len -= n;
+  }
+  return true;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sequential data sources for the copy: data that is produced on the fly
+ * (patch application, decompression) rather than read from a device.
+ * Streams can be stacked, e.g. delta stream reads the patch from
+ * a device stream.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_boot_stream {
+  const char *name;
+  /* Produce the next len bytes into buf. */
+  bool (*read)(struct mgos_boot_stream *s, void *buf, size_t len);
+};
+
+/* Reads len bytes of a device sequentially, small reads are buffered. */
+struct mgos_boot_dev_stream {
+  struct mgos_boot_stream s;
+  struct mgos_vfs_dev *dev;
+  size_t offset, end;
+  /* CRC32 of the data read so far. */
+  uint32_t crc32;
+  uint8_t buf[128];
+  size_t buf_pos, buf_len;
+};
+
+void mgos_boot_dev_stream_init(struct mgos_boot_dev_stream *ds,
+                               struct mgos_vfs_dev *dev, size_t len);
+
+/*
+ * Consume the remaining data, if there is no more than max_len bytes of it,
+ * so that the CRC covers all of it. Returns false if there's more.
+ */
+bool mgos_boot_dev_stream_finish(struct mgos_boot_dev_stream *ds,
+                                 size_t max_len);
+
+#ifdef __cplusplus
+}
+#endif
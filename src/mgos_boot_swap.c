@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_swap.h"
+
+#include <string.h>
+
+#include "mgos_hal.h"
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "mgos_boot_hal.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_xcfg.h"
+
+enum swap_step {
+  SWAP_STEP_BACKUP = 0,  /* b -> scratch */
+  SWAP_STEP_INSTALL = 1, /* a -> b */
+  SWAP_STEP_RESTORE = 2, /* scratch -> a */
+};
+
+struct swap_ctx {
+  struct mgos_vfs_dev *da, *db, *ds;
+  size_t len;
+};
+
+static size_t swap_sector_end(struct mgos_vfs_dev *dev, size_t offset) {
+  size_t start, size;
+  if (!mgos_boot_dev_get_sector(dev, offset, &start, &size)) return 0;
+  return start + size;
+}
+
+/* Unit that starts at offset: whole sectors of both devices. */
+static bool swap_get_unit(const struct swap_ctx *sc, size_t offset,
+                          size_t *end) {
+  size_t e = offset, ea, eb;
+  do {
+    ea = swap_sector_end(sc->da, e);
+    eb = swap_sector_end(sc->db, e);
+    if (ea == 0 || eb == 0) return false;
+    e = MAX(ea, eb);
+  } while (swap_sector_end(sc->da, e - 1) != e ||
+           swap_sector_end(sc->db, e - 1) != e ||
+           e - offset < MGOS_BOOT_SWAP_MIN_UNIT);
+  if (e - offset > mgos_vfs_dev_get_size(sc->ds) ||
+      e > mgos_vfs_dev_get_size(sc->da) || e > mgos_vfs_dev_get_size(sc->db)) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Swap unit @ %lu is too big\n",
+                             (unsigned long) offset));
+    return false;
+  }
+  *end = e;
+  return true;
+}
+
+static bool swap_dev_same(struct mgos_vfs_dev *d1, size_t off1,
+                          struct mgos_vfs_dev *d2, size_t off2, size_t len) {
+  uint8_t b1[256], b2[256];
+  while (len > 0) {
+    size_t n = MIN(len, sizeof(b1));
+    if (mgos_vfs_dev_read(d1, off1, n, b1) != 0 ||
+        mgos_vfs_dev_read(d2, off2, n, b2) != 0 || memcmp(b1, b2, n) != 0) {
+      return false;
+    }
+    off1 += n;
+    off2 += n;
+    len -= n;
+    mgos_wdt_feed();
+  }
+  return true;
+}
+
+/* Identical units need not be swapped. */
+static bool swap_unit_same(const struct swap_ctx *sc, size_t offset,
+                           size_t len) {
+  return swap_dev_same(sc->da, offset, sc->db, offset, len);
+}
+
+/*
+ * Once the install step starts, scratch holds the only copy of the unit
+ * of b, so the backup is checked against b first.
+ */
+static bool swap_backup(const struct swap_ctx *sc, size_t offset,
+                        size_t len) {
+  if (!mgos_boot_copy_dev_range(sc->db, offset, sc->ds, 0, len, NULL)) {
+    return false;
+  }
+  if (!swap_dev_same(sc->db, offset, sc->ds, 0, len)) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Swap backup @ %lu is bad\n",
+                             (unsigned long) offset));
+    return false;
+  }
+  return true;
+}
+
+static bool swap_run(const struct swap_ctx *sc, size_t offset,
+                     enum swap_step step) {
+  while (offset < sc->len) {
+    size_t end, ul;
+    if (!swap_get_unit(sc, offset, &end)) return false;
+    ul = end - offset;
+    MGOS_BOOT_LOG(LL_DEBUG, ("Swap %lu/%lu, step %d\n", (unsigned long) offset,
+                             (unsigned long) sc->len, step));
+    if (step == SWAP_STEP_BACKUP) {
+      if (swap_unit_same(sc, offset, ul)) {
+        offset = end;
+        continue;
+      }
+      if (!swap_backup(sc, offset, ul) ||
+          !mgos_boot_xcfg_journal_add(offset, SWAP_STEP_INSTALL)) {
+        return false;
+      }
+      step = SWAP_STEP_INSTALL;
+    }
+    if (step == SWAP_STEP_INSTALL) {
+      if (!mgos_boot_copy_dev_range(sc->da, offset, sc->db, offset, ul,
+                                    NULL) ||
+          !mgos_boot_xcfg_journal_add(offset, SWAP_STEP_RESTORE)) {
+        return false;
+      }
+      step = SWAP_STEP_RESTORE;
+    }
+    if (!mgos_boot_copy_dev_range(sc->ds, 0, sc->da, offset, ul, NULL) ||
+        !mgos_boot_xcfg_journal_add(end, SWAP_STEP_BACKUP)) {
+      return false;
+    }
+    offset = end;
+    step = SWAP_STEP_BACKUP;
+  }
+  return true;
+}
+
+static void swap_slot_ref(int8_t *slot, int a, int b) {
+  if (*slot == a) {
+    *slot = b;
+  } else if (*slot == b) {
+    *slot = a;
+  }
+}
+
+/* Swap is done, update config to match. Scratch slot holds pieces of
+ * both images now, it no longer contains whatever it had before. */
+static bool swap_finish(struct mgos_boot_cfg *cfg, int a, int b,
+                        int scratch) {
+  struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  struct mgos_boot_slot_state tmp = cfg->slots[a].state;
+  struct mgos_boot_slot_state *ss = &cfg->slots[scratch].state;
+  cfg->slots[a].state = cfg->slots[b].state;
+  cfg->slots[b].state = tmp;
+  ss->app_len = 0;
+  ss->app_crc32 = 0;
+  ss->app_flags = 0;
+  mgos_boot_swap_fs_devs(cfg, a, b);
+  swap_slot_ref(&cfg->active_slot, a, b);
+  swap_slot_ref(&cfg->revert_slot, a, b);
+  if (!mgos_boot_cfg_write(cfg, MGOS_BOOT_LOG_CFG_DUMP)) return false;
+  xcfg->op.type = MGOS_BOOT_XCFG_OP_NONE;
+  return mgos_boot_xcfg_write();
+}
+
+static bool swap_open(const struct mgos_boot_cfg *cfg,
+                      const struct mgos_boot_xcfg_op *op,
+                      struct swap_ctx *sc) {
+  memset(sc, 0, sizeof(*sc));
+  sc->da = mgos_vfs_dev_open(cfg->slots[op->a].cfg.app_dev);
+  sc->db = mgos_vfs_dev_open(cfg->slots[op->b].cfg.app_dev);
+  sc->ds = mgos_vfs_dev_open(cfg->slots[op->c].cfg.app_dev);
+  sc->len = op->len;
+  return (sc->da != NULL && sc->db != NULL && sc->ds != NULL);
+}
+
+static void swap_close(struct swap_ctx *sc) {
+  mgos_vfs_dev_close(sc->da);
+  mgos_vfs_dev_close(sc->db);
+  mgos_vfs_dev_close(sc->ds);
+}
+
+/* Run or continue the swap recorded in xcfg. */
+static bool swap_do(struct mgos_boot_cfg *cfg) {
+  bool res = false;
+  struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  struct mgos_boot_xcfg_op *op = &xcfg->op;
+  const struct mgos_boot_slot_state *as = &cfg->slots[op->a].state;
+  const struct mgos_boot_slot_state *bs = &cfg->slots[op->b].state;
+  uint32_t offset = op->offset, step = op->value;
+  struct swap_ctx sc;
+  mgos_boot_xcfg_journal_get(0, &offset, &step);
+  if (!swap_open(cfg, op, &sc)) goto out;
+  if (!swap_run(&sc, offset, (enum swap_step) step)) goto out;
+  /* Both images are checked before config points at them. */
+  if (mgos_boot_checksum(sc.db, as->app_len) != as->app_crc32 ||
+      mgos_boot_checksum(sc.da, bs->app_len) != bs->app_crc32) {
+    MGOS_BOOT_LOG(LL_ERROR, ("Swap verification failed\n"));
+    goto out;
+  }
+  res = swap_finish(cfg, op->a, op->b, op->c);
+out:
+  swap_close(&sc);
+  return res;
+}
+
+bool mgos_boot_swap_wanted(const struct mgos_boot_cfg *cfg, int a, int b,
+                           int scratch) {
+  bool res = false;
+  struct mgos_vfs_dev *ds = NULL;
+  if (mgos_boot_xcfg_get() == NULL ||
+      (cfg->slots[a].state.app_flags &
+       (MGOS_BOOT_APP_F_DELTA | MGOS_BOOT_APP_F_LZ))) {
+    goto out;
+  }
+  ds = mgos_vfs_dev_open(cfg->slots[scratch].cfg.app_dev);
+  if (ds == NULL) goto out;
+  res = (mgos_vfs_dev_get_size(ds) < cfg->slots[b].state.app_len);
+out:
+  mgos_vfs_dev_close(ds);
+  return res;
+}
+
+bool mgos_boot_swap_slots(struct mgos_boot_cfg *cfg, int a, int b,
+                          int scratch) {
+  struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  struct mgos_boot_xcfg_op *op;
+  if (xcfg == NULL) return false;
+  op = &xcfg->op;
+  memset(op, 0, sizeof(*op));
+  op->type = MGOS_BOOT_XCFG_OP_SWAP;
+  op->cfg_seq = cfg->seq;
+  op->len = MAX(cfg->slots[a].state.app_len, cfg->slots[b].state.app_len);
+  op->a = a;
+  op->b = b;
+  op->c = scratch;
+  /* All three are written, ranges erased in advance are not used. */
+  xcfg->erased[a].len = xcfg->erased[b].len = xcfg->erased[scratch].len = 0;
+  MGOS_BOOT_LOG(LL_INFO, ("Swapping slots %d and %d (%lu) via %d\n", a, b,
+                          (unsigned long) op->len, scratch));
+  if (!mgos_boot_xcfg_write()) return false;
+  return swap_do(cfg);
+}
+
+bool mgos_boot_swap_resume(struct mgos_boot_cfg *cfg) {
+  struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  if (xcfg == NULL || xcfg->op.type != MGOS_BOOT_XCFG_OP_SWAP) return true;
+  if (xcfg->op.cfg_seq != cfg->seq) {
+    /* Config has been written since, swap was completed. */
+    xcfg->op.type = MGOS_BOOT_XCFG_OP_NONE;
+    return mgos_boot_xcfg_write();
+  }
+  MGOS_BOOT_LOG(LL_INFO, ("Resuming swap of slots %d and %d\n", xcfg->op.a,
+                          xcfg->op.b));
+  return swap_do(cfg);
+}
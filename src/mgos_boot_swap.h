@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Slot swap: exchange contents of two slots unit by unit, using one unit
+ * worth of scratch space at the start of the scratch slot's device.
+ * This is used to install an update into the bootable slot that holds
+ * the revert image when there is no temp slot large enough for a full
+ * backup. For each unit:
+ *   1. b -> scratch, 2. a -> b, 3. scratch -> a.
+ * Units consist of whole erase sectors of both slots. Completion of each
+ * step is recorded in the xcfg journal and repeating a step is harmless,
+ * so an interrupted swap is resumed on the next boot.
+ * Note that this writes about 3x image size in total, compared to 2x for
+ * backup + copy, but needs no full size temp slot.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "mgos_boot_cfg.h"
+
+/* Swap units are at least this large, to limit the number of steps. */
+#ifndef MGOS_BOOT_SWAP_MIN_UNIT
+#define MGOS_BOOT_SWAP_MIN_UNIT 65536
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns true if a should be installed into b by swapping: a contains
+ * a plain image, scratch is too small for a backup of b and the journal
+ * (xcfg) is available.
+ */
+bool mgos_boot_swap_wanted(const struct mgos_boot_cfg *cfg, int a, int b,
+                           int scratch);
+
+/*
+ * Swap slots a and b. On success slot states, fs devices and active and
+ * revert slot references are exchanged and config is written.
+ */
+bool mgos_boot_swap_slots(struct mgos_boot_cfg *cfg, int a, int b,
+                          int scratch);
+
+/*
+ * Complete the swap interrupted by reset, if any.
+ * Must be called before mgos_boot_select_slot.
+ */
+bool mgos_boot_swap_resume(struct mgos_boot_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
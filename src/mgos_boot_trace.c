@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_trace.h"
+
+#include <string.h>
+
+#include "mgos_utils.h"
+
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_dbg.h"
+#include "mgos_boot_hal.h"
+
+struct mgos_boot_trace g_boot_trace
+#if MGOS_BOOT_STATE_SECTION
+    __attribute__((section(".boot_state.trace")))
+#endif
+    ;
+
+static uint32_t s_start_us;
+
+static const char *const s_phase_names[MGOS_BOOT_TRACE_NUM_PHASES] = {
+    "early", "clock", "devs", "devtab", "cfg", "checksum", "copy", "jump",
+    "warm",
+};
+
+uint32_t __attribute__((weak)) mgos_boot_time_us(void) {
+  return 0;
+}
+
+static bool trace_active(void) {
+  return (g_boot_trace.magic == MGOS_BOOT_TRACE_MAGIC &&
+          g_boot_trace.crc32 == 0);
+}
+
+void mgos_boot_trace_init(uint32_t start_us) {
+  struct mgos_boot_trace_span sp;
+  memset(&g_boot_trace, 0, sizeof(g_boot_trace));
+  g_boot_trace.magic = MGOS_BOOT_TRACE_MAGIC;
+  g_boot_trace.size = sizeof(g_boot_trace);
+  s_start_us = start_us;
+  /* Early init is done by now, account for it retroactively. */
+  mgos_boot_trace_begin(&sp, MGOS_BOOT_TRACE_EARLY_INIT, NULL);
+  sp.start_us = start_us;
+  g_boot_trace.events[sp.ev].start_us = 0;
+  mgos_boot_trace_end(&sp, 0);
+}
+
+void mgos_boot_trace_begin(struct mgos_boot_trace_span *sp,
+                           enum mgos_boot_trace_phase phase, const char *dev) {
+  struct mgos_boot_trace *t = &g_boot_trace;
+  sp->phase = phase;
+  sp->ev = -1;
+  sp->start_us = mgos_boot_time_us();
+  sp->erases = t->erases;
+  if (!trace_active()) return;
+  if (t->num_events == ARRAY_SIZE(t->events)) {
+    if (t->num_dropped < 0xff) t->num_dropped++;
+    return;
+  }
+  struct mgos_boot_trace_event *ev = &t->events[t->num_events];
+  ev->phase = phase;
+  if (dev != NULL) strncpy(ev->dev, dev, sizeof(ev->dev));
+  ev->start_us = sp->start_us - s_start_us;
+  sp->ev = t->num_events++;
+}
+
+void mgos_boot_trace_end(struct mgos_boot_trace_span *sp, size_t bytes) {
+  struct mgos_boot_trace *t = &g_boot_trace;
+  if (!trace_active()) return;
+  uint32_t dur_us = mgos_boot_time_us() - sp->start_us;
+  uint32_t erases = t->erases - sp->erases;
+  struct mgos_boot_trace_phase_stats *ps = &t->phases[sp->phase];
+  ps->count++;
+  ps->erases += erases;
+  ps->us += dur_us;
+  ps->bytes += bytes;
+  if (sp->ev >= 0) {
+    struct mgos_boot_trace_event *ev = &t->events[sp->ev];
+    ev->erases = erases;
+    ev->dur_us = dur_us;
+    ev->bytes = bytes;
+  }
+}
+
+void mgos_boot_trace_io(size_t written, size_t erased) {
+  struct mgos_boot_trace *t = &g_boot_trace;
+  t->bytes_written += written;
+  if (erased > 0) {
+    t->bytes_erased += erased;
+    t->erases++;
+  }
+}
+
+void mgos_boot_trace_finish(void) {
+  struct mgos_boot_trace *t = &g_boot_trace;
+  if (!trace_active()) return;
+  t->total_us = mgos_boot_time_us() - s_start_us;
+  t->crc32 = mgos_boot_crc32(0, t, offsetof(struct mgos_boot_trace, crc32));
+}
+
+bool mgos_boot_trace_is_valid(const struct mgos_boot_trace *t) {
+  return (t->magic == MGOS_BOOT_TRACE_MAGIC && t->size == sizeof(*t) &&
+          t->crc32 ==
+              mgos_boot_crc32(0, t, offsetof(struct mgos_boot_trace, crc32)));
+}
+
+void mgos_boot_trace_dump(const struct mgos_boot_trace *t) {
+  if (!mgos_boot_trace_is_valid(t)) {
+    mgos_boot_dbg_printf("No boot trace\n");
+    return;
+  }
+  mgos_boot_dbg_printf("Loader time %lu us, wr %lu er %lu (%lu)\n",
+                       (unsigned long) t->total_us,
+                       (unsigned long) t->bytes_written,
+                       (unsigned long) t->bytes_erased,
+                       (unsigned long) t->erases);
+  for (int i = 0; i < t->num_events; i++) {
+    const struct mgos_boot_trace_event *ev = &t->events[i];
+    if (ev->phase >= MGOS_BOOT_TRACE_NUM_PHASES) continue;
+    mgos_boot_dbg_printf("  @%lu %s %.*s: %lu us, %lu B, %u er\n",
+                         (unsigned long) ev->start_us,
+                         s_phase_names[ev->phase], (int) sizeof(ev->dev),
+                         ev->dev, (unsigned long) ev->dur_us,
+                         (unsigned long) ev->bytes, ev->erases);
+  }
+  if (t->num_dropped > 0) {
+    mgos_boot_dbg_printf("  (%u more)\n", t->num_dropped);
+  }
+}
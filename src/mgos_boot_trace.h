@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Boot timing trace. The loader records how long each phase of the boot
+ * took, along with the amount of data processed and the number of erases,
+ * and leaves the record in RAM for the app to pick up, in the boot state
+ * area with g_boot_state (see mgos_boot_state_area.h), which is not
+ * initialized on reset. The host build keeps it in the boot state file.
+ *
+ * Time comes from mgos_boot_time_us, see mgos_boot_hal.h. The record is
+ * valid if magic and crc32 match, it is rewritten on every boot that
+ * goes through the loader.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MGOS_BOOT_TRACE_MAGIC 0x5254424d /* "MBTR" */
+
+/* Individual events kept, phase totals are kept regardless. */
+#ifndef MGOS_BOOT_TRACE_MAX_EVENTS
+#define MGOS_BOOT_TRACE_MAX_EVENTS 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum mgos_boot_trace_phase {
+  MGOS_BOOT_TRACE_EARLY_INIT = 0,
+  MGOS_BOOT_TRACE_CLOCK_INIT = 1, /* mgos_boot_init, debug output setup. */
+  MGOS_BOOT_TRACE_DEVS_INIT = 2,
+  MGOS_BOOT_TRACE_DEVTAB_INIT = 3,
+  MGOS_BOOT_TRACE_CFG_INIT = 4, /* Boot config and xcfg. */
+  MGOS_BOOT_TRACE_CHECKSUM = 5,
+  MGOS_BOOT_TRACE_COPY = 6,
+  /* From the boot decision to restart, the reset itself is not included. */
+  MGOS_BOOT_TRACE_JUMP = 7,
+  MGOS_BOOT_TRACE_WARM_CHECK = 8, /* See mgos_boot_warm.h. */
+  MGOS_BOOT_TRACE_NUM_PHASES,
+};
+
+struct mgos_boot_trace_event {
+  uint8_t phase;
+  uint8_t reserved;
+  uint16_t erases;
+  /* Device checksummed or copied to. */
+  char dev[8];
+  /* Since loader start. */
+  uint32_t start_us;
+  uint32_t dur_us;
+  /* Bytes checksummed or copied. */
+  uint32_t bytes;
+};
+
+struct mgos_boot_trace_phase_stats {
+  uint16_t count;
+  uint16_t erases;
+  uint32_t us;
+  uint32_t bytes;
+};
+
+struct mgos_boot_trace {
+  uint32_t magic;
+  uint16_t size; /* sizeof(struct mgos_boot_trace) */
+  uint8_t num_events;
+  uint8_t num_dropped; /* Events that did not fit. */
+  /* Loader start to restart into the app. */
+  uint32_t total_us;
+  /* Device totals. */
+  uint32_t bytes_written;
+  uint32_t bytes_erased;
+  uint32_t erases;
+  struct mgos_boot_trace_phase_stats phases[MGOS_BOOT_TRACE_NUM_PHASES];
+  struct mgos_boot_trace_event events[MGOS_BOOT_TRACE_MAX_EVENTS];
+  uint32_t crc32;
+};
+
+extern struct mgos_boot_trace g_boot_trace;
+
+/* Phase in progress, lives on the caller's stack. */
+struct mgos_boot_trace_span {
+  enum mgos_boot_trace_phase phase;
+  int ev;
+  uint32_t start_us;
+  uint32_t erases;
+};
+
+/* Start a new trace, start_us is the time the loader started. */
+void mgos_boot_trace_init(uint32_t start_us);
+
+void mgos_boot_trace_begin(struct mgos_boot_trace_span *sp,
+                           enum mgos_boot_trace_phase phase, const char *dev);
+void mgos_boot_trace_end(struct mgos_boot_trace_span *sp, size_t bytes);
+
+/* Account for device writes and erases. */
+void mgos_boot_trace_io(size_t written, size_t erased);
+
+/* Seal the record before handing control over to the app. */
+void mgos_boot_trace_finish(void);
+
+/* Check the record, for the app side. */
+bool mgos_boot_trace_is_valid(const struct mgos_boot_trace *t);
+
+void mgos_boot_trace_dump(const struct mgos_boot_trace *t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_warm.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_hal.h"
+#include "mgos_boot_log.h"
+
+#define MGOS_BOOT_WARM_SAMPLE_SIZE 2048
+
+bool __attribute__((weak)) mgos_boot_retained_read(void *data, size_t len) {
+  (void) data;
+  (void) len;
+  return false;
+}
+
+bool __attribute__((weak))
+mgos_boot_retained_write(const void *data, size_t len) {
+  (void) data;
+  (void) len;
+  return false;
+}
+
+static uint32_t warm_crc32(const struct mgos_boot_warm *w) {
+  return mgos_boot_crc32(0, w, offsetof(struct mgos_boot_warm, crc32));
+}
+
+/*
+ * Identify the config record in the area by its seq and CRC32, all zeroes
+ * if there is no valid record.
+ */
+static void warm_area_id(uint32_t addr, uint32_t *seq, uint32_t *crc32) {
+  const struct mgos_boot_cfg *c =
+      (const struct mgos_boot_cfg *) (uintptr_t) addr;
+  *seq = *crc32 = 0;
+  if (c->magic != MGOS_BOOT_CFG_MAGIC ||
+      c->crc32 !=
+          mgos_boot_crc32(0, c, offsetof(struct mgos_boot_cfg, crc32))) {
+    return;
+  }
+  *seq = c->seq;
+  *crc32 = c->crc32;
+}
+
+static bool warm_area_same(const struct mgos_boot_warm_area *a) {
+  uint32_t seq, crc32;
+  warm_area_id(a->addr, &seq, &crc32);
+  return (seq == a->seq && crc32 == a->crc32);
+}
+
+static uint32_t warm_app_sample(uintptr_t app_org, size_t len) {
+  const uint8_t *p = (const uint8_t *) app_org;
+  size_t first_len = MIN(len, MGOS_BOOT_WARM_SAMPLE_SIZE);
+  size_t last_len = MIN(len - first_len, MGOS_BOOT_WARM_SAMPLE_SIZE);
+  uint32_t crc32 = mgos_boot_crc32(0, p, first_len);
+  return mgos_boot_crc32(crc32, p + len - last_len, last_len);
+}
+
+static bool warm_get_area(const char *dev_name,
+                          struct mgos_boot_warm_area *a) {
+  struct mgos_vfs_dev *dev = mgos_vfs_dev_open(dev_name);
+  const void *p = (dev != NULL ? mgos_boot_dev_map(dev) : NULL);
+  bool res = (p != NULL &&
+              mgos_vfs_dev_get_size(dev) >= sizeof(struct mgos_boot_cfg));
+  if (res) {
+    a->addr = (uint32_t) (uintptr_t) p;
+    warm_area_id(a->addr, &a->seq, &a->crc32);
+  }
+  mgos_vfs_dev_close(dev);
+  return res;
+}
+
+bool mgos_boot_warm_check(int *slot, uintptr_t *app_org, uint32_t *app_len,
+                          bool *expired) {
+  bool res = false;
+  struct mgos_boot_warm w;
+  *expired = false;
+  if (MGOS_BOOT_WARM_MAX_BOOTS == 0 ||
+      !mgos_boot_retained_read(&w, sizeof(w)) ||
+      w.magic != MGOS_BOOT_WARM_MAGIC || w.crc32 != warm_crc32(&w)) {
+    return false;
+  }
+  if (w.num_boots >= MGOS_BOOT_WARM_MAX_BOOTS) {
+    *expired = true;
+    goto out;
+  }
+  for (size_t i = 0; i < ARRAY_SIZE(w.cfg); i++) {
+    if (!warm_area_same(&w.cfg[i])) {
+      MGOS_BOOT_LOG(LL_DEBUG, ("Config changed\n"));
+      goto out;
+    }
+  }
+  if (warm_app_sample(w.app_org, w.app_len) != w.app_sample_crc32) {
+    MGOS_BOOT_LOG(LL_WARN, ("Sample mismatch\n"));
+    goto out;
+  }
+  w.num_boots++;
+  w.crc32 = warm_crc32(&w);
+  if (!mgos_boot_retained_write(&w, sizeof(w))) goto out;
+  MGOS_BOOT_LOG(LL_INFO, ("Warm boot %u, seq %lu\n", w.num_boots,
+                          (unsigned long) w.cfg_seq));
+  *slot = w.slot;
+  *app_org = w.app_org;
+  *app_len = w.app_len;
+  res = true;
+out:
+  if (!res) mgos_boot_warm_clear();
+  return res;
+}
+
+void mgos_boot_warm_save(const struct mgos_boot_cfg *cfg) {
+  struct mgos_boot_warm w;
+  const struct mgos_boot_xcfg *xcfg = mgos_boot_xcfg_get();
+  const struct mgos_boot_slot *as = &cfg->slots[cfg->active_slot];
+  uint32_t flags = (MGOS_BOOT_F_COMMITTED | MGOS_BOOT_F_FIRST_BOOT_A |
+                    MGOS_BOOT_F_FIRST_BOOT_B | MGOS_BOOT_F_MERGE_FS);
+  if (MGOS_BOOT_WARM_MAX_BOOTS == 0) return;
+  if ((cfg->flags & flags) != MGOS_BOOT_F_COMMITTED ||
+      (xcfg != NULL && xcfg->op.type == MGOS_BOOT_XCFG_OP_SWAP) ||
+      as->cfg.app_map_addr != as->state.app_org) {
+    goto clear;
+  }
+  memset(&w, 0, sizeof(w));
+  w.magic = MGOS_BOOT_WARM_MAGIC;
+  w.cfg_seq = cfg->seq;
+  w.slot = cfg->active_slot;
+  w.app_org = as->state.app_org;
+  w.app_len = as->state.app_len;
+  if (!warm_get_area(MGOS_BOOT_WARM_CFG_DEV_0, &w.cfg[0]) ||
+      !warm_get_area(MGOS_BOOT_WARM_CFG_DEV_1, &w.cfg[1])) {
+    goto clear;
+  }
+  w.app_sample_crc32 = warm_app_sample(w.app_org, w.app_len);
+  w.crc32 = warm_crc32(&w);
+  if (mgos_boot_retained_write(&w, sizeof(w))) return;
+clear:
+  mgos_boot_warm_clear();
+}
+
+void mgos_boot_warm_clear(void) {
+  struct mgos_boot_warm w;
+  memset(&w, 0, sizeof(w));
+  mgos_boot_retained_write(&w, sizeof(w));
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Warm boot. When the loader boots a committed app, it leaves a record of
+ * the decision in retained storage (see mgos_boot_retained_read in
+ * mgos_boot_hal.h). On the following resets, if the boot config records
+ * and a sample of the app are unchanged, the app is booted straight away:
+ * devices, boot config and xcfg are not initialized and external flash is
+ * not accessed at all.
+ *
+ * Both boot config devices and the active slot must be memory-mapped.
+ * Records are identified by their seq and CRC32, any config write by the
+ * app (update, revert, commit) changes these and forces a full boot. Full
+ * boot is also done after MGOS_BOOT_WARM_MAX_BOOTS warm ones, so that the
+ * app gets a full checksum from time to time.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_boot_cfg.h"
+#include "mgos_boot_xcfg.h"
+
+#define MGOS_BOOT_WARM_MAGIC 0x4d57424d /* "MBWM" */
+
+#ifndef MGOS_BOOT_WARM_MAX_BOOTS
+#define MGOS_BOOT_WARM_MAX_BOOTS MGOS_BOOT_FULL_VERIFY_INTERVAL
+#endif
+
+/* Boot config devices, as set up by the bootloader library. */
+#define MGOS_BOOT_WARM_CFG_DEV_0 "bcfg0"
+#define MGOS_BOOT_WARM_CFG_DEV_1 "bcfg1"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Memory-mapped config area and the record in it, zeroes if invalid. */
+struct mgos_boot_warm_area {
+  uint32_t addr;
+  uint32_t seq;
+  uint32_t crc32; /* Of the record, as stored in it. */
+};
+
+/* Small enough to fit in STM32F4 RTC backup registers. */
+struct mgos_boot_warm {
+  uint32_t magic;
+  /* Config generation (seq) the decision was made from. */
+  uint32_t cfg_seq;
+  int8_t slot;
+  uint8_t num_boots; /* Warm boots since the record was made. */
+  uint16_t reserved;
+  uint32_t app_org;
+  uint32_t app_len;
+  /* Checksum of the first and last chunk of the app. */
+  uint32_t app_sample_crc32;
+  struct mgos_boot_warm_area cfg[2];
+  uint32_t crc32;
+};
+
+/*
+ * Check the warm boot record. Returns true and the slot to boot, with
+ * address and length of the app, if it is valid and nothing has changed
+ * since. Otherwise the record is removed, and expired is set if that is
+ * because it has been used MGOS_BOOT_WARM_MAX_BOOTS times: warm boots do
+ * not count towards the verified record tally, so the app must then get
+ * a full checksum.
+ */
+bool mgos_boot_warm_check(int *slot, uintptr_t *app_org, uint32_t *app_len,
+                          bool *expired);
+
+/*
+ * Record the boot decision after a full boot. Nothing is recorded if the
+ * config is not committed, a swap is in progress or storage is not
+ * mapped. Must be called with devices and config initialized.
+ */
+void mgos_boot_warm_save(const struct mgos_boot_cfg *cfg);
+
+void mgos_boot_warm_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_boot_xcfg.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "mgos_boot_crc32.h"
+#include "mgos_boot_hal.h"
+#include "mgos_boot_log.h"
+
+#define MGOS_BOOT_XCFG_MIN_BANK_SIZE 1024
+/* Minimum number of state records that fit in a bank. */
+#define MGOS_BOOT_XCFG_MIN_BANK_RECS 4
+
+static struct mgos_boot_xcfg s_xcfg;
+static struct mgos_vfs_dev *s_xcfg_dev = NULL;
+static size_t s_bank_size = 0, s_write_size = 0;
+static int s_bank = 0;
+/* End of the log in the current bank, 0 - bank must be switched. */
+static size_t s_log_end = 0;
+static uint8_t *s_rec_buf = NULL;
+static int s_num_fast_boots = 0;
+/* Last journal entries, s_journal_len counts all of them. */
+static struct mgos_boot_xcfg_jentry s_journal[MGOS_BOOT_XCFG_JOURNAL_DEPTH];
+static int s_journal_len = 0;
+
+static uint32_t xcfg_crc32(const struct mgos_boot_xcfg *xcfg) {
+  return mgos_boot_crc32(0, xcfg, offsetof(struct mgos_boot_xcfg, crc32));
+}
+
+static uint32_t xcfg_rec_check(const struct mgos_boot_xcfg_rec_hdr *hdr,
+                               const void *data) {
+  uint32_t crc = mgos_boot_crc32(
+      0, hdr, offsetof(struct mgos_boot_xcfg_rec_hdr, check));
+  return ~mgos_boot_crc32(crc, data, hdr->len);
+}
+
+static size_t xcfg_rec_size(size_t len) {
+  size_t size = sizeof(struct mgos_boot_xcfg_rec_hdr) + len;
+  return (size + s_write_size - 1) / s_write_size * s_write_size;
+}
+
+static size_t xcfg_bank_offset(int bank) {
+  return bank * s_bank_size;
+}
+
+static bool xcfg_is_erased(const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] != 0xff) return false;
+  }
+  return true;
+}
+
+/*
+ * Read and check the record at offset in bank. Data is left in s_rec_buf,
+ * after the header. Returns the record size, 0 if there is no valid record.
+ */
+static size_t xcfg_read_rec(int bank, size_t offset,
+                            struct mgos_boot_xcfg_rec_hdr **hdr) {
+  struct mgos_boot_xcfg_rec_hdr *h =
+      (struct mgos_boot_xcfg_rec_hdr *) s_rec_buf;
+  size_t bo = xcfg_bank_offset(bank);
+  if (offset + sizeof(*h) > s_bank_size ||
+      mgos_vfs_dev_read(s_xcfg_dev, bo + offset, sizeof(*h), h) != 0 ||
+      xcfg_is_erased(h, sizeof(*h)) ||
+      offset + xcfg_rec_size(h->len) > s_bank_size ||
+      xcfg_rec_size(h->len) > xcfg_rec_size(sizeof(s_xcfg)) ||
+      (h->len > 0 && mgos_vfs_dev_read(s_xcfg_dev, bo + offset + sizeof(*h),
+                                       h->len, h + 1) != 0) ||
+      h->check != xcfg_rec_check(h, h + 1)) {
+    return 0;
+  }
+  *hdr = h;
+  return xcfg_rec_size(h->len);
+}
+
+static bool xcfg_read_state(const struct mgos_boot_xcfg_rec_hdr *hdr,
+                            struct mgos_boot_xcfg *xcfg) {
+  if (hdr->type != MGOS_BOOT_XCFG_REC_STATE || hdr->len != sizeof(*xcfg)) {
+    return false;
+  }
+  memcpy(xcfg, hdr + 1, sizeof(*xcfg));
+  return (xcfg->magic == MGOS_BOOT_XCFG_MAGIC &&
+          xcfg->crc32 == xcfg_crc32(xcfg));
+}
+
+static bool xcfg_read_bank_state(int bank, struct mgos_boot_xcfg *xcfg) {
+  struct mgos_boot_xcfg_rec_hdr *hdr;
+  return (xcfg_read_rec(bank, 0, &hdr) > 0 && xcfg_read_state(hdr, xcfg));
+}
+
+static void xcfg_set_state(const struct mgos_boot_xcfg *xcfg) {
+  s_xcfg = *xcfg;
+  s_num_fast_boots = xcfg->fast_boots;
+  s_journal_len = 0;
+}
+
+static void xcfg_journal_push(const struct mgos_boot_xcfg_jentry *je) {
+  s_journal[s_journal_len % MGOS_BOOT_XCFG_JOURNAL_DEPTH] = *je;
+  s_journal_len++;
+}
+
+/* Replay the log of the current bank. */
+static void xcfg_read_log(void) {
+  struct mgos_boot_xcfg_rec_hdr *hdr;
+  struct mgos_boot_xcfg xcfg;
+  size_t offset = 0, size;
+  while ((size = xcfg_read_rec(s_bank, offset, &hdr)) > 0) {
+    switch (hdr->type) {
+      case MGOS_BOOT_XCFG_REC_STATE:
+        if (!xcfg_read_state(hdr, &xcfg)) goto out;
+        xcfg_set_state(&xcfg);
+        break;
+      case MGOS_BOOT_XCFG_REC_TALLY:
+        s_num_fast_boots++;
+        break;
+      case MGOS_BOOT_XCFG_REC_JOURNAL:
+        if (hdr->len != sizeof(struct mgos_boot_xcfg_jentry)) goto out;
+        xcfg_journal_push((const struct mgos_boot_xcfg_jentry *) (hdr + 1));
+        break;
+      default:
+        goto out;
+    }
+    offset += size;
+  }
+out:
+  s_log_end = offset;
+  /* Anything but erased space after the log means a damaged record. */
+  size = MIN(s_write_size, s_bank_size - offset);
+  if (size > 0 &&
+      (mgos_vfs_dev_read(s_xcfg_dev, xcfg_bank_offset(s_bank) + offset, size,
+                         s_rec_buf) != 0 ||
+       !xcfg_is_erased(s_rec_buf, size))) {
+    s_log_end = 0;
+  }
+}
+
+static bool xcfg_write_rec(int bank, size_t offset,
+                           enum mgos_boot_xcfg_rec_type type, const void *data,
+                           size_t len) {
+  struct mgos_boot_xcfg_rec_hdr *hdr =
+      (struct mgos_boot_xcfg_rec_hdr *) s_rec_buf;
+  size_t size = xcfg_rec_size(len);
+  memset(s_rec_buf, 0xff, size);
+  hdr->type = type;
+  hdr->len = len;
+  if (len > 0) memcpy(hdr + 1, data, len);
+  hdr->check = xcfg_rec_check(hdr, hdr + 1);
+  return (mgos_vfs_dev_write(s_xcfg_dev, xcfg_bank_offset(bank) + offset, size,
+                             s_rec_buf) == 0);
+}
+
+/* Append a record to the current bank, fails if it doesn't fit. */
+static bool xcfg_append(enum mgos_boot_xcfg_rec_type type,
+                        const void *data, size_t len) {
+  size_t offset = s_log_end;
+  if (offset == 0 || offset + xcfg_rec_size(len) > s_bank_size) return false;
+  /* Whatever happens, this space is used. */
+  s_log_end += xcfg_rec_size(len);
+  if (xcfg_write_rec(s_bank, offset, type, data, len)) return true;
+  s_log_end = 0;
+  return false;
+}
+
+/* Write the state, to the current bank if possible, else to the other. */
+static bool xcfg_write_state(void) {
+  int bank = s_bank ^ 1;
+  s_xcfg.seq++;
+  s_xcfg.crc32 = xcfg_crc32(&s_xcfg);
+  if (!xcfg_append(MGOS_BOOT_XCFG_REC_STATE, &s_xcfg, sizeof(s_xcfg))) {
+    if (mgos_vfs_dev_erase(s_xcfg_dev, xcfg_bank_offset(bank), s_bank_size) !=
+            0 ||
+        !xcfg_write_rec(bank, 0, MGOS_BOOT_XCFG_REC_STATE, &s_xcfg,
+                        sizeof(s_xcfg))) {
+      MGOS_BOOT_LOG(LL_ERROR, ("%s write failed\n", MGOS_BOOT_XCFG_DEV_NAME));
+      return false;
+    }
+    s_bank = bank;
+    s_log_end = xcfg_rec_size(sizeof(s_xcfg));
+  }
+  xcfg_set_state(&s_xcfg);
+  return true;
+}
+
+bool mgos_boot_xcfg_init(void) {
+  size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  struct mgos_boot_xcfg xcfg1;
+  size_t min_bank_size;
+  bool valid0, valid1;
+  s_xcfg_dev = mgos_vfs_dev_open(MGOS_BOOT_XCFG_DEV_NAME);
+  if (s_xcfg_dev == NULL) {
+    MGOS_BOOT_LOG(LL_WARN, ("No %s in devtab, extended state disabled\n",
+                            MGOS_BOOT_XCFG_DEV_NAME));
+    return false;
+  }
+  mgos_vfs_dev_get_erase_sizes(s_xcfg_dev, erase_sizes);
+  s_write_size = MAX(mgos_boot_dev_get_write_size(s_xcfg_dev), 4);
+  if (erase_sizes[0] == 0) goto err;
+  s_bank_size = erase_sizes[0];
+  min_bank_size = MAX(MGOS_BOOT_XCFG_MIN_BANK_SIZE,
+                      MGOS_BOOT_XCFG_MIN_BANK_RECS *
+                          xcfg_rec_size(sizeof(s_xcfg)));
+  while (s_bank_size < min_bank_size) {
+    s_bank_size += erase_sizes[0];
+  }
+  if (mgos_vfs_dev_get_size(s_xcfg_dev) < 2 * s_bank_size) goto err;
+  s_rec_buf = (uint8_t *) malloc(xcfg_rec_size(sizeof(s_xcfg)));
+  if (s_rec_buf == NULL) goto err;
+  valid0 = xcfg_read_bank_state(0, &s_xcfg);
+  valid1 = xcfg_read_bank_state(1, &xcfg1);
+  if (valid1 && (!valid0 || (int32_t)(xcfg1.seq - s_xcfg.seq) > 0)) {
+    s_bank = 1;
+  } else {
+    s_bank = 0;
+  }
+  if (!valid0 && !valid1) {
+    /* Not initialized yet or corrupted, start afresh. */
+    memset(&s_xcfg, 0, sizeof(s_xcfg));
+    s_xcfg.magic = MGOS_BOOT_XCFG_MAGIC;
+    xcfg_set_state(&s_xcfg);
+    /* Make sure the next write goes to bank 0. */
+    s_bank = 1;
+    s_log_end = 0;
+  } else {
+    xcfg_read_log();
+  }
+  return true;
+err:
+  MGOS_BOOT_LOG(LL_ERROR, ("%s: invalid layout\n", MGOS_BOOT_XCFG_DEV_NAME));
+  mgos_boot_xcfg_deinit();
+  return false;
+}
+
+struct mgos_boot_xcfg *mgos_boot_xcfg_get(void) {
+  return (s_xcfg_dev != NULL ? &s_xcfg : NULL);
+}
+
+bool mgos_boot_xcfg_write(void) {
+  if (s_xcfg_dev == NULL) return false;
+  s_xcfg.fast_boots = s_num_fast_boots;
+  return xcfg_write_state();
+}
+
+bool mgos_boot_xcfg_is_verified(const struct mgos_boot_cfg *cfg, int slot,
+                                uint32_t *sample_crc32) {
+  const struct mgos_boot_slot_state *ss = &cfg->slots[slot].state;
+  const struct mgos_boot_xcfg_slot *xs = &s_xcfg.slots[slot];
+  if (s_xcfg_dev == NULL || MGOS_BOOT_FULL_VERIFY_INTERVAL == 0) {
+    return false;
+  }
+  if (xs->app_len == 0 || xs->cfg_seq != cfg->seq ||
+      xs->app_org != (uint32_t) ss->app_org || xs->app_len != ss->app_len ||
+      xs->app_crc32 != ss->app_crc32) {
+    return false;
+  }
+  if (s_num_fast_boots >= MGOS_BOOT_FULL_VERIFY_INTERVAL) {
+    MGOS_BOOT_LOG(LL_DEBUG, ("Full verification is due\n"));
+    return false;
+  }
+  *sample_crc32 = xs->sample_crc32;
+  return true;
+}
+
+bool mgos_boot_xcfg_set_verified(const struct mgos_boot_cfg *cfg, int slot,
+                                 uint32_t sample_crc32) {
+  const struct mgos_boot_slot_state *ss = &cfg->slots[slot].state;
+  struct mgos_boot_xcfg_slot *xs = &s_xcfg.slots[slot];
+  if (s_xcfg_dev == NULL) return false;
+  xs->cfg_seq = cfg->seq;
+  xs->app_org = (uint32_t) ss->app_org;
+  xs->app_len = ss->app_len;
+  xs->app_crc32 = ss->app_crc32;
+  xs->sample_crc32 = sample_crc32;
+  s_xcfg.fast_boots = 0;
+  return xcfg_write_state();
+}
+
+bool mgos_boot_xcfg_set_erased(int slot, uint32_t offset, uint32_t len) {
+  struct mgos_boot_xcfg_erased *e;
+  if (s_xcfg_dev == NULL || slot < 0 || slot >= MGOS_BOOT_CFG_MAX_SLOTS) {
+    return false;
+  }
+  e = &s_xcfg.erased[slot];
+  e->offset = (len > 0 ? offset : 0);
+  e->len = len;
+  return mgos_boot_xcfg_write();
+}
+
+bool mgos_boot_xcfg_add_fast_boot(void) {
+  if (s_xcfg_dev == NULL) return false;
+  if (xcfg_append(MGOS_BOOT_XCFG_REC_TALLY, NULL, 0)) {
+    s_num_fast_boots++;
+    return true;
+  }
+  /* No room, carry the tally over with the state. */
+  s_xcfg.fast_boots = s_num_fast_boots + 1;
+  return xcfg_write_state();
+}
+
+bool mgos_boot_xcfg_journal_add(uint32_t offset, uint32_t value) {
+  struct mgos_boot_xcfg_jentry je = {.offset = offset, .value = value};
+  if (s_xcfg_dev == NULL) return false;
+  if (xcfg_append(MGOS_BOOT_XCFG_REC_JOURNAL, &je, sizeof(je))) {
+    xcfg_journal_push(&je);
+    return true;
+  }
+  /* No room, start a new journal. */
+  s_xcfg.op.offset = offset;
+  s_xcfg.op.value = value;
+  return mgos_boot_xcfg_write();
+}
+
+bool mgos_boot_xcfg_journal_get(int n, uint32_t *offset, uint32_t *value) {
+  const struct mgos_boot_xcfg_jentry *je;
+  if (s_xcfg_dev == NULL || n < 0 || n >= MGOS_BOOT_XCFG_JOURNAL_DEPTH ||
+      n >= s_journal_len) {
+    return false;
+  }
+  je = &s_journal[(s_journal_len - 1 - n) % MGOS_BOOT_XCFG_JOURNAL_DEPTH];
+  *offset = je->offset;
+  *value = je->value;
+  return true;
+}
+
+void mgos_boot_xcfg_deinit(void) {
+  mgos_vfs_dev_close(s_xcfg_dev);
+  s_xcfg_dev = NULL;
+  free(s_rec_buf);
+  s_rec_buf = NULL;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Extended loader state. Boot config layout is shared with the app,
+ * so state private to the loader is kept separately, on an optional
+ * device named "bxcfg" (two erase units, of at least 1K each).
+ * It is only used if the board's devtab declares it: the loader does not
+ * guess flash layout. Without it, features that depend on it are disabled.
+ *
+ * Storage is a log of records appended to one of two banks, so writes,
+ * fast boot tally and journal entries are a single program of a few
+ * write units (see mgos_boot_dev_get_write_size). The other bank is
+ * erased only when the current one fills up.
+ *
+ * Device layout. Banks are the erase size, or as many erase units as it
+ * takes to hold 1K and four state records. A record is struct
+ * mgos_boot_xcfg_rec_hdr followed by len bytes of data, padded with 0xff
+ * to a multiple of the write size (at least 4). Every bank starts with a
+ * state record, the bank whose first record is valid and has the higher
+ * seq is current. Records that follow are applied in order:
+ *   STATE: struct mgos_boot_xcfg, replaces the state, resets the tally
+ *     and the journal.
+ *   TALLY: no data, one boot that skipped full verification.
+ *   JOURNAL: struct mgos_boot_xcfg_jentry.
+ * The log ends at the first erased or invalid record. A record damaged by
+ * an interrupted write is never written over: the next write goes to the
+ * other bank, as it does when the current one is full. The other bank is
+ * erased and the state record is written first, so an interrupted
+ * compaction leaves the current bank intact.
+ *
+ * The app updates the state (e.g. erased, after erasing a slot) with
+ * mgos_boot_xcfg_set_erased, or, if it doesn't link this code, the same
+ * way: it takes the last state record of the current bank, updates the
+ * fields, increments seq, sets fast_boots to the tally (its fast_boots
+ * plus TALLY records after it) and recomputes crc32, then appends the
+ * record to the log. If the record doesn't fit or the log ends with a
+ * damaged record, it erases the other bank and writes the record there.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mgos_boot_cfg.h"
+
+#define MGOS_BOOT_XCFG_DEV_NAME "bxcfg"
+#define MGOS_BOOT_XCFG_MAGIC 0x4758434d /* "MCXG" */
+
+/* Journal entries kept in memory for mgos_boot_xcfg_journal_get. */
+#define MGOS_BOOT_XCFG_JOURNAL_DEPTH 4
+
+/* Do a full app checksum at least every N boots, 0 - on every boot. */
+#ifndef MGOS_BOOT_FULL_VERIFY_INTERVAL
+#define MGOS_BOOT_FULL_VERIFY_INTERVAL 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Record of the last successful full verification of a slot. */
+struct mgos_boot_xcfg_slot {
+  /*
+   * Config generation (sequence number) and slot state at the time of
+   * verification. Config seq changes on every write, by the loader or
+   * the app, so any copy, update or commit invalidates the record.
+   */
+  uint32_t cfg_seq;
+  uint32_t app_org;
+  uint32_t app_len;
+  uint32_t app_crc32;
+  /* Checksum of the samples that are checked on fast boot. */
+  uint32_t sample_crc32;
+};
+
+enum mgos_boot_xcfg_op_type {
+  MGOS_BOOT_XCFG_OP_NONE = 0,
+  /* Slot swap, see mgos_boot_swap.h. */
+  MGOS_BOOT_XCFG_OP_SWAP = 1,
+  /* Copy of the app between slots, see mgos_boot_copy_app. */
+  MGOS_BOOT_XCFG_OP_COPY = 2,
+};
+
+/*
+ * Long operation in progress. Progress is recorded in the journal,
+ * offset and value here are the starting point for journal entries.
+ */
+struct mgos_boot_xcfg_op {
+  uint8_t type;
+  /* Slots involved: swap - a, b and scratch; copy - src and dst. */
+  int8_t a, b, c;
+  /* Config generation when the operation was started. */
+  uint32_t cfg_seq;
+  uint32_t len;
+  /* Checksum of the source data. */
+  uint32_t src_crc32;
+  uint32_t offset;
+  uint32_t value;
+};
+
+/*
+ * Range of the slot's app device that has been erased in advance, by the
+ * app, while it had time to spare. Copy to the slot then only programs,
+ * sectors in the range are checked to be blank by reading a few bytes
+ * instead of all of them. The loader clears the range when it starts
+ * writing to the slot.
+ */
+struct mgos_boot_xcfg_erased {
+  uint32_t offset;
+  uint32_t len; /* 0 - none. */
+};
+
+struct mgos_boot_xcfg {
+  uint32_t magic; /* MGOS_BOOT_XCFG_MAGIC */
+  /* Incremented on every write, the latest record wins. */
+  uint32_t seq;
+  struct mgos_boot_xcfg_slot slots[MGOS_BOOT_CFG_MAX_SLOTS];
+  struct mgos_boot_xcfg_op op;
+  /* Fast boots counted when the record was written. */
+  uint32_t fast_boots;
+  struct mgos_boot_xcfg_erased erased[MGOS_BOOT_CFG_MAX_SLOTS];
+  /* CRC32 (as cs_crc32) of the fields above. */
+  uint32_t crc32;
+};
+
+enum mgos_boot_xcfg_rec_type {
+  MGOS_BOOT_XCFG_REC_STATE = 1,
+  MGOS_BOOT_XCFG_REC_TALLY = 2,
+  MGOS_BOOT_XCFG_REC_JOURNAL = 3,
+};
+
+struct mgos_boot_xcfg_rec_hdr {
+  uint16_t type;
+  uint16_t len; /* Of the data that follows. */
+  /*
+   * Inverted CRC32 of the header up to this field and the data, so that a
+   * zeroed record is not valid.
+   */
+  uint32_t check;
+};
+
+struct mgos_boot_xcfg_jentry {
+  uint32_t offset;
+  uint32_t value;
+};
+
+/* Read extended state. Returns false if not available, this is not fatal. */
+bool mgos_boot_xcfg_init(void);
+
+/* Returns NULL if extended state is not available. */
+struct mgos_boot_xcfg *mgos_boot_xcfg_get(void);
+
+/* Write the state. Journal is reset, fast boot tally is carried over. */
+bool mgos_boot_xcfg_write(void);
+
+/*
+ * Returns true if slot has been fully verified in its current state and
+ * full verification is not due yet. Expected sample checksum is returned.
+ */
+bool mgos_boot_xcfg_is_verified(const struct mgos_boot_cfg *cfg, int slot,
+                                uint32_t *sample_crc32);
+
+/* Record successful full verification of the slot, resets the tally. */
+bool mgos_boot_xcfg_set_verified(const struct mgos_boot_cfg *cfg, int slot,
+                                 uint32_t sample_crc32);
+
+/*
+ * Record that len bytes at offset of the slot's app device are erased.
+ * For the app: call after erasing the slot and, with len of 0, before
+ * writing anything to it.
+ */
+bool mgos_boot_xcfg_set_erased(int slot, uint32_t offset, uint32_t len);
+
+/* Count a boot that skipped full verification. */
+bool mgos_boot_xcfg_add_fast_boot(void);
+
+/*
+ * Journal of the operation in progress: a sequence of (offset, value)
+ * progress records that are appended without erasing. When the bank
+ * fills up, the last entry is moved to the op record.
+ * Journal is cleared by mgos_boot_xcfg_write.
+ */
+bool mgos_boot_xcfg_journal_add(uint32_t offset, uint32_t value);
+
+/*
+ * Get the n-th last valid journal entry (0 - the last one), n must be
+ * less than MGOS_BOOT_XCFG_JOURNAL_DEPTH.
+ * Returns false if there are not that many.
+ */
+bool mgos_boot_xcfg_journal_get(int n, uint32_t *offset, uint32_t *value);
+
+void mgos_boot_xcfg_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
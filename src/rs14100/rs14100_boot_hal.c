@@ -21,8 +21,15 @@
 
 #include "mgos_boot_cfg.h"
 #include "mgos_boot_dbg.h"
+#include "mgos_boot_hot.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_state_area.h"
+#include "mgos_boot_trace.h"
 #include "mgos_hal.h"
 #include "mgos_uart.h"
+#include "mgos_utils.h"
 #include "mgos_vfs_dev_part.h"
 
 #include "rs14100_sdk.h"
@@ -32,8 +39,6 @@
 
 #define FLASH_BASE QSPI_AUTOM_CHIP0_ADDRESS
 
-extern uint32_t mgos_boot_checksum(struct mgos_vfs_dev *src, size_t len);
-
 bool mgos_boot_print_app_info(uintptr_t app_org) {
   if (app_org < FLASH_BASE || app_org > FLASH_BASE + 4 * 1024 * 1024) {
     mgos_boot_dbg_printf("Invalid app address\n");
@@ -72,6 +77,23 @@ void mgos_boot_app(uintptr_t app_org) {
   }
 }
 
+/* Cycle counter, extended in software and scaled by the current clock. */
+uint32_t mgos_boot_time_us(void) {
+  static uint32_t s_last_cyc, s_rem_cyc, s_us;
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+  uint32_t cyc = DWT->CYCCNT, mhz = SystemCoreClock / 1000000;
+  uint32_t n = s_rem_cyc + (cyc - s_last_cyc);
+  if (mhz == 0) mhz = 1;
+  s_last_cyc = cyc;
+  s_us += n / mhz;
+  s_rem_cyc = n % mhz;
+  return s_us;
+}
+
 extern void rs14100_clock_config(uint32_t cpu_freq);
 extern void (*mgos_nsleep100)(uint32_t n);
 extern void mgos_nsleep100_impl(uint32_t n);
@@ -89,6 +111,16 @@ bool mgos_boot_devs_init(void) {
           mgos_vfs_dev_part_init());
 }
 
+/* App slots are in QSPI flash, which stays in auto mode between commands. */
+const void *mgos_boot_dev_map(struct mgos_vfs_dev *dev) {
+  if (strcmp(dev->name, "app0") == 0) {
+    return (const void *) (FLASH_BASE + MGOS_BOOT_APP0_OFFSET);
+  } else if (strcmp(dev->name, "app1") == 0) {
+    return (const void *) (FLASH_BASE + MGOS_BOOT_APP1_OFFSET);
+  }
+  return NULL;
+}
+
 void mgos_boot_cfg_set_default_slots(struct mgos_boot_cfg *cfg) {
   struct mgos_boot_slot_cfg *sc;
   struct mgos_boot_slot_state *ss;
@@ -103,9 +135,8 @@ void mgos_boot_cfg_set_default_slots(struct mgos_boot_cfg *cfg) {
   sc->flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
   sc->app_map_addr = FLASH_BASE + MGOS_BOOT_APP0_OFFSET;
   ss->app_org = sc->app_map_addr; /* Directly bootable */
-  /* Note: we don't know the actual length of the FW. */
-  ss->app_len = mgos_vfs_dev_get_size(app0_dev);
-  ss->app_crc32 = mgos_boot_checksum(app0_dev, ss->app_len);
+  /* Actual length of the FW is taken from the image trailer, if any. */
+  mgos_boot_img_get_info(app0_dev, &ss->app_len, &ss->app_crc32);
   /* Slot 1. */
   sc = &cfg->slots[1].cfg;
   ss = &cfg->slots[1].state;
@@ -129,25 +160,57 @@ bool mgos_boot_dbg_setup(void) {
   return mgos_uart_configure(MGOS_DEBUG_UART, &cfg);
 }
 
-void mgos_boot_dbg_putc(char c) {
+void mgos_boot_dbg_uart_putc(char c) {
   rs14100_uart_putc(MGOS_DEBUG_UART, c);
 }
 
 /* Lower RAM addresses get scribbled on by (presumably) ROM so we need
  * a location to stash it during final reboot.
  * mgos_boot_system_restart stashes it and
- * mgos_boot_early_init retrieves it. */
+ * mgos_boot_early_init retrieves it.
+ * Boot trace, log and hot section record are stashed with it, at the
+ * offsets of the boot state area, and stay there for the app. */
 extern struct mgos_boot_state g_boot_state;
-#define BOOT_STATE_STASH_LOCATION ((void *) 0x21f000)
+#define BOOT_STASH_LOCATION(off) ((void *) (0x21f000 + (off)))
+#define BOOT_STATE_STASH_LOCATION BOOT_STASH_LOCATION(MGOS_BOOT_STATE_OFF)
+#define BOOT_TRACE_STASH_LOCATION BOOT_STASH_LOCATION(MGOS_BOOT_TRACE_OFF)
+#define BOOT_LOG_STASH_LOCATION BOOT_STASH_LOCATION(MGOS_BOOT_LOG_OFF)
+#define BOOT_HOT_STASH_LOCATION BOOT_STASH_LOCATION(MGOS_BOOT_HOT_OFF)
+
+_Static_assert(sizeof(g_boot_state) <= MGOS_BOOT_TRACE_OFF, "state");
+_Static_assert(sizeof(g_boot_trace) <= MGOS_BOOT_HOT_OFF - MGOS_BOOT_TRACE_OFF,
+               "trace");
+_Static_assert(sizeof(g_boot_hot) <= MGOS_BOOT_LOG_OFF - MGOS_BOOT_HOT_OFF,
+               "hot");
+_Static_assert(sizeof(struct mgos_boot_log) + MGOS_BOOT_LOG_RING_SIZE <=
+                   MGOS_BOOT_STATE_AREA_SIZE - MGOS_BOOT_LOG_OFF,
+               "log");
 
 void mgos_boot_system_restart(void) {
+  const struct mgos_boot_log *log = mgos_boot_log_get();
   memcpy(BOOT_STATE_STASH_LOCATION, &g_boot_state, sizeof(g_boot_state));
+  memcpy(BOOT_TRACE_STASH_LOCATION, &g_boot_trace, sizeof(g_boot_trace));
+  if (log != NULL) {
+    memcpy(BOOT_LOG_STASH_LOCATION, log, sizeof(*log) + log->size);
+  }
+  memcpy(BOOT_HOT_STASH_LOCATION, &g_boot_hot, sizeof(g_boot_hot));
   mgos_dev_system_restart();
 }
 
 void mgos_boot_early_init(void) {
   memcpy(&g_boot_state, BOOT_STATE_STASH_LOCATION, sizeof(g_boot_state));
   memset(BOOT_STATE_STASH_LOCATION, 0, sizeof(g_boot_state));
+  memcpy(&g_boot_hot, BOOT_HOT_STASH_LOCATION, sizeof(g_boot_hot));
+}
+
+/*
+ * Hot sections may use SRAM below the stash and the loader's stack, which
+ * is at the top. Stack is shallower after restart than it is now.
+ */
+bool mgos_boot_hot_mem_ok(uintptr_t addr, size_t len) {
+  uintptr_t top =
+      MIN(__get_MSP() - 1024, (uintptr_t) BOOT_STATE_STASH_LOCATION);
+  return (addr >= SRAM_BASE && addr + len <= top);
 }
 
 int main(void) {
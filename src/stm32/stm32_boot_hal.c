@@ -19,11 +19,15 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common/str_util.h"
 
 #include "mgos_boot_cfg.h"
 #include "mgos_boot_dbg.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_main.h"
 #include "mgos_hal.h"
 #include "mgos_vfs_dev_part.h"
 #include "mgos_vfs_dev_spi_flash.h"
@@ -40,16 +44,152 @@ bool mgos_boot_dbg_setup(void) {
   return mgos_uart_configure(MGOS_DEBUG_UART, &cfg);
 }
 
-void mgos_boot_dbg_putc(char c) {
+void mgos_boot_dbg_uart_putc(char c) {
   stm32_uart_putc(MGOS_DEBUG_UART, c);
 }
 
+static USART_TypeDef *stm32_dbg_uart_regs(void) {
+  switch (MGOS_DEBUG_UART) {
+#ifdef USART1
+    case 1:
+      return USART1;
+#endif
+#ifdef USART2
+    case 2:
+      return USART2;
+#endif
+#ifdef USART3
+    case 3:
+      return USART3;
+#endif
+#ifdef UART4
+    case 4:
+      return UART4;
+#endif
+#ifdef UART5
+    case 5:
+      return UART5;
+#endif
+#ifdef USART6
+    case 6:
+      return USART6;
+#endif
+  }
+  return NULL;
+}
+
+/* Polled, the loader does not use UART interrupts. */
+int mgos_boot_dbg_uart_getc(void) {
+  USART_TypeDef *regs = stm32_dbg_uart_regs();
+  if (regs == NULL) return -1;
+#ifdef USART_ISR_RXNE
+  /* Overrun stops reception until cleared. */
+  if (regs->ISR & USART_ISR_ORE) regs->ICR = USART_ICR_ORECF;
+  if (!(regs->ISR & USART_ISR_RXNE)) return -1;
+  return (uint8_t) regs->RDR;
+#else
+  /* Reading SR and then DR also clears overrun. */
+  if (!(regs->SR & USART_SR_RXNE)) return -1;
+  return (uint8_t) regs->DR;
+#endif
+}
+
 bool mgos_boot_devs_init(void) {
   return (stm32_vfs_dev_flash_register_type() && mgos_vfs_dev_part_init() &&
           mgos_vfs_dev_spi_flash_init());
 }
 
-extern uint32_t mgos_boot_checksum(struct mgos_vfs_dev *src, size_t len);
+#ifdef CRC_CR_REV_IN
+/*
+ * CRC unit on F7 and L4 has programmable initial value and input/output
+ * bit reversal, which allows it to compute the standard (reflected) CRC32.
+ * Reflected CRC is the same as the MSB-first CRC of bit-reversed input,
+ * with initial value and result bit-reversed as well.
+ * F2 and F4 units are fixed to MSB-first, these use software CRC.
+ */
+bool mgos_boot_hw_crc32(uint32_t *crc32, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  __HAL_RCC_CRC_CLK_ENABLE();
+  CRC->POL = 0x04C11DB7;
+  CRC->INIT = __RBIT(~*crc32);
+  /* Byte-wise input reversal for the unaligned head. */
+  CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+  while (len > 0 && ((uintptr_t) p & 3) != 0) {
+    *((volatile uint8_t *) &CRC->DR) = *p++;
+    len--;
+  }
+  /* Word-wise reversal puts the first (lowest) byte first. */
+  CRC->CR = CRC_CR_REV_IN | CRC_CR_REV_OUT;
+  while (len >= 4) {
+    CRC->DR = *((const uint32_t *) p);
+    p += 4;
+    len -= 4;
+  }
+  CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;
+  while (len > 0) {
+    *((volatile uint8_t *) &CRC->DR) = *p++;
+    len--;
+  }
+  *crc32 = ~CRC->DR;
+  return true;
+}
+#endif
+
+/*
+ * app0 is in the internal flash, which has non-uniform sectors on F2/F4/F7.
+ * SPI flash sectors are uniform.
+ */
+bool mgos_boot_dev_get_sector(struct mgos_vfs_dev *dev, size_t offset,
+                              size_t *start, size_t *size) {
+  if (strcmp(dev->name, "app0") == 0) {
+    int sector = stm32_flash_get_sector(MGOS_BOOT_APP0_OFFSET + offset);
+    if (sector < 0) return false;
+    *start = stm32_flash_get_sector_offset(sector) - MGOS_BOOT_APP0_OFFSET;
+    *size = stm32_flash_get_sector_size(sector);
+  } else {
+    size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+    mgos_vfs_dev_get_erase_sizes(dev, erase_sizes);
+    if (erase_sizes[0] == 0) return false;
+    *start = offset - offset % erase_sizes[0];
+    *size = erase_sizes[0];
+  }
+  return true;
+}
+
+/*
+ * app0 is in the internal flash, and so is boot config: two devices set up
+ * by the bootloader library between the loader and app0. Their placement
+ * is checked against the contents.
+ */
+const void *mgos_boot_dev_map(struct mgos_vfs_dev *dev) {
+  size_t cfg_size = (MGOS_BOOT_APP0_OFFSET - STM32_FLASH_BL_SIZE) / 2;
+  uintptr_t addr = FLASH_BASE + STM32_FLASH_BL_SIZE;
+  uint8_t buf[16];
+  if (strcmp(dev->name, "app0") == 0) {
+    return (const void *) (FLASH_BASE + MGOS_BOOT_APP0_OFFSET);
+  }
+  if (strcmp(dev->name, "bcfg1") == 0) {
+    addr += cfg_size;
+  } else if (strcmp(dev->name, "bcfg0") != 0) {
+    return NULL;
+  }
+  if (mgos_vfs_dev_get_size(dev) != cfg_size ||
+      mgos_vfs_dev_read(dev, 0, sizeof(buf), buf) != 0 ||
+      memcmp(buf, (const void *) addr, sizeof(buf)) != 0) {
+    return NULL;
+  }
+  return (const void *) addr;
+}
+
+/* L4 flash has ECC, programmed double words cannot be modified. */
+bool mgos_boot_dev_can_overwrite(struct mgos_vfs_dev *dev) {
+#ifdef STM32L4
+  (void) dev;
+  return false;
+#else
+  return (strcmp(dev->name, "app0") == 0);
+#endif
+}
 
 void mgos_boot_cfg_set_default_slots(struct mgos_boot_cfg *cfg) {
   struct mgos_boot_slot_cfg *sc;
@@ -65,9 +205,8 @@ void mgos_boot_cfg_set_default_slots(struct mgos_boot_cfg *cfg) {
   sc->flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
   sc->app_map_addr = FLASH_BASE + MGOS_BOOT_APP0_OFFSET;
   ss->app_org = sc->app_map_addr; /* Directly bootable */
-  /* Note: we don't know the actual length of the FW. */
-  ss->app_len = mgos_vfs_dev_get_size(app0_dev);
-  ss->app_crc32 = mgos_boot_checksum(app0_dev, ss->app_len);
+  /* Actual length of the FW is taken from the image trailer, if any. */
+  mgos_boot_img_get_info(app0_dev, &ss->app_len, &ss->app_crc32);
   /* Slot 1 - on SPI flash, not mappable. */
   sc = &cfg->slots[1].cfg;
   ss = &cfg->slots[1].state;
@@ -113,7 +252,7 @@ struct int_vectors {
 };
 
 void exc_handler(void) {
-  mgos_boot_dbg_putc('X');
+  mgos_boot_dbg_uart_putc('X');
   while (1) {
   }
 }
@@ -121,11 +260,12 @@ void exc_handler(void) {
 void exc_handler2(void) {
   uint32_t hfsr = SCB->HFSR, cfsr = SCB->CFSR;
   mgos_boot_dbg_printf("!!! H 0x%lx C 0x%lx sp %p\n", hfsr, cfsr, &hfsr);
+  mgos_boot_log_flush();
   while (1) {
   }
 }
 
-extern uint32_t _stack;
+extern uint32_t _stack, _stack_size, _heap_start;
 extern void stm32_entry(void);
 extern void arm_exc_handler_top(void);
 
@@ -176,6 +316,22 @@ void mgos_boot_app(uintptr_t app_org) {
   }
 }
 
+/*
+ * Hot sections may use SRAM between the loader's .bss and its stack, i.e.
+ * the heap, which is not in use when they are loaded, and all of CCM, if
+ * there is one. Loader's .data (with the code that does the copying) and
+ * .bss are below the heap. On F4 CCM is not executable, only data can go
+ * there.
+ */
+bool mgos_boot_hot_mem_ok(uintptr_t addr, size_t len) {
+  uintptr_t end = addr + len;
+#ifdef CCMDATARAM_BASE
+  if (addr >= CCMDATARAM_BASE && end <= CCMDATARAM_END + 1) return true;
+#endif
+  return (addr >= (uintptr_t) &_heap_start &&
+          end <= (uintptr_t) &_stack - (uintptr_t) &_stack_size);
+}
+
 /*
  * Use last 8 bytes of the boot loader area to keep the "already inited" flag.
  * 8 bytes to satisfy STM32L4 flash write 64-bit alignment requirement.
@@ -203,6 +359,65 @@ void mgos_boot_system_restart(void) {
   mgos_dev_system_restart();
 }
 
+#ifdef DWT_CTRL_CYCCNTENA_Msk
+/* Cycle counter, extended in software and scaled by the current clock. */
+uint32_t mgos_boot_time_us(void) {
+  static uint32_t s_last_cyc, s_rem_cyc, s_us;
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+#if __CORTEX_M == 7
+    DWT->LAR = 0xc5acce55; /* Unlock */
+#endif
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+  uint32_t cyc = DWT->CYCCNT, mhz = SystemCoreClock / 1000000;
+  uint32_t n = s_rem_cyc + (cyc - s_last_cyc);
+  if (mhz == 0) mhz = 1;
+  s_last_cyc = cyc;
+  s_us += n / mhz;
+  s_rem_cyc = n % mhz;
+  return s_us;
+}
+#endif
+
+/*
+ * RTC backup registers keep the warm boot record. They survive reset
+ * (and power loss, with VBAT), the record takes the last ones.
+ */
+#ifdef RTC_BKP31R_Pos
+#define STM32_BKP_NUM_REGS 32
+#else
+#define STM32_BKP_NUM_REGS 20
+#endif
+
+static volatile uint32_t *stm32_bkp_regs(size_t len) {
+  size_t n = len / 4;
+  if (len % 4 != 0 || n > STM32_BKP_NUM_REGS) return NULL;
+  __HAL_RCC_PWR_CLK_ENABLE();
+#ifdef __HAL_RCC_RTCAPB_CLK_ENABLE
+  __HAL_RCC_RTCAPB_CLK_ENABLE();
+#endif
+  HAL_PWR_EnableBkUpAccess();
+  return &RTC->BKP0R + (STM32_BKP_NUM_REGS - n);
+}
+
+bool mgos_boot_retained_read(void *data, size_t len) {
+  volatile uint32_t *regs = stm32_bkp_regs(len);
+  uint32_t *p = (uint32_t *) data;
+  if (regs == NULL) return false;
+  for (size_t i = 0; i < len / 4; i++) p[i] = regs[i];
+  return true;
+}
+
+bool mgos_boot_retained_write(const void *data, size_t len) {
+  volatile uint32_t *regs = stm32_bkp_regs(len);
+  const uint32_t *p = (const uint32_t *) data;
+  if (regs == NULL) return false;
+  for (size_t i = 0; i < len / 4; i++) regs[i] = p[i];
+  return true;
+}
+
 extern struct mgos_boot_state g_boot_state;
 
 void mgos_boot_init(void) {
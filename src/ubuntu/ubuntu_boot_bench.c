@@ -0,0 +1,659 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Boot path benchmark: runs the loader's checksum, copy and swap sequences
+ * over simulated flash and reports time, throughput and flash traffic.
+ * Flash is memory-backed and wiped before each scenario, only the scenario
+ * itself is measured (not the setup).
+ */
+
+#include "ubuntu_boot_bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/cs_crc32.h"
+
+#include "mgos_boot_cfg.h"
+#include "mgos_boot_delta.h"
+#include "mgos_boot_hal.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_lz.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_swap.h"
+#include "mgos_boot_warm.h"
+#include "mgos_boot_xcfg.h"
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "ubuntu_boot_ota.h"
+#include "ubuntu_sim_flash.h"
+
+#define BENCH_SLOT_APP0 0
+#define BENCH_SLOT_APP1 1
+#define BENCH_SLOT_TEMP 2
+
+struct bench_model {
+  const char *name;
+  const char *chip;
+  struct ubuntu_sim_flash_model model;
+};
+
+static const struct bench_model s_models[] = {
+    {"stm32f4", "int",
+     {.sectors = "4x16K,1x64K,7x128K", .page_size = 4, .read_op_ns = 100,
+      .read_ns_per_kb = 6000, .prog_page_us = 16, .erase_base_us = 130000,
+      .erase_us_per_kb = 7000}},
+    {"stm32l4", "int",
+     {.sectors = "512x2K", .page_size = 8, .read_op_ns = 100,
+      .read_ns_per_kb = 6000, .prog_page_us = 82, .erase_base_us = 22000,
+      .erase_us_per_kb = 0}},
+    {"spi-nor", "ext",
+     {.sectors = "2048x4K", .block_sizes = {32768, 65536}, .page_size = 256,
+      .read_op_ns = 2000, .read_ns_per_kb = 200000, .prog_page_us = 700,
+      .erase_base_us = 40000, .erase_us_per_kb = 1700}},
+    {"qspi-nor", "ext",
+     {.sectors = "2048x4K", .block_sizes = {32768, 65536}, .page_size = 256,
+      .read_op_ns = 1000, .read_ns_per_kb = 25000, .prog_page_us = 400,
+      .erase_base_us = 30000, .erase_us_per_kb = 1000}},
+    {"spi-nand", "ext",
+     {.sectors = "64x128K", .page_size = 2048, .read_op_ns = 25000,
+      .read_ns_per_kb = 50000, .prog_page_us = 300, .erase_base_us = 2000,
+      .erase_us_per_kb = 0, .nand = true}},
+};
+
+struct bench_result {
+  uint64_t time_ns;
+  uint64_t cpu_ns;
+  struct ubuntu_sim_flash_stats st;
+};
+
+static uint64_t bench_cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_gen_image(uint8_t *buf, size_t len, uint32_t seed,
+                            uintptr_t org) {
+  uint32_t x = seed * 2654435761U + 1;
+  for (size_t i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = (uint8_t) x;
+  }
+  /* Make it look like a valid Cortex-M image. */
+  uint32_t vectors[2] = {0x20020000, (uint32_t) org + 0x201};
+  memcpy(buf, vectors, sizeof(vectors));
+}
+
+static bool bench_write_slot(struct mgos_boot_cfg *cfg, int slot,
+                             const uint8_t *img, size_t len, uintptr_t org) {
+  struct mgos_boot_slot *s = &cfg->slots[slot];
+  struct mgos_vfs_dev *dev = mgos_vfs_dev_open(s->cfg.app_dev);
+  /* Chips are wiped before each scenario, no need to erase.
+   * Pad to whole pages, NAND can't program partial ones. */
+  size_t wlen = (len + 4095) & ~4095UL;
+  uint8_t *buf = (uint8_t *) malloc(wlen);
+  memset(buf, 0xff, wlen);
+  memcpy(buf, img, len);
+  bool res = (dev != NULL && mgos_vfs_dev_write(dev, 0, wlen, buf) == 0);
+  mgos_vfs_dev_close(dev);
+  free(buf);
+  s->state.app_len = len;
+  s->state.app_org = org;
+  s->state.app_crc32 = cs_crc32(0, img, len);
+  s->state.app_flags = 0;
+  return res;
+}
+
+/*
+ * Typical small release: a few percent of the image changed in one place.
+ * Returns the new image and a patch against the old one.
+ */
+static size_t bench_make_patch(const uint8_t *img_old, size_t len,
+                               uint8_t *img_new, uint8_t *patch) {
+  struct mgos_boot_delta_hdr hdr;
+  struct mgos_boot_delta_op op;
+  size_t pl = sizeof(hdr), ch_off = len / 2, ch_len = (len / 32) & ~3;
+  memcpy(img_new, img_old, len);
+  bench_gen_image(img_new + ch_off, ch_len, 3, 0);
+  memset(&op, 0, sizeof(op));
+  op.op = MGOS_BOOT_DELTA_OP_COPY;
+  op.off = 0;
+  op.len = ch_off;
+  memcpy(patch + pl, &op, sizeof(op));
+  pl += sizeof(op);
+  op.op = MGOS_BOOT_DELTA_OP_INSERT;
+  op.len = ch_len;
+  memcpy(patch + pl, &op, sizeof(op));
+  pl += sizeof(op);
+  memcpy(patch + pl, img_new + ch_off, ch_len);
+  pl += ch_len;
+  op.op = MGOS_BOOT_DELTA_OP_COPY;
+  op.off = ch_off + ch_len;
+  op.len = len - op.off;
+  memcpy(patch + pl, &op, sizeof(op));
+  pl += sizeof(op);
+  hdr.magic = MGOS_BOOT_DELTA_MAGIC;
+  hdr.base_len = len;
+  hdr.base_crc32 = cs_crc32(0, img_old, len);
+  hdr.out_len = len;
+  hdr.out_crc32 = cs_crc32(0, img_new, len);
+  memcpy(patch, &hdr, sizeof(hdr));
+  return pl;
+}
+
+/* Code-like image: a small vocabulary of instructions, some addresses. */
+static void bench_gen_code_image(uint8_t *buf, size_t len, uintptr_t org) {
+  static const uint16_t insns[] = {0x4770, 0xb580, 0x2000, 0x6800,
+                                   0x4618, 0xbd80, 0x2101, 0x9b01};
+  uint32_t x = 12345;
+  for (size_t i = 0; i + 4 <= len; i += 4) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    uint32_t w = insns[(x >> 2) & 7] | (uint32_t) insns[(x >> 5) & 7] << 16;
+    if ((x & 3) == 0) w = (uint32_t) org + ((x >> 8) & 0x3fffc);
+    memcpy(buf + i, &w, 4);
+  }
+  uint32_t vectors[2] = {0x20020000, (uint32_t) org + 0x201};
+  memcpy(buf, vectors, sizeof(vectors));
+}
+
+/*
+ * Relocatable image: code linked at link_org with a relocation table,
+ * built the way mgos_boot_img.py does it, by diffing with a build for org.
+ * The image as it should be at org is returned in img_org.
+ * Returns the image length.
+ */
+static size_t bench_make_reloc_image(uint8_t *img, uint8_t *img_org,
+                                     size_t fw_len, uintptr_t link_org,
+                                     uintptr_t org) {
+  struct mgos_boot_img_ext e = {.type = MGOS_BOOT_IMG_EXT_RELOC};
+  struct mgos_boot_img_reloc r = {.org = link_org};
+  struct mgos_boot_img_trailer t;
+  size_t off = fw_len + sizeof(e) + sizeof(r);
+  bench_gen_code_image(img, fw_len, link_org);
+  bench_gen_code_image(img_org, fw_len, org);
+  for (uint32_t i = 0; i < fw_len; i += 4) {
+    if (memcmp(img + i, img_org + i, 4) == 0) continue;
+    memcpy(img + off, &i, 4);
+    off += 4;
+  }
+  e.len = off - fw_len - sizeof(e);
+  memcpy(img + fw_len, &e, sizeof(e));
+  memcpy(img + fw_len + sizeof(e), &r, sizeof(r));
+  memset(img + off, 0xff, -off & 7);
+  off += -off & 7;
+  memcpy(img_org + fw_len, img + fw_len, off - fw_len);
+  memset(&t, 0, sizeof(t));
+  t.magic = MGOS_BOOT_IMG_MAGIC;
+  t.fw_len = fw_len;
+  t.ext_len = off - fw_len;
+  t.crc32 = cs_crc32(0, img, off);
+  t.magic2 = MGOS_BOOT_IMG_MAGIC2;
+  memcpy(img + off, &t, sizeof(t));
+  memcpy(img_org + off, &t, sizeof(t));
+  return off + sizeof(t);
+}
+
+/* Simple greedy LZSS compressor, see mgos_boot_lz.h for the format. */
+static void bench_lz_put(uint8_t *out, size_t *bit_pos, uint32_t v, int n) {
+  while (n-- > 0) {
+    if ((*bit_pos & 7) == 0) out[*bit_pos >> 3] = 0;
+    if ((v >> n) & 1) out[*bit_pos >> 3] |= 0x80 >> (*bit_pos & 7);
+    (*bit_pos)++;
+  }
+}
+
+static size_t bench_make_lz(const uint8_t *data, size_t len, uint8_t *out) {
+  const int wb = 11, lb = 4;
+  static int32_t last[65536];
+  struct mgos_boot_lz_hdr hdr;
+  size_t bp = sizeof(hdr) * 8, i = 0;
+  memset(last, 0xff, sizeof(last));
+  while (i < len) {
+    size_t best_len = 0, off = 0;
+    if (i + 3 <= len) {
+      uint32_t h = (data[i] | data[i + 1] << 8 | data[i + 2] << 16);
+      h *= 2654435761U;
+      int32_t j = last[h >> 16];
+      last[h >> 16] = i;
+      if (j >= 0 && i - j <= (1U << wb)) {
+        while (best_len < (1U << lb) && i + best_len < len &&
+               data[j + best_len] == data[i + best_len]) {
+          best_len++;
+        }
+        off = i - j;
+      }
+    }
+    if (best_len >= 3) {
+      bench_lz_put(out, &bp, 0, 1);
+      bench_lz_put(out, &bp, off - 1, wb);
+      bench_lz_put(out, &bp, best_len - 1, lb);
+      i += best_len;
+    } else {
+      bench_lz_put(out, &bp, 1, 1);
+      bench_lz_put(out, &bp, data[i], 8);
+      i++;
+    }
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MGOS_BOOT_LZ_MAGIC;
+  hdr.out_len = len;
+  hdr.out_crc32 = cs_crc32(0, data, len);
+  hdr.window_bits = wb;
+  hdr.lookahead_bits = lb;
+  memcpy(out, &hdr, sizeof(hdr));
+  return (bp + 7) / 8;
+}
+
+static void bench_reset(struct mgos_boot_cfg *cfg) {
+  ubuntu_sim_flash_reset_chip("int");
+  ubuntu_sim_flash_reset_chip("ext");
+  memset(cfg->slots, 0, sizeof(cfg->slots));
+  mgos_boot_cfg_set_default_slots(cfg);
+  cfg->flags = MGOS_BOOT_F_COMMITTED;
+  cfg->active_slot = BENCH_SLOT_APP0;
+  cfg->revert_slot = -1;
+}
+
+static void bench_start(void) {
+  mgos_boot_cfg_write(mgos_boot_cfg_get(), false /* dump */);
+  ubuntu_sim_flash_reset_stats();
+}
+
+static void bench_add_stats(struct ubuntu_sim_flash_stats *a,
+                            const struct ubuntu_sim_flash_stats *b) {
+  a->bytes_read += b->bytes_read;
+  a->bytes_written += b->bytes_written;
+  a->bytes_erased += b->bytes_erased;
+  a->read_ops += b->read_ops;
+  a->write_ops += b->write_ops;
+  a->erase_ops += b->erase_ops;
+  a->read_ns += b->read_ns;
+  a->write_ns += b->write_ns;
+  a->erase_ns += b->erase_ns;
+}
+
+static void bench_report(const char *name, size_t len, bool ok,
+                         uint64_t cpu_start) {
+  struct bench_result r;
+  struct ubuntu_sim_flash_stats st;
+  memset(&r, 0, sizeof(r));
+  r.cpu_ns = bench_cpu_ns() - cpu_start;
+  r.time_ns = ubuntu_sim_flash_now();
+  ubuntu_sim_flash_get_stats("int", &st);
+  bench_add_stats(&r.st, &st);
+  ubuntu_sim_flash_get_stats("ext", &st);
+  bench_add_stats(&r.st, &st);
+  double ms = r.time_ns / 1e6;
+  printf("%-17s %7lu %9.1f %7.2f %8lu %8lu %8lu %6lu %9.1f %9.1f %9.1f %7.1f "
+         "%5.2f %s\n",
+         name, (unsigned long) len / 1024, ms,
+         (ms > 0 ? (len / 1048576.0) / (ms / 1000) : 0),
+         (unsigned long) (r.st.bytes_read / 1024),
+         (unsigned long) (r.st.bytes_written / 1024),
+         (unsigned long) (r.st.bytes_erased / 1024),
+         (unsigned long) r.st.erase_ops, r.st.read_ns / 1e6,
+         r.st.write_ns / 1e6, r.st.erase_ns / 1e6, r.cpu_ns / 1e6,
+         (double) r.st.bytes_written / len, (ok ? "ok" : "FAIL"));
+}
+
+static const struct bench_model *bench_find_model(const char *name) {
+  for (int i = 0; i < (int) ARRAY_SIZE(s_models); i++) {
+    if (strcmp(s_models[i].name, name) == 0) return &s_models[i];
+  }
+  return NULL;
+}
+
+static void bench_usage(void) {
+  fprintf(stderr,
+          "Benchmark options:\n"
+          "  --size N         image size, bytes (default 786432)\n"
+          "  --sync           disable background I/O\n"
+          "  --no-map         disable memory-mapped access\n"
+          "  --model NAME     flash model, may be repeated, one of:");
+  for (int i = 0; i < (int) ARRAY_SIZE(s_models); i++) {
+    fprintf(stderr, " %s (%s)", s_models[i].name, s_models[i].chip);
+  }
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+int ubuntu_boot_bench(int argc, char **argv) {
+  size_t len = 786432;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      len = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--sync") == 0) {
+      ubuntu_sim_flash_set_async(false);
+    } else if (strcmp(argv[i], "--no-map") == 0) {
+      ubuntu_sim_flash_set_map(false);
+    } else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+      const struct bench_model *m = bench_find_model(argv[++i]);
+      if (m == NULL) bench_usage();
+      if (!ubuntu_sim_flash_set_model(m->chip, &m->model)) {
+        fprintf(stderr, "Invalid model %s\n", m->name);
+        return EXIT_FAILURE;
+      }
+    } else {
+      bench_usage();
+    }
+  }
+  if (!mgos_boot_cfg_init()) return EXIT_FAILURE;
+  struct mgos_boot_cfg *cfg = mgos_boot_cfg_get();
+  bench_reset(cfg);
+  struct mgos_vfs_dev *app0 = mgos_vfs_dev_open("app0");
+  struct mgos_vfs_dev *app1 = mgos_vfs_dev_open("app1");
+  uintptr_t org = cfg->slots[BENCH_SLOT_APP0].cfg.app_map_addr;
+  if (len == 0 || len % 4 != 0 || len > mgos_vfs_dev_get_size(app0) ||
+      len > mgos_vfs_dev_get_size(app1)) {
+    fprintf(stderr, "Invalid size %lu\n", (unsigned long) len);
+    return EXIT_FAILURE;
+  }
+  uint8_t *img_old = (uint8_t *) malloc(len);
+  uint8_t *img_new = (uint8_t *) malloc(len);
+  bench_gen_image(img_old, len, 1, org);
+  bench_gen_image(img_new, len, 2, org);
+  uint64_t cpu;
+  bool ok;
+
+  printf("%-17s %7s %9s %7s %8s %8s %8s %6s %9s %9s %9s %7s %5s\n",
+         "scenario", "size,K", "time,ms", "MB/s", "read,K", "wr,K", "er,K",
+         "erases", "read,ms", "prog,ms", "erase,ms", "cpu,ms", "WA");
+
+  /* Checksum of the bootable slot: every boot does this. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_checksum(app0, len) == cfg->slots[0].state.app_crc32);
+  bench_report("checksum-int", len, ok, cpu);
+
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_checksum(app1, len) == cfg->slots[1].state.app_crc32);
+  bench_report("checksum-ext", len, ok, cpu);
+
+  /* Boot of an unchanged slot that has been verified before. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  bench_start();
+  ok &= (mgos_boot_xcfg_init() && mgos_boot_verify_app(cfg, false));
+  ubuntu_sim_flash_reset_stats();
+  cpu = bench_cpu_ns();
+  ok &= mgos_boot_verify_app(cfg, false);
+  mgos_boot_xcfg_deinit();
+  bench_report("warm-boot", len, ok, cpu);
+
+  /*
+   * First cold boot after the warm boot record has expired. The middle of
+   * the app is damaged behind the loader's back: samples still match, so
+   * only a full checksum catches it.
+   */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  bench_start();
+  ok &= (mgos_boot_xcfg_init() && mgos_boot_verify_app(cfg, false));
+  mgos_boot_warm_save(cfg);
+  {
+    size_t start = 0, size = 0;
+    bool expired = false;
+    int slot;
+    uintptr_t app_org;
+    uint32_t app_len;
+    memcpy(img_new, img_old, len);
+    img_new[len / 2] ^= 0xff;
+    ok &= (ubuntu_sim_flash_get_sector(app0, len / 2, &start, &size) &&
+           start + size <= len &&
+           mgos_vfs_dev_erase(app0, start, size) == 0 &&
+           mgos_vfs_dev_write(app0, start, size, img_new + start) == 0);
+    for (int i = 0; i < MGOS_BOOT_WARM_MAX_BOOTS; i++) {
+      ok &= mgos_boot_warm_check(&slot, &app_org, &app_len, &expired);
+    }
+    ok &= !mgos_boot_warm_check(&slot, &app_org, &app_len, &expired);
+    ok &= expired;
+    ubuntu_sim_flash_reset_stats();
+    cpu = bench_cpu_ns();
+    ok &= !mgos_boot_verify_app(cfg, expired);
+  }
+  mgos_boot_xcfg_deinit();
+  bench_report("warm-expired", len, ok, cpu);
+  bench_gen_image(img_new, len, 2, org);
+
+  /* Raw device copy, external to internal. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= mgos_boot_copy_dev(app1, app0, len, NULL);
+  bench_report("copy-dev", len, ok, cpu);
+
+  /* Copy with verification. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= mgos_boot_copy_app(cfg, BENCH_SLOT_APP1, BENCH_SLOT_APP0);
+  bench_report("copy-app", len, ok, cpu);
+
+  /* Update when there is nothing to preserve in the bootable slot. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  cfg->active_slot = BENCH_SLOT_APP1;
+  cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+         mgos_boot_checksum(app0, len) == cfg->slots[0].state.app_crc32);
+  bench_report("update", len, ok, cpu);
+
+  /* Regular OTA: bootable slot holds the revert image, needs a backup. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  cfg->active_slot = BENCH_SLOT_APP1;
+  cfg->revert_slot = BENCH_SLOT_APP0;
+  cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+         mgos_boot_checksum(app0, len) == cfg->slots[0].state.app_crc32);
+  bench_report("update-backup", len, ok, cpu);
+
+  /* Same, the temp slot holds an old image that has to be erased. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_TEMP, img_new, len, org);
+  memset(&cfg->slots[BENCH_SLOT_TEMP].state, 0,
+         sizeof(cfg->slots[BENCH_SLOT_TEMP].state));
+  cfg->active_slot = BENCH_SLOT_APP1;
+  cfg->revert_slot = BENCH_SLOT_APP0;
+  cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+         mgos_boot_checksum(app0, len) == cfg->slots[0].state.app_crc32);
+  bench_report("update-dirty", len, ok, cpu);
+
+  /* Same, the app has erased the temp slot in advance. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_TEMP, img_new, len, org);
+  memset(&cfg->slots[BENCH_SLOT_TEMP].state, 0,
+         sizeof(cfg->slots[BENCH_SLOT_TEMP].state));
+  cfg->active_slot = BENCH_SLOT_APP1;
+  cfg->revert_slot = BENCH_SLOT_APP0;
+  cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+  bench_start();
+  ok &= (ubuntu_boot_ota_pre_erase(BENCH_SLOT_TEMP) && mgos_boot_xcfg_init());
+  ubuntu_sim_flash_reset_stats();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+         mgos_boot_checksum(app0, len) == cfg->slots[0].state.app_crc32);
+  mgos_boot_xcfg_deinit();
+  bench_report("update-pre-erased", len, ok, cpu);
+
+  /* Same, swapping the slots when there's no room for a full backup. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_APP1, img_new, len, org);
+  cfg->active_slot = BENCH_SLOT_APP1;
+  cfg->revert_slot = BENCH_SLOT_APP0;
+  cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+  bench_start();
+  ok &= mgos_boot_xcfg_init();
+  ubuntu_sim_flash_reset_stats();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_swap_slots(cfg, BENCH_SLOT_APP1, BENCH_SLOT_APP0,
+                              BENCH_SLOT_TEMP) &&
+         cfg->active_slot == BENCH_SLOT_APP0 &&
+         cfg->revert_slot == BENCH_SLOT_APP1 &&
+         mgos_boot_checksum(app0, len) == cs_crc32(0, img_new, len) &&
+         mgos_boot_checksum(app1, len) == cs_crc32(0, img_old, len));
+  mgos_boot_xcfg_deinit();
+  bench_report("update-swap", len, ok, cpu);
+
+  /* Same, with a patch against the current image. */
+  bench_reset(cfg);
+  {
+    uint8_t *img_delta = (uint8_t *) malloc(len);
+    uint8_t *patch = (uint8_t *) malloc(len);
+    size_t patch_len = bench_make_patch(img_old, len, img_delta, patch);
+    ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+    ok &= bench_write_slot(cfg, BENCH_SLOT_APP1, patch, patch_len, org);
+    cfg->slots[BENCH_SLOT_APP1].state.app_flags |= MGOS_BOOT_APP_F_DELTA;
+    cfg->active_slot = BENCH_SLOT_APP1;
+    cfg->revert_slot = BENCH_SLOT_APP0;
+    cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+    bench_start();
+    cpu = bench_cpu_ns();
+    ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+           mgos_boot_checksum(app0, len) == cs_crc32(0, img_delta, len));
+    bench_report("update-delta", len, ok, cpu);
+    free(img_delta);
+    free(patch);
+  }
+
+  /* Update with a compressed image, nothing to back up. */
+  bench_reset(cfg);
+  {
+    uint8_t *img_code = (uint8_t *) malloc(len);
+    uint8_t *comp = (uint8_t *) malloc(len * 9 / 8 + 64);
+    size_t comp_len;
+    bench_gen_code_image(img_code, len, org);
+    comp_len = bench_make_lz(img_code, len, comp);
+    ok = bench_write_slot(cfg, BENCH_SLOT_APP1, comp, comp_len, org);
+    cfg->slots[BENCH_SLOT_APP1].state.app_flags |= MGOS_BOOT_APP_F_LZ;
+    cfg->active_slot = BENCH_SLOT_APP1;
+    cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+    bench_start();
+    cpu = bench_cpu_ns();
+    ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+           mgos_boot_checksum(app0, len) == cs_crc32(0, img_code, len));
+    bench_report("update-lz", len, ok, cpu);
+    free(img_code);
+    free(comp);
+  }
+
+  /* Update was not committed: revert to the backup in the temp slot. */
+  bench_reset(cfg);
+  ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_new, len, org);
+  ok &= bench_write_slot(cfg, BENCH_SLOT_TEMP, img_old, len, org);
+  cfg->active_slot = BENCH_SLOT_APP0;
+  cfg->revert_slot = BENCH_SLOT_TEMP;
+  cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A;
+  bench_start();
+  cpu = bench_cpu_ns();
+  ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+         mgos_boot_checksum(app0, len) == cs_crc32(0, img_old, len));
+  bench_report("rollback", len, ok, cpu);
+
+  /* Re-apply of a near-identical build: a few bytes changed in one place,
+   * some bits cleared in another. Most sectors need not be touched. */
+  bench_reset(cfg);
+  {
+    uint8_t *img_near = (uint8_t *) malloc(len);
+    memcpy(img_near, img_old, len);
+    for (size_t i = len / 2; i < len / 2 + 64 && i < len; i++) {
+      img_near[i] ^= 0x5a;
+    }
+    for (size_t i = len / 4; i < len / 4 + 64; i++) img_near[i] &= 0xf0;
+    ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_old, len, org);
+    ok &= bench_write_slot(cfg, BENCH_SLOT_APP1, img_near, len, org);
+    cfg->active_slot = BENCH_SLOT_APP1;
+    cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+    bench_start();
+    cpu = bench_cpu_ns();
+    ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+           mgos_boot_checksum(app0, len) == cs_crc32(0, img_near, len));
+    bench_report("update-same", len, ok, cpu);
+    free(img_near);
+  }
+
+  /* Update with an image built for a different address, relocated while
+   * being copied. */
+  bench_reset(cfg);
+  {
+    uintptr_t link_org = org + 0x100000;
+    uint8_t *img_rl = (uint8_t *) malloc(len * 2);
+    uint8_t *img_org = (uint8_t *) malloc(len * 2);
+    size_t rl_len =
+        bench_make_reloc_image(img_rl, img_org, len * 3 / 4, link_org, org);
+    ok = bench_write_slot(cfg, BENCH_SLOT_APP1, img_rl, rl_len, link_org);
+    cfg->active_slot = BENCH_SLOT_APP1;
+    cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+    bench_start();
+    cpu = bench_cpu_ns();
+    ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+           cfg->active_slot == BENCH_SLOT_APP0 &&
+           cfg->slots[0].state.app_org == org &&
+           mgos_boot_checksum(app0, rl_len) == cs_crc32(0, img_org, rl_len));
+    bench_report("update-reloc", rl_len, ok, cpu);
+
+    /* Same, the image is already in the bootable slot: it is moved out
+     * to the temp slot and relocated on the way back. */
+    bench_reset(cfg);
+    ok = bench_write_slot(cfg, BENCH_SLOT_APP0, img_rl, rl_len, link_org);
+    cfg->flags = MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B;
+    bench_start();
+    cpu = bench_cpu_ns();
+    ok &= (mgos_boot_select_slot(cfg) && mgos_boot_make_bootable(cfg) &&
+           cfg->active_slot == BENCH_SLOT_APP0 &&
+           cfg->slots[0].state.app_org == org &&
+           mgos_boot_checksum(app0, rl_len) == cs_crc32(0, img_org, rl_len));
+    bench_report("reloc-in-place", rl_len, ok, cpu);
+    free(img_rl);
+    free(img_org);
+  }
+
+  mgos_vfs_dev_close(app0);
+  mgos_vfs_dev_close(app1);
+  free(img_old);
+  free(img_new);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host (Linux) port of the loader.
+ *
+ * Flash is simulated (see ubuntu_sim_flash.h) and laid out like a STM32F4
+ * with 1M of internal flash mapped at 0x08000000 and 8M of SPI NOR flash.
+ * Flash contents are kept in files in the current directory (or --dir),
+ * so state persists across runs, just like on a real device.
+ * Restart re-executes the loader, boot state is carried over in a file.
+ * Booting the app prints its vectors and exits.
+ * With --pty, the debug UART is a pseudo-terminal, for recovery.
+ */
+
+#include "mgos_boot_hal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/str_util.h"
+
+#include "mgos_boot_cfg.h"
+#include "mgos_boot_dbg.h"
+#include "mgos_boot_hot.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_log.h"
+#include "mgos_boot_main.h"
+#include "mgos_boot_trace.h"
+#include "mgos_hal.h"
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+#include "ubuntu_boot_bench.h"
+#include "ubuntu_boot_ota.h"
+#include "ubuntu_sim_flash.h"
+
+#define FLASH_BASE 0x08000000
+#define FLASH_SIZE (1024 * 1024)
+#define FLASH_BL_SIZE 32768
+#define SRAM_BASE 0x20000000
+/* Only hot sections live in it, the loader uses host memory. */
+#define SRAM_SIZE (256 * 1024)
+#define EXT_FLASH_SIZE (8 * 1024 * 1024)
+
+#define BOOT_STATE_FILE "boot_state.bin"
+/* Stands for RTC backup registers, survives restarts until --power-on. */
+#define RETAINED_FILE "retained.bin"
+
+extern struct mgos_boot_state g_boot_state;
+extern bool mgos_root_devtab_init(void);
+
+/* STM32F4 internal flash: 16K/64K/128K sectors, word programming. */
+static const struct ubuntu_sim_flash_model s_int_flash_model = {
+    .sectors = "4x16K,1x64K,7x128K",
+    .page_size = 4,
+    .read_op_ns = 100,
+    .read_ns_per_kb = 6000,
+    .prog_page_us = 16,
+    .erase_base_us = 130000,
+    .erase_us_per_kb = 7000,
+};
+
+/* Typical 8M SPI NOR: 4K sectors, 32K and 64K blocks, 256-byte pages. */
+static const struct ubuntu_sim_flash_model s_ext_flash_model = {
+    .sectors = "2048x4K",
+    .block_sizes = {32768, 65536},
+    .page_size = 256,
+    .read_op_ns = 2000,
+    .read_ns_per_kb = 200000,
+    .prog_page_us = 700,
+    .erase_base_us = 40000,
+    .erase_us_per_kb = 1700,
+};
+
+struct ubuntu_dev {
+  const char *name;
+  const char *chip;
+  uint32_t offset;
+  uint32_t size;
+};
+
+static const struct ubuntu_dev s_devs[] = {
+    {"boot", "int", 0, FLASH_BL_SIZE},
+    {"bcfg0", "int", 0x8000, 0x4000},
+    {"bcfg1", "int", 0xc000, 0x4000},
+    {"app0", "int", MGOS_BOOT_APP0_OFFSET, FLASH_SIZE - MGOS_BOOT_APP0_OFFSET},
+    {"app1", "ext", 0x000000, 0x100000},
+    {"appT", "ext", 0x100000, 0x100000},
+    {"appF", "ext", 0x200000, 0x100000},
+    {"fs0", "ext", 0x300000, 0x80000},
+    {"fs1", "ext", 0x380000, 0x80000},
+    {"fsF", "ext", 0x400000, 0x80000},
+    /* Extended loader state, see mgos_boot_xcfg.h. Fits two NAND blocks. */
+    {"bxcfg", "ext", 0x480000, 0x40000},
+};
+
+static const char *s_dir = ".";
+static char **s_argv = NULL;
+static bool s_quiet = false;
+static bool s_realtime = false;
+/* Debug UART: master side of the pty, -1 for stdout. */
+static int s_uart_fd = -1;
+/* Drop one in this many received characters, 0 - none. */
+static int s_uart_loss = 0;
+/* Loader log as the app would find it. */
+static uint32_t s_app_log[(sizeof(struct mgos_boot_log) +
+                           MGOS_BOOT_LOG_RING_SIZE + 3) / 4];
+
+/* If s_dir is NULL, flash is memory-backed. */
+static const char *ubuntu_path(const char *name, char *buf, size_t buf_size) {
+  if (s_dir == NULL) return NULL;
+  snprintf(buf, buf_size, "%s/%s", s_dir, name);
+  return buf;
+}
+
+bool mgos_boot_dbg_setup(void) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  return true;
+}
+
+void mgos_boot_dbg_uart_putc(char c) {
+  if (s_uart_fd >= 0) {
+    /* Wait for the other end to take data, as a real UART waits for the
+     * transmitter. If it doesn't, nobody is listening, data is dropped. */
+    while (write(s_uart_fd, &c, 1) < 0) {
+      struct pollfd pfd = {.fd = s_uart_fd, .events = POLLOUT};
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN || poll(&pfd, 1, 100 /* ms */) <= 0) break;
+    }
+  } else if (!s_quiet) {
+    fputc(c, stdout);
+  }
+}
+
+int mgos_boot_dbg_uart_getc(void) {
+  static uint8_t s_buf[4096];
+  static int s_pos = 0, s_len = 0;
+  while (s_pos == s_len) {
+    struct pollfd pfd = {.fd = s_uart_fd, .events = POLLIN};
+    if (s_uart_fd < 0 || poll(&pfd, 1, 1 /* ms */) <= 0) return -1;
+    s_len = read(s_uart_fd, s_buf, sizeof(s_buf));
+    s_pos = 0;
+    if (s_len <= 0) {
+      s_len = 0;
+      return -1;
+    }
+  }
+  if (s_uart_loss > 0 && rand() % s_uart_loss == 0) s_pos++;
+  return (s_pos < s_len ? s_buf[s_pos++] : -1);
+}
+
+/*
+ * Create a pty for the debug UART, link points to the slave side.
+ * The pty is kept across restarts, like a real UART.
+ */
+static bool ubuntu_pty_init(const char *link) {
+  struct termios t;
+  const char *name, *env = getenv("UBUNTU_UART_FD");
+  int fd, sfd;
+  char buf[16];
+  if (env != NULL) {
+    s_uart_fd = atoi(env);
+    return true;
+  }
+  fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 ||
+      (name = ptsname(fd)) == NULL) {
+    goto err;
+  }
+  /* Keep the slave open, so the master works while nobody else has it. */
+  sfd = open(name, O_RDWR | O_NOCTTY);
+  if (sfd < 0 || tcgetattr(sfd, &t) != 0) goto err;
+  cfmakeraw(&t);
+  if (tcsetattr(sfd, TCSANOW, &t) != 0) goto err;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  unlink(link);
+  if (symlink(name, link) != 0) goto err;
+  snprintf(buf, sizeof(buf), "%d", fd);
+  setenv("UBUNTU_UART_FD", buf, 1);
+  s_uart_fd = fd;
+  return true;
+err:
+  perror(link);
+  return false;
+}
+
+/* Internal flash is always mapped on a real device, so this is also
+ * needed on the app boot path, before devices are initialized. */
+static bool ubuntu_chips_init(void) {
+  static bool s_inited = false;
+  char int_buf[256], ext_buf[256];
+  const char *int_file, *ext_file;
+  if (s_inited) return true;
+  int_file = ubuntu_path("flash_int.bin", int_buf, sizeof(int_buf));
+  ext_file = ubuntu_path("flash_ext.bin", ext_buf, sizeof(ext_buf));
+  s_inited = (ubuntu_sim_flash_add_chip("int", int_file, FLASH_SIZE,
+                                        FLASH_BASE, &s_int_flash_model) &&
+              ubuntu_sim_flash_add_chip("ext", ext_file, EXT_FLASH_SIZE, 0,
+                                        &s_ext_flash_model));
+  return s_inited;
+}
+
+static bool ubuntu_sram_init(void) {
+  static bool s_inited = false;
+  if (s_inited) return true;
+  s_inited = (mmap((void *) SRAM_BASE, SRAM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1,
+                   0) == (void *) SRAM_BASE);
+  return s_inited;
+}
+
+bool mgos_boot_hot_mem_ok(uintptr_t addr, size_t len) {
+  return (addr >= SRAM_BASE && addr + len <= SRAM_BASE + SRAM_SIZE);
+}
+
+bool mgos_boot_devs_init(void) {
+  if (!ubuntu_chips_init() || !ubuntu_sim_flash_register_type()) {
+    return false;
+  }
+  for (int i = 0; i < (int) ARRAY_SIZE(s_devs); i++) {
+    const struct ubuntu_dev *d = &s_devs[i];
+    char opts[64];
+    snprintf(opts, sizeof(opts), "{\"chip\": \"%s\", \"offset\": %u, "
+             "\"size\": %u}", d->chip, (unsigned) d->offset,
+             (unsigned) d->size);
+    if (!mgos_vfs_dev_create_and_register(UBUNTU_SIM_FLASH_TYPE, opts,
+                                          d->name)) {
+      mgos_boot_dbg_printf("Failed to create %s\n", d->name);
+      return false;
+    }
+  }
+  return true;
+}
+
+void mgos_boot_cfg_set_default_slots(struct mgos_boot_cfg *cfg) {
+  struct mgos_boot_slot_cfg *sc;
+  struct mgos_boot_slot_state *ss;
+  struct mgos_vfs_dev *app0_dev = mgos_vfs_dev_open("app0");
+  /* Same layout as on STM32. */
+  cfg->num_slots = 4;
+  /* Slot 0 - internal flash, directly bootable. */
+  sc = &cfg->slots[0].cfg;
+  ss = &cfg->slots[0].state;
+  strcpy(sc->app_dev, "app0");
+  strcpy(sc->fs_dev, "fs0");
+  sc->flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
+  sc->app_map_addr = FLASH_BASE + MGOS_BOOT_APP0_OFFSET;
+  ss->app_org = sc->app_map_addr;
+  /* Actual length of the FW is taken from the image trailer, if any. */
+  mgos_boot_img_get_info(app0_dev, &ss->app_len, &ss->app_crc32);
+  mgos_vfs_dev_close(app0_dev);
+  /* Slot 1 - on SPI flash, not mappable. */
+  sc = &cfg->slots[1].cfg;
+  strcpy(sc->app_dev, "app1");
+  strcpy(sc->fs_dev, "fs1");
+  sc->flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
+  /* Slot 2 - temp slot for swaps. */
+  sc = &cfg->slots[2].cfg;
+  strcpy(sc->app_dev, "appT");
+  sc->flags = MGOS_BOOT_SLOT_F_VALID | MGOS_BOOT_SLOT_F_WRITEABLE;
+  /* Slot 3 - factory reset slot. Not writeable. */
+  sc = &cfg->slots[3].cfg;
+  strcpy(sc->app_dev, "appF");
+  strcpy(sc->fs_dev, "fsF");
+  sc->flags = MGOS_BOOT_SLOT_F_VALID;
+}
+
+bool mgos_boot_dev_read_async(struct mgos_vfs_dev *dev, size_t offset,
+                              size_t len, void *dst) {
+  return ubuntu_sim_flash_read_async(dev, offset, len, dst);
+}
+
+bool mgos_boot_dev_erase_async(struct mgos_vfs_dev *dev, size_t offset,
+                               size_t len) {
+  return ubuntu_sim_flash_erase_async(dev, offset, len);
+}
+
+enum mgos_vfs_dev_err mgos_boot_dev_wait(struct mgos_vfs_dev *dev) {
+  return ubuntu_sim_flash_wait(dev);
+}
+
+bool mgos_boot_dev_get_sector(struct mgos_vfs_dev *dev, size_t offset,
+                              size_t *start, size_t *size) {
+  return ubuntu_sim_flash_get_sector(dev, offset, start, size);
+}
+
+bool mgos_boot_dev_can_overwrite(struct mgos_vfs_dev *dev) {
+  return ubuntu_sim_flash_can_overwrite(dev);
+}
+
+size_t mgos_boot_dev_get_write_size(struct mgos_vfs_dev *dev) {
+  return ubuntu_sim_flash_get_write_size(dev);
+}
+
+const void *mgos_boot_dev_map(struct mgos_vfs_dev *dev) {
+  return ubuntu_sim_flash_map(dev);
+}
+
+/* Cortex-M vector table layout, as produced for STM32 targets. */
+struct int_vectors {
+  uint32_t sp;
+  uint32_t reset;
+};
+
+bool mgos_boot_print_app_info(uintptr_t app_org) {
+  if (app_org < FLASH_BASE || app_org > FLASH_BASE + FLASH_SIZE - 8) {
+    mgos_boot_dbg_printf("Invalid app address\n");
+    return false;
+  }
+  const struct int_vectors *app_vectors = (const struct int_vectors *) app_org;
+  mgos_boot_dbg_printf("SP 0x%lx, entry: 0x%lx\r\n",
+                       (unsigned long) app_vectors->sp,
+                       (unsigned long) app_vectors->reset);
+  if (app_vectors->sp < SRAM_BASE ||
+      app_vectors->sp > SRAM_BASE + 2 * 1024 * 1024 ||
+      app_vectors->reset < app_org ||
+      app_vectors->reset > FLASH_BASE + FLASH_SIZE) {
+    return false;
+  }
+  return true;
+}
+
+/* Check that hot sections are where the app expects them. */
+static bool ubuntu_check_hot(uintptr_t app_org) {
+  const struct mgos_boot_hot *h = &g_boot_hot;
+  if (!mgos_boot_hot_is_valid(h) || h->app_org != app_org) return true;
+  for (int i = 0; i < h->num_ranges; i++) {
+    const struct mgos_boot_hot_range *r = &h->ranges[i];
+    if (memcmp((void *) (uintptr_t) r->dst, (void *) (uintptr_t) r->src,
+               r->len) != 0) {
+      mgos_boot_dbg_printf("Hot range %d is not loaded\n", i);
+      return false;
+    }
+  }
+  mgos_boot_dbg_printf("Hot: %d ranges loaded\n", h->num_ranges);
+  return true;
+}
+
+void mgos_boot_app(uintptr_t app_org) {
+  bool ok = (ubuntu_chips_init() && mgos_boot_print_app_info(app_org) &&
+             ubuntu_check_hot(app_org));
+  mgos_boot_dbg_printf("App @ %p %s\n", (void *) app_org,
+                       (ok ? "started" : "is not valid"));
+  /* This is what the app would report. */
+  if (ok && !MGOS_BOOT_LOG_UART) {
+    char buf[MGOS_BOOT_LOG_RING_SIZE];
+    size_t n = mgos_boot_log_read((struct mgos_boot_log *) s_app_log, buf,
+                                  sizeof(buf));
+    if (!s_quiet) fwrite(buf, 1, n, stdout);
+  }
+  if (ok) mgos_boot_trace_dump(&g_boot_trace);
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Same as on STM32: last 8 bytes of the boot loader area. */
+bool mgos_boot_cfg_should_write_default(void) {
+  uint32_t buf[2] = {MGOS_BOOT_CFG_MAGIC, MGOS_BOOT_CFG_MAGIC}, fbuf[2];
+  bool res = false;
+  struct mgos_vfs_dev *dev = mgos_vfs_dev_open("boot");
+  if (dev == NULL) return false;
+  if (mgos_vfs_dev_read(dev, FLASH_BL_SIZE - 8, 8, fbuf) == 0 &&
+      memcmp(fbuf, buf, sizeof(buf)) != 0) {
+    mgos_vfs_dev_write(dev, FLASH_BL_SIZE - 8, 8, buf);
+    res = true;
+  }
+  mgos_vfs_dev_close(dev);
+  return res;
+}
+
+/* RAM does not survive re-exec so boot state is stashed in a file,
+ * similar to what we do on RS14100. Flash and SRAM are there from reset,
+ * hot sections are loaded before the app is started. */
+void mgos_boot_early_init(void) {
+  char fn[256];
+  ubuntu_chips_init();
+  ubuntu_sram_init();
+  ubuntu_path(BOOT_STATE_FILE, fn, sizeof(fn));
+  FILE *fp = fopen(fn, "rb");
+  if (fp == NULL) return;
+  if (fread(&g_boot_state, sizeof(g_boot_state), 1, fp) != 1) {
+    memset(&g_boot_state, 0, sizeof(g_boot_state));
+  }
+  if (fread(&g_boot_trace, sizeof(g_boot_trace), 1, fp) != 1) {
+    memset(&g_boot_trace, 0, sizeof(g_boot_trace));
+  }
+  if (fread(&g_boot_hot, sizeof(g_boot_hot), 1, fp) != 1) {
+    memset(&g_boot_hot, 0, sizeof(g_boot_hot));
+  }
+  const struct mgos_boot_log *log = (struct mgos_boot_log *) s_app_log;
+  if (fread(s_app_log, 1, sizeof(s_app_log), fp) != sizeof(s_app_log) ||
+      log->size != MGOS_BOOT_LOG_RING_SIZE) {
+    memset(s_app_log, 0, sizeof(s_app_log));
+  }
+  fclose(fp);
+  unlink(fn);
+}
+
+/* Internal flash is mapped from the start, warm boot reads it. */
+void mgos_boot_init(void) {
+  ubuntu_chips_init();
+}
+
+/* Without a state dir (bench), retained storage lives for the process. */
+static uint8_t s_retained[128];
+
+bool mgos_boot_retained_read(void *data, size_t len) {
+  char fn[256];
+  FILE *fp;
+  memset(data, 0, len);
+  if (ubuntu_path(RETAINED_FILE, fn, sizeof(fn)) == NULL) {
+    if (len > sizeof(s_retained)) return false;
+    memcpy(data, s_retained, len);
+    return true;
+  }
+  fp = fopen(fn, "rb");
+  if (fp == NULL) return true;
+  if (fread(data, 1, len, fp) != len) memset(data, 0, len);
+  fclose(fp);
+  return true;
+}
+
+bool mgos_boot_retained_write(const void *data, size_t len) {
+  char fn[256];
+  bool res = false;
+  FILE *fp;
+  if (ubuntu_path(RETAINED_FILE, fn, sizeof(fn)) == NULL) {
+    if (len > sizeof(s_retained)) return false;
+    memcpy(s_retained, data, len);
+    return true;
+  }
+  fp = fopen(fn, "wb");
+  if (fp == NULL) return false;
+  res = (fwrite(data, 1, len, fp) == len);
+  fclose(fp);
+  return res;
+}
+
+/* Wall time plus simulated flash time, unless flash timing is real. */
+uint32_t mgos_boot_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if (!s_realtime) ns += ubuntu_sim_flash_now();
+  return (uint32_t) (ns / 1000);
+}
+
+void mgos_boot_system_restart(void) {
+  char fn[256];
+  ubuntu_path(BOOT_STATE_FILE, fn, sizeof(fn));
+  FILE *fp = fopen(fn, "wb");
+  if (fp != NULL) {
+    fwrite(&g_boot_state, sizeof(g_boot_state), 1, fp);
+    fwrite(&g_boot_trace, sizeof(g_boot_trace), 1, fp);
+    fwrite(&g_boot_hot, sizeof(g_boot_hot), 1, fp);
+    const struct mgos_boot_log *log = mgos_boot_log_get();
+    if (log != NULL) fwrite(log, 1, sizeof(*log) + log->size, fp);
+    fclose(fp);
+  }
+  fflush(stdout);
+  execv("/proc/self/exe", s_argv);
+  perror("execv");
+  abort();
+}
+
+static void ubuntu_usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--dir DIR] [--realtime] [--verbose] [--bench ...]\n"
+          "  --dir DIR   directory to keep flash contents and boot state in\n"
+          "  --realtime  actually take time simulating flash operations\n"
+          "  --power-on  power-on reset: retained state is lost\n"
+          "  --update SLOT FILE\n"
+          "              act as the app: write image or patch to a slot and\n"
+          "              switch to it on next boot\n"
+          "  --pre-erase SLOT\n"
+          "              act as the app: erase a spare slot in advance\n"
+          "  --commit    act as the app: commit the update\n"
+          "  --pty LINK  debug UART is a pty, LINK is the name to use\n"
+          "  --uart-loss N\n"
+          "              drop one in N characters received by the UART\n"
+          "  --bench     run boot path benchmarks on memory-backed flash,\n"
+          "              the rest of the arguments are benchmark options\n"
+          "  --verbose   print loader output in benchmark mode\n",
+          argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  int bench_argi = 0, update_slot = -1, erase_slot = -1;
+  bool verbose = false, commit = false, power_on = false;
+  const char *update_file = NULL, *pty_link = NULL;
+  s_argv = argv;
+  for (int i = 1; i < argc && bench_argi == 0; i++) {
+    if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+      s_dir = argv[++i];
+    } else if (strcmp(argv[i], "--realtime") == 0) {
+      ubuntu_sim_flash_set_realtime(true);
+      s_realtime = true;
+    } else if (strcmp(argv[i], "--verbose") == 0) {
+      verbose = true;
+    } else if (strcmp(argv[i], "--power-on") == 0) {
+      /* Restart into the app is not a power-on, drop it from argv. */
+      power_on = true;
+      memmove(&argv[i], &argv[i + 1], (argc - i) * sizeof(*argv));
+      argc--;
+      i--;
+    } else if (strcmp(argv[i], "--update") == 0 && i + 2 < argc) {
+      update_slot = atoi(argv[++i]);
+      update_file = argv[++i];
+    } else if (strcmp(argv[i], "--pre-erase") == 0 && i + 1 < argc) {
+      erase_slot = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--commit") == 0) {
+      commit = true;
+    } else if (strcmp(argv[i], "--pty") == 0 && i + 1 < argc) {
+      pty_link = argv[++i];
+    } else if (strcmp(argv[i], "--uart-loss") == 0 && i + 1 < argc) {
+      s_uart_loss = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench_argi = i + 1;
+    } else {
+      ubuntu_usage(argv[0]);
+    }
+  }
+  if (bench_argi > 0) {
+    s_dir = NULL;
+    s_quiet = !verbose;
+    mgos_boot_dbg_setup();
+    if (!mgos_boot_devs_init() || !mgos_root_devtab_init()) {
+      return EXIT_FAILURE;
+    }
+    return ubuntu_boot_bench(argc - bench_argi, argv + bench_argi);
+  }
+  if (update_file != NULL || erase_slot >= 0 || commit) {
+    bool ok;
+    mgos_boot_dbg_setup();
+    if (!mgos_boot_devs_init() || !mgos_root_devtab_init()) {
+      return EXIT_FAILURE;
+    }
+    if (update_file != NULL) {
+      ok = ubuntu_boot_ota_update(update_slot, update_file);
+    } else if (erase_slot >= 0) {
+      ok = ubuntu_boot_ota_pre_erase(erase_slot);
+    } else {
+      ok = ubuntu_boot_ota_commit();
+    }
+    return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  if (pty_link != NULL && !ubuntu_pty_init(pty_link)) return EXIT_FAILURE;
+  if (power_on) {
+    char fn[256];
+    unlink(ubuntu_path(RETAINED_FILE, fn, sizeof(fn)));
+  }
+  mgos_boot_main();
+  return 0;
+}
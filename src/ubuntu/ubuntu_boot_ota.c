@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ubuntu_boot_ota.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_crc32.h"
+
+#include "mgos_boot_cfg.h"
+#include "mgos_boot_dbg.h"
+#include "mgos_boot_delta.h"
+#include "mgos_boot_img.h"
+#include "mgos_boot_lz.h"
+#include "mgos_boot_xcfg.h"
+#include "mgos_utils.h"
+#include "mgos_vfs_dev.h"
+
+/* Erase len bytes at the start of the device, sector sizes may vary. */
+static bool ota_erase(struct mgos_vfs_dev *dev, size_t len) {
+  size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0}, offset = 0;
+  if (mgos_vfs_dev_get_erase_sizes(dev, erase_sizes) != 0) return false;
+  while (offset < len) {
+    int i = MGOS_VFS_DEV_NUM_ERASE_SIZES - 1;
+    while (i >= 0 && (erase_sizes[i] == 0 || offset % erase_sizes[i] != 0 ||
+                      mgos_vfs_dev_erase(dev, offset, erase_sizes[i]) != 0)) {
+      i--;
+    }
+    if (i < 0) return false;
+    offset += erase_sizes[i];
+  }
+  return true;
+}
+
+bool ubuntu_boot_ota_update(int slot, const char *file) {
+  bool res = false;
+  struct mgos_boot_cfg *cfg = NULL;
+  struct mgos_boot_slot *s;
+  struct mgos_vfs_dev *dev = NULL;
+  uint8_t *data = NULL;
+  uint32_t org, reloc_off, reloc_num;
+  long len = 0;
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) <= 0) {
+    fprintf(stderr, "Failed to read %s\n", file);
+    goto out;
+  }
+  data = (uint8_t *) malloc(len);
+  rewind(fp);
+  if (data == NULL || fread(data, len, 1, fp) != 1) goto out;
+  if (!mgos_boot_cfg_init()) goto out;
+  cfg = mgos_boot_cfg_get();
+  if (slot < 0 || slot >= cfg->num_slots || slot == cfg->active_slot ||
+      !(cfg->slots[slot].cfg.flags & MGOS_BOOT_SLOT_F_WRITEABLE)) {
+    fprintf(stderr, "Slot %d is not writeable\n", slot);
+    goto out;
+  }
+  s = &cfg->slots[slot];
+  /* Slot is about to be written, it's no longer erased. */
+  if (mgos_boot_xcfg_init() && mgos_boot_xcfg_get()->erased[slot].len > 0 &&
+      !mgos_boot_xcfg_set_erased(slot, 0, 0)) {
+    goto out;
+  }
+  dev = mgos_vfs_dev_open(s->cfg.app_dev);
+  if (dev == NULL || (size_t) len > mgos_vfs_dev_get_size(dev) ||
+      !ota_erase(dev, len) || mgos_vfs_dev_write(dev, 0, len, data) != 0) {
+    fprintf(stderr, "Failed to write %s\n", s->cfg.app_dev);
+    goto out;
+  }
+  /* App is built to run from the same address as the current one,
+   * unless it says otherwise. */
+  s->state.app_org = cfg->slots[cfg->active_slot].state.app_org;
+  if (mgos_boot_img_get_reloc(dev, len, &org, &reloc_off, &reloc_num)) {
+    s->state.app_org = org;
+  }
+  s->state.app_len = len;
+  s->state.app_crc32 = cs_crc32(0, data, len);
+  s->state.app_flags = 0;
+  if (len >= 4 && *((uint32_t *) data) == MGOS_BOOT_DELTA_MAGIC) {
+    s->state.app_flags |= MGOS_BOOT_APP_F_DELTA;
+  } else if (len >= (long) sizeof(struct mgos_boot_lz_hdr) &&
+             *((uint32_t *) data) == MGOS_BOOT_LZ_MAGIC) {
+    const struct mgos_boot_lz_hdr *hdr = (struct mgos_boot_lz_hdr *) data;
+    s->state.app_flags |= (MGOS_BOOT_APP_F_LZ | hdr->flags);
+  }
+  cfg->revert_slot = cfg->active_slot;
+  cfg->active_slot = slot;
+  cfg->flags &= ~MGOS_BOOT_F_COMMITTED;
+  cfg->flags |= (MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B);
+  res = mgos_boot_cfg_write(cfg, true /* dump */);
+out:
+  if (fp != NULL) fclose(fp);
+  free(data);
+  mgos_vfs_dev_close(dev);
+  mgos_boot_xcfg_deinit();
+  return res;
+}
+
+bool ubuntu_boot_ota_pre_erase(int slot) {
+  bool res = false;
+  struct mgos_boot_cfg *cfg;
+  struct mgos_vfs_dev *dev = NULL;
+  size_t size;
+  if (!mgos_boot_cfg_init()) goto out;
+  cfg = mgos_boot_cfg_get();
+  if (slot < 0 || slot >= cfg->num_slots || slot == cfg->active_slot ||
+      slot == cfg->revert_slot ||
+      !(cfg->slots[slot].cfg.flags & MGOS_BOOT_SLOT_F_WRITEABLE)) {
+    fprintf(stderr, "Slot %d can't be erased\n", slot);
+    goto out;
+  }
+  if (!mgos_boot_xcfg_init()) goto out;
+  dev = mgos_vfs_dev_open(cfg->slots[slot].cfg.app_dev);
+  if (dev == NULL) goto out;
+  size = mgos_vfs_dev_get_size(dev);
+  res = (ota_erase(dev, size) && mgos_boot_xcfg_set_erased(slot, 0, size));
+  if (!res) fprintf(stderr, "Failed to erase %s\n", dev->name);
+out:
+  mgos_vfs_dev_close(dev);
+  mgos_boot_xcfg_deinit();
+  return res;
+}
+
+bool ubuntu_boot_ota_commit(void) {
+  struct mgos_boot_cfg *cfg;
+  if (!mgos_boot_cfg_init()) return false;
+  cfg = mgos_boot_cfg_get();
+  if (cfg->flags & MGOS_BOOT_F_COMMITTED) return true;
+  cfg->flags |= MGOS_BOOT_F_COMMITTED;
+  cfg->flags &= ~(MGOS_BOOT_F_FIRST_BOOT_A | MGOS_BOOT_F_FIRST_BOOT_B);
+  return mgos_boot_cfg_write(cfg, true /* dump */);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Emulation of the app side of OTA, for testing updates with the host
+ * build: write a new image (or a patch) to a slot and request the loader
+ * to switch to it on next boot, like the updater in the app does.
+ * Devices must be initialized.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool ubuntu_boot_ota_update(int slot, const char *file);
+
+/*
+ * Erase a slot that is not in use and record it in xcfg, so that
+ * the loader does not have to (see mgos_boot_xcfg_erased).
+ */
+bool ubuntu_boot_ota_pre_erase(int slot);
+
+/* Commit the update, like the app does once it's happy with it. */
+bool ubuntu_boot_ota_commit(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ubuntu_sim_flash.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/str_util.h"
+#include "frozen.h"
+
+#include "mgos_boot_dbg.h"
+#include "mgos_utils.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define SIM_MAX_CHIPS 4
+#define SIM_MAX_REGIONS 8
+
+struct sim_region {
+  size_t start;
+  size_t sector_size;
+  size_t num_sectors;
+};
+
+struct sim_chip {
+  char name[8];
+  uint8_t *data;
+  size_t size;
+  uintptr_t map_addr;
+  struct ubuntu_sim_flash_model model;
+  struct sim_region regions[SIM_MAX_REGIONS];
+  int num_regions;
+  uint64_t busy_until;
+  enum mgos_vfs_dev_err async_res;
+  struct ubuntu_sim_flash_stats stats;
+};
+
+struct sim_dev_data {
+  struct sim_chip *chip;
+  size_t offset;
+  size_t size;
+};
+
+static struct sim_chip s_chips[SIM_MAX_CHIPS];
+static int s_num_chips = 0;
+static uint64_t s_now = 0;
+static bool s_realtime = false;
+static bool s_async_enabled = true;
+static bool s_async_op = false;
+static bool s_map_enabled = true;
+
+static struct sim_chip *sim_find_chip(const char *name) {
+  for (int i = 0; i < s_num_chips; i++) {
+    if (strcmp(s_chips[i].name, name) == 0) return &s_chips[i];
+  }
+  return NULL;
+}
+
+static size_t sim_parse_size(const char *s, char **end) {
+  size_t v = strtoul(s, end, 0);
+  if (**end == 'K') {
+    v *= 1024;
+    (*end)++;
+  } else if (**end == 'M') {
+    v *= 1024 * 1024;
+    (*end)++;
+  }
+  return v;
+}
+
+static bool sim_parse_sectors(struct sim_chip *c) {
+  const char *p = c->model.sectors;
+  size_t start = 0;
+  c->num_regions = 0;
+  while (p != NULL && *p != '\0') {
+    char *end = NULL;
+    size_t n = strtoul(p, &end, 10), ss;
+    if (*end != 'x' || n == 0) return false;
+    ss = sim_parse_size(end + 1, &end);
+    if (ss == 0 || c->num_regions == SIM_MAX_REGIONS) return false;
+    c->regions[c->num_regions].start = start;
+    c->regions[c->num_regions].sector_size = ss;
+    c->regions[c->num_regions].num_sectors = n;
+    c->num_regions++;
+    start += n * ss;
+    p = (*end == ',' ? end + 1 : end);
+  }
+  return (start == c->size);
+}
+
+/* Find sector that contains the specified chip offset. */
+static bool sim_get_sector(const struct sim_chip *c, size_t off,
+                           size_t *sector_start, size_t *sector_size) {
+  for (int i = 0; i < c->num_regions; i++) {
+    const struct sim_region *r = &c->regions[i];
+    size_t end = r->start + r->num_sectors * r->sector_size;
+    if (off < r->start || off >= end) continue;
+    *sector_size = r->sector_size;
+    *sector_start = off - ((off - r->start) % r->sector_size);
+    return true;
+  }
+  return false;
+}
+
+static void sim_op(struct sim_chip *c, uint64_t dur, uint64_t *counter) {
+  uint64_t start = (c->busy_until > s_now ? c->busy_until : s_now);
+  c->busy_until = start + dur;
+  *counter += dur;
+  /* Async operations only keep the chip busy, caller continues. */
+  if (!s_async_op) ubuntu_sim_flash_advance(c->busy_until - s_now);
+}
+
+uint64_t ubuntu_sim_flash_now(void) {
+  return s_now;
+}
+
+void ubuntu_sim_flash_advance(uint64_t ns) {
+  s_now += ns;
+  if (s_realtime && ns > 0) {
+    struct timespec ts = {.tv_sec = ns / 1000000000,
+                          .tv_nsec = ns % 1000000000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+void ubuntu_sim_flash_set_realtime(bool realtime) {
+  s_realtime = realtime;
+}
+
+bool ubuntu_sim_flash_add_chip(const char *name, const char *file, size_t size,
+                               uintptr_t map_addr,
+                               const struct ubuntu_sim_flash_model *model) {
+  int fd = -1, flags = MAP_SHARED;
+  struct sim_chip *c;
+  if (s_num_chips == SIM_MAX_CHIPS || strlen(name) >= sizeof(c->name) ||
+      sim_find_chip(name) != NULL) {
+    return false;
+  }
+  c = &s_chips[s_num_chips];
+  memset(c, 0, sizeof(*c));
+  strcpy(c->name, name);
+  c->size = size;
+  c->model = *model;
+  if (!sim_parse_sectors(c)) {
+    mgos_boot_dbg_printf("%s: invalid sector map %s\n", name, model->sectors);
+    return false;
+  }
+  if (file != NULL) {
+    struct stat st;
+    fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) goto out_err;
+    if ((size_t) st.st_size != size) {
+      /* New (or resized) chip: fill with erased state. */
+      uint8_t ff[4096];
+      memset(ff, 0xff, sizeof(ff));
+      if (ftruncate(fd, 0) != 0) goto out_err;
+      for (size_t i = 0; i < size; i += sizeof(ff)) {
+        if (write(fd, ff, sizeof(ff)) != sizeof(ff)) goto out_err;
+      }
+    }
+  } else {
+    flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  }
+  if (map_addr != 0) {
+    c->data = mmap((void *) map_addr, size, PROT_READ | PROT_WRITE,
+                   flags | MAP_FIXED_NOREPLACE, fd, 0);
+    if (c->data != (void *) map_addr) {
+      if (c->data != MAP_FAILED) munmap(c->data, size);
+      mgos_boot_dbg_printf("%s: cannot map @ %p\n", name, (void *) map_addr);
+      map_addr = 0;
+    }
+  }
+  if (map_addr == 0) {
+    c->data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  }
+  if (c->data == MAP_FAILED) goto out_err;
+  if (fd < 0) memset(c->data, 0xff, size);
+  c->map_addr = map_addr;
+  if (fd >= 0) close(fd);
+  s_num_chips++;
+  return true;
+out_err:
+  mgos_boot_dbg_printf("%s: failed to create %s\n", name,
+                       (file ? file : "(mem)"));
+  if (fd >= 0) close(fd);
+  return false;
+}
+
+bool ubuntu_sim_flash_set_model(const char *name,
+                                const struct ubuntu_sim_flash_model *model) {
+  struct sim_chip *c = sim_find_chip(name);
+  if (c == NULL) return false;
+  struct ubuntu_sim_flash_model old = c->model;
+  c->model = *model;
+  if (!sim_parse_sectors(c)) {
+    c->model = old;
+    sim_parse_sectors(c);
+    return false;
+  }
+  return true;
+}
+
+bool ubuntu_sim_flash_reset_chip(const char *name) {
+  struct sim_chip *c = sim_find_chip(name);
+  if (c == NULL) return false;
+  memset(c->data, 0xff, c->size);
+  memset(&c->stats, 0, sizeof(c->stats));
+  c->busy_until = 0;
+  return true;
+}
+
+bool ubuntu_sim_flash_get_stats(const char *name,
+                                struct ubuntu_sim_flash_stats *stats) {
+  struct sim_chip *c = sim_find_chip(name);
+  if (c == NULL) return false;
+  *stats = c->stats;
+  return true;
+}
+
+void ubuntu_sim_flash_reset_stats(void) {
+  for (int i = 0; i < s_num_chips; i++) {
+    memset(&s_chips[i].stats, 0, sizeof(s_chips[i].stats));
+    s_chips[i].busy_until = 0;
+  }
+  s_now = 0;
+}
+
+static enum mgos_vfs_dev_err sim_dev_open(struct mgos_vfs_dev *dev,
+                                          const char *opts) {
+  char *chip = NULL;
+  unsigned int offset = 0, size = 0;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_INVAL;
+  struct sim_dev_data *dd = NULL;
+  json_scanf(opts, strlen(opts), "{chip: %Q, offset: %u, size: %u}", &chip,
+             &offset, &size);
+  struct sim_chip *c = (chip != NULL ? sim_find_chip(chip) : NULL);
+  if (c == NULL) goto out;
+  if (size == 0) size = c->size - offset;
+  if ((size_t) offset + size > c->size) goto out;
+  dd = (struct sim_dev_data *) calloc(1, sizeof(*dd));
+  if (dd == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+  dd->chip = c;
+  dd->offset = offset;
+  dd->size = size;
+  dev->dev_data = dd;
+  res = MGOS_VFS_DEV_ERR_NONE;
+out:
+  free(chip);
+  return res;
+}
+
+static enum mgos_vfs_dev_err sim_dev_read(struct mgos_vfs_dev *dev,
+                                          size_t offset, size_t len,
+                                          void *dst) {
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  struct sim_chip *c = dd->chip;
+  if (offset + len > dd->size) return MGOS_VFS_DEV_ERR_INVAL;
+  memcpy(dst, c->data + dd->offset + offset, len);
+  c->stats.bytes_read += len;
+  c->stats.read_ops++;
+  sim_op(c,
+         c->model.read_op_ns +
+             ((uint64_t) len * c->model.read_ns_per_kb) / 1024,
+         &c->stats.read_ns);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err sim_dev_write(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len,
+                                           const void *src) {
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  struct sim_chip *c = dd->chip;
+  size_t ps = c->model.page_size, coff = dd->offset + offset;
+  const uint8_t *sp = (const uint8_t *) src;
+  uint8_t *dp = c->data + coff;
+  if (offset + len > dd->size) return MGOS_VFS_DEV_ERR_INVAL;
+  if (c->model.nand) {
+    if (coff % ps != 0 || len % ps != 0) return MGOS_VFS_DEV_ERR_INVAL;
+    for (size_t i = 0; i < len; i++) {
+      if (dp[i] != 0xff) return MGOS_VFS_DEV_ERR_IO;
+    }
+  }
+  for (size_t i = 0; i < len; i++) {
+    dp[i] &= sp[i];
+  }
+  size_t num_pages = (coff + len + ps - 1) / ps - coff / ps;
+  c->stats.bytes_written += len;
+  c->stats.write_ops++;
+  sim_op(c, (uint64_t) num_pages * c->model.prog_page_us * 1000,
+         &c->stats.write_ns);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err sim_dev_erase(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len) {
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  struct sim_chip *c = dd->chip;
+  size_t coff = dd->offset + offset, ss1, ss2, ss_start1, ss_start2;
+  if (len == 0 || offset + len > dd->size) return MGOS_VFS_DEV_ERR_INVAL;
+  if (!sim_get_sector(c, coff, &ss_start1, &ss1) ||
+      !sim_get_sector(c, coff + len - 1, &ss_start2, &ss2)) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  /* Either exactly one sector or a naturally aligned block of sectors. */
+  bool ok = (ss_start1 == coff && ss1 == len);
+  for (int i = 0; !ok && i < (int) ARRAY_SIZE(c->model.block_sizes); i++) {
+    ok = (c->model.block_sizes[i] == len && coff % len == 0 &&
+          ss_start1 == coff && ss_start2 + ss2 == coff + len);
+  }
+  if (!ok) return MGOS_VFS_DEV_ERR_INVAL;
+  memset(c->data + coff, 0xff, len);
+  c->stats.bytes_erased += len;
+  c->stats.erase_ops++;
+  sim_op(c,
+         ((uint64_t) c->model.erase_base_us +
+          ((uint64_t) len * c->model.erase_us_per_kb) / 1024) *
+             1000,
+         &c->stats.erase_ns);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static size_t sim_dev_get_size(struct mgos_vfs_dev *dev) {
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  return dd->size;
+}
+
+static enum mgos_vfs_dev_err sim_dev_close(struct mgos_vfs_dev *dev) {
+  free(dev->dev_data);
+  dev->dev_data = NULL;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err sim_dev_get_erase_sizes(
+    struct mgos_vfs_dev *dev, size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]) {
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  struct sim_chip *c = dd->chip;
+  int n = 0;
+  memset(sizes, 0, MGOS_VFS_DEV_NUM_ERASE_SIZES * sizeof(sizes[0]));
+  /* Distinct sector sizes that appear in the device's range, then blocks. */
+  for (int i = 0; i < c->num_regions; i++) {
+    const struct sim_region *r = &c->regions[i];
+    size_t end = r->start + r->num_sectors * r->sector_size;
+    if (end <= dd->offset || r->start >= dd->offset + dd->size) continue;
+    bool found = false;
+    for (int j = 0; j < n; j++) found |= (sizes[j] == r->sector_size);
+    if (!found && n < MGOS_VFS_DEV_NUM_ERASE_SIZES) sizes[n++] = r->sector_size;
+  }
+  for (int i = 0; i < (int) ARRAY_SIZE(c->model.block_sizes); i++) {
+    if (c->model.block_sizes[i] > 0 && n < MGOS_VFS_DEV_NUM_ERASE_SIZES) {
+      sizes[n++] = c->model.block_sizes[i];
+    }
+  }
+  /* Callers expect ascending order. */
+  for (int i = 1; i < n; i++) {
+    for (int j = i; j > 0 && sizes[j - 1] > sizes[j]; j--) {
+      size_t t = sizes[j];
+      sizes[j] = sizes[j - 1];
+      sizes[j - 1] = t;
+    }
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static const struct mgos_vfs_dev_ops sim_dev_ops = {
+    .open = sim_dev_open,
+    .read = sim_dev_read,
+    .write = sim_dev_write,
+    .erase = sim_dev_erase,
+    .get_size = sim_dev_get_size,
+    .close = sim_dev_close,
+    .get_erase_sizes = sim_dev_get_erase_sizes,
+};
+
+bool ubuntu_sim_flash_get_dev_chip(const struct mgos_vfs_dev *dev,
+                                   const char **chip, size_t *offset) {
+  if (dev == NULL || dev->ops != &sim_dev_ops) return false;
+  const struct sim_dev_data *dd = (const struct sim_dev_data *) dev->dev_data;
+  *chip = dd->chip->name;
+  *offset = dd->offset;
+  return true;
+}
+
+bool ubuntu_sim_flash_get_sector(const struct mgos_vfs_dev *dev, size_t offset,
+                                 size_t *start, size_t *size) {
+  if (dev == NULL || dev->ops != &sim_dev_ops) return false;
+  const struct sim_dev_data *dd = (const struct sim_dev_data *) dev->dev_data;
+  size_t sstart;
+  if (offset >= dd->size ||
+      !sim_get_sector(dd->chip, dd->offset + offset, &sstart, size) ||
+      sstart < dd->offset) {
+    return false;
+  }
+  *start = sstart - dd->offset;
+  return true;
+}
+
+bool ubuntu_sim_flash_can_overwrite(const struct mgos_vfs_dev *dev) {
+  if (dev == NULL || dev->ops != &sim_dev_ops) return false;
+  return !((const struct sim_dev_data *) dev->dev_data)->chip->model.nand;
+}
+
+size_t ubuntu_sim_flash_get_write_size(const struct mgos_vfs_dev *dev) {
+  if (dev == NULL || dev->ops != &sim_dev_ops) return 1;
+  const struct sim_dev_data *dd = (const struct sim_dev_data *) dev->dev_data;
+  return (dd->chip->model.nand ? dd->chip->model.page_size : 1);
+}
+
+const void *ubuntu_sim_flash_map(const struct mgos_vfs_dev *dev) {
+  if (dev == NULL || dev->ops != &sim_dev_ops) return NULL;
+  const struct sim_dev_data *dd = (const struct sim_dev_data *) dev->dev_data;
+  if (!s_map_enabled || dd->chip->map_addr == 0) return NULL;
+  return dd->chip->data + dd->offset;
+}
+
+void ubuntu_sim_flash_set_map(bool enable) {
+  s_map_enabled = enable;
+}
+
+void ubuntu_sim_flash_set_async(bool enable) {
+  s_async_enabled = enable;
+}
+
+bool ubuntu_sim_flash_read_async(struct mgos_vfs_dev *dev, size_t offset,
+                                 size_t len, void *dst) {
+  if (!s_async_enabled || dev->ops != &sim_dev_ops) return false;
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  s_async_op = true;
+  dd->chip->async_res = sim_dev_read(dev, offset, len, dst);
+  s_async_op = false;
+  return true;
+}
+
+bool ubuntu_sim_flash_erase_async(struct mgos_vfs_dev *dev, size_t offset,
+                                  size_t len) {
+  if (!s_async_enabled || dev->ops != &sim_dev_ops) return false;
+  struct sim_dev_data *dd = (struct sim_dev_data *) dev->dev_data;
+  s_async_op = true;
+  dd->chip->async_res = sim_dev_erase(dev, offset, len);
+  s_async_op = false;
+  return true;
+}
+
+enum mgos_vfs_dev_err ubuntu_sim_flash_wait(struct mgos_vfs_dev *dev) {
+  if (dev->ops != &sim_dev_ops) return MGOS_VFS_DEV_ERR_INVAL;
+  struct sim_chip *c = ((struct sim_dev_data *) dev->dev_data)->chip;
+  enum mgos_vfs_dev_err res = c->async_res;
+  if (c->busy_until > s_now) ubuntu_sim_flash_advance(c->busy_until - s_now);
+  c->async_res = MGOS_VFS_DEV_ERR_NONE;
+  return res;
+}
+
+bool ubuntu_sim_flash_register_type(void) {
+  return mgos_vfs_dev_register_type(UBUNTU_SIM_FLASH_TYPE, &sim_dev_ops);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2014-2019 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Simulated flash for the host build of the loader.
+ *
+ * A "chip" is a file- or memory-backed array of bytes with a sector map
+ * and a timing model. Devices of type "simflash" are windows into a chip:
+ *   {"chip": "int", "offset": 65536, "size": 983040}
+ * Programming follows NOR semantics (bits can only go 1 -> 0) unless the
+ * chip is NAND, in which case only whole erased pages can be programmed.
+ *
+ * Time is not actually spent (unless realtime is enabled), it is accounted
+ * on a simulated clock so loader operations can be timed precisely.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UBUNTU_SIM_FLASH_TYPE "simflash"
+
+struct ubuntu_sim_flash_model {
+  /* Sector map: comma-separated list of "<count>x<size>", sizes may have
+   * K or M suffix, e.g. "4x16K,1x64K,7x128K" for STM32F4 1M flash. */
+  const char *sectors;
+  /* Additional (multi-sector) erase sizes, e.g. 64K block erase on NOR.
+   * Must be a multiple of the sector size and naturally aligned. */
+  size_t block_sizes[2];
+  size_t page_size;          /* Program page size. */
+  uint32_t read_op_ns;       /* Per-read command overhead. */
+  uint32_t read_ns_per_kb;   /* Read transfer time. */
+  uint32_t prog_page_us;     /* Per-page program time. */
+  uint32_t erase_base_us;    /* Per-erase fixed cost. */
+  uint32_t erase_us_per_kb;  /* Per-erase cost proportional to size. */
+  bool nand;                 /* Whole-page programming of erased pages only. */
+};
+
+struct ubuntu_sim_flash_stats {
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t bytes_erased;
+  uint32_t read_ops;
+  uint32_t write_ops;
+  uint32_t erase_ops;
+  uint64_t read_ns;
+  uint64_t write_ns;
+  uint64_t erase_ns;
+};
+
+/*
+ * Add a chip. If file is NULL, the chip is backed by anonymous memory.
+ * If map_addr is not 0, the contents will be mapped at that address,
+ * similar to internal or XIP flash.
+ */
+bool ubuntu_sim_flash_add_chip(const char *name, const char *file, size_t size,
+                               uintptr_t map_addr,
+                               const struct ubuntu_sim_flash_model *model);
+
+/* Update timing model of an existing chip. */
+bool ubuntu_sim_flash_set_model(const char *name,
+                                const struct ubuntu_sim_flash_model *model);
+
+/* Erase the entire chip and reset its statistics. */
+bool ubuntu_sim_flash_reset_chip(const char *name);
+
+/* Get statistics of a chip, reset statistics of all chips. */
+bool ubuntu_sim_flash_get_stats(const char *name,
+                                struct ubuntu_sim_flash_stats *stats);
+void ubuntu_sim_flash_reset_stats(void);
+
+/* Chip and offset that device (which must be of simflash type) maps to. */
+bool ubuntu_sim_flash_get_dev_chip(const struct mgos_vfs_dev *dev,
+                                   const char **chip, size_t *offset);
+
+/* Erase sector of a simflash device that contains offset. */
+bool ubuntu_sim_flash_get_sector(const struct mgos_vfs_dev *dev, size_t offset,
+                                 size_t *start, size_t *size);
+
+/* Whether programmed data can be overwritten (NOR) or not (NAND). */
+bool ubuntu_sim_flash_can_overwrite(const struct mgos_vfs_dev *dev);
+
+/* Smallest programming unit: page on NAND, 1 otherwise. */
+size_t ubuntu_sim_flash_get_write_size(const struct mgos_vfs_dev *dev);
+
+/*
+ * Address of the device's data if its chip is mapped, NULL otherwise.
+ * Reads through the mapping are not accounted for in the simulated time.
+ */
+const void *ubuntu_sim_flash_map(const struct mgos_vfs_dev *dev);
+void ubuntu_sim_flash_set_map(bool enable);
+
+/* Simulated clock, ns. */
+uint64_t ubuntu_sim_flash_now(void);
+void ubuntu_sim_flash_advance(uint64_t ns);
+
+/* If enabled, simulated operations actually sleep. */
+void ubuntu_sim_flash_set_realtime(bool realtime);
+
+/*
+ * Background operations: data is transferred immediately but the simulated
+ * clock is not advanced until ubuntu_sim_flash_wait() is called, so other
+ * chips can be accessed in the meantime. Return false if disabled.
+ */
+bool ubuntu_sim_flash_read_async(struct mgos_vfs_dev *dev, size_t offset,
+                                 size_t len, void *dst);
+bool ubuntu_sim_flash_erase_async(struct mgos_vfs_dev *dev, size_t offset,
+                                  size_t len);
+enum mgos_vfs_dev_err ubuntu_sim_flash_wait(struct mgos_vfs_dev *dev);
+void ubuntu_sim_flash_set_async(bool enable);
+
+bool ubuntu_sim_flash_register_type(void);
+
+#ifdef __cplusplus
+}
+#endif
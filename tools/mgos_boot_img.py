@@ -0,0 +1,556 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2014-2019 Cesanta Software Limited
+# All rights reserved
+#
+# Licensed under the Apache License, Version 2.0 (the ""License"");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an ""AS IS"" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Boot loader image tool, see src/mgos_boot_img.h for the format.
+#
+#   mgos_boot_img.py create [--manifest] fw.bin app.img
+#   mgos_boot_img.py create --reloc fw_alt.bin --org ORG --alt-org ALT_ORG \
+#       fw.bin app.img
+#
+#   mgos_boot_img.py create --hot OFFSET,ADDR,LEN [--hot ...] fw.bin app.img
+#
+# For --reloc, fw_alt.bin is the same firmware linked at ALT_ORG instead of
+# ORG, words that differ by exactly ALT_ORG - ORG are the ones to relocate.
+# --hot lists ranges of fw.bin (at OFFSET, load address minus ORG) that are
+# linked to run from RAM at ADDR, the loader copies them before starting
+# the app (see src/mgos_boot_hot.h).
+#   mgos_boot_img.py info app.img
+#   mgos_boot_img.py delta old.img new.img patch.bin
+#   mgos_boot_img.py apply old.img patch.bin new.img
+#   mgos_boot_img.py compress new.img (or patch.bin) new.lz
+#   mgos_boot_img.py decompress new.lz new.img
+
+import argparse
+import struct
+import sys
+import zlib
+
+IMG_MAGIC = 0x5449474d  # "MGIT"
+IMG_MAGIC2 = 0x4549474d  # "MGIE"
+# magic, fw_len, ext_len, flags, crc32, reserved[2], magic2
+TRAILER_FMT = "<8I"
+TRAILER_LEN = struct.calcsize(TRAILER_FMT)
+ALIGN = 8
+# Extension record header: type, reserved, len.
+EXT_HDR_FMT = "<HHI"
+EXT_HDR_LEN = struct.calcsize(EXT_HDR_FMT)
+EXT_MANIFEST = 1
+# Manifest header: block_size, len.
+MANIFEST_HDR_FMT = "<2I"
+MANIFEST_BLOCK_SIZE = 4096
+EXT_RELOC = 2
+# Relocation table header: org, followed by word offsets.
+RELOC_HDR_FMT = "<I"
+EXT_HOT = 3
+# Hot section: offset, addr, len.
+HOT_FMT = "<3I"
+HOT_MAX_RANGES = 8
+
+# See src/mgos_boot_delta.h.
+DELTA_MAGIC = 0x5044474d  # "MGDP"
+# magic, base_len, base_crc32, out_len, out_crc32
+DELTA_HDR_FMT = "<5I"
+# op, off, len
+DELTA_OP_FMT = "<B3xII"
+DELTA_OP_COPY = 1
+DELTA_OP_INSERT = 2
+DELTA_OP_ADD = 3
+# Minimum length of a match to be used.
+DELTA_BLOCK = 16
+# Zero runs in ADD data shorter than this are not worth a separate COPY.
+DELTA_MIN_COPY = 24
+
+# See src/mgos_boot_lz.h.
+LZ_MAGIC = 0x5a4c474d  # "MGLZ"
+# magic, out_len, out_crc32, window_bits, lookahead_bits, reserved, flags
+LZ_HDR_FMT = "<3IBBHI"
+LZ_WINDOW_BITS = 11
+LZ_LOOKAHEAD_BITS = 4
+# Max number of candidates to check for each position.
+LZ_MAX_CHAIN = 64
+# App flags, see src/mgos_boot_img.h.
+APP_F_DELTA = 1 << 24
+APP_F_LZ = 1 << 25
+
+
+def pad(data, align=ALIGN):
+    return data + b"\xff" * (-len(data) % align)
+
+
+def make_trailer(fw, ext, flags=0):
+    crc = zlib.crc32(fw + ext)
+    return struct.pack(TRAILER_FMT, IMG_MAGIC, len(fw), len(ext), flags, crc,
+                       0, 0, IMG_MAGIC2)
+
+
+def create_image(fw, ext=b"", flags=0):
+    fw = pad(fw)
+    ext = pad(ext)
+    return fw + ext + make_trailer(fw, ext, flags)
+
+
+def make_ext(typ, data):
+    return pad(struct.pack(EXT_HDR_FMT, typ, 0, len(data)) + data)
+
+
+def parse_ext(ext):
+    """Returns a list of (type, data)."""
+    res = []
+    off = 0
+    while len(ext) - off >= EXT_HDR_LEN:
+        typ, _, dlen = struct.unpack_from(EXT_HDR_FMT, ext, off)
+        off += EXT_HDR_LEN
+        if dlen > len(ext) - off:
+            break
+        res.append((typ, ext[off:off + dlen]))
+        off += dlen + (-dlen % ALIGN)
+    return res
+
+
+def make_manifest(fw, block_size=MANIFEST_BLOCK_SIZE):
+    crcs = [zlib.crc32(fw[i:i + block_size])
+            for i in range(0, len(fw), block_size)]
+    data = struct.pack(MANIFEST_HDR_FMT, block_size, len(fw))
+    data += struct.pack("<%dI" % len(crcs), *crcs)
+    return make_ext(EXT_MANIFEST, data)
+
+
+def check_manifest(img, data):
+    """Returns (block_size, number of bad blocks)."""
+    block_size, mlen = struct.unpack_from(MANIFEST_HDR_FMT, data)
+    hl = struct.calcsize(MANIFEST_HDR_FMT)
+    crcs = struct.unpack_from("<%dI" % ((len(data) - hl) // 4), data, hl)
+    bad = 0
+    for i in range(0, mlen, block_size):
+        n = i // block_size
+        if n >= len(crcs) or zlib.crc32(img[i:i + block_size]) != crcs[n]:
+            bad += 1
+    return block_size, bad
+
+
+def make_reloc(fw, fw_alt, org, alt_org):
+    if len(fw) != len(fw_alt):
+        raise ValueError("builds differ in length: %d vs %d" %
+                         (len(fw), len(fw_alt)))
+    delta = (alt_org - org) & 0xffffffff
+    offs = []
+    # Both are padded, so there is no partial word at the end.
+    for i in range(0, len(fw), 4):
+        a = struct.unpack_from("<I", fw, i)[0]
+        b = struct.unpack_from("<I", fw_alt, i)[0]
+        if a == b:
+            continue
+        if (b - a) & 0xffffffff != delta:
+            raise ValueError("unrelocatable difference @ 0x%x" % i)
+        offs.append(i)
+    data = struct.pack(RELOC_HDR_FMT, org)
+    data += struct.pack("<%dI" % len(offs), *offs)
+    return make_ext(EXT_RELOC, data)
+
+
+def parse_hot(s):
+    off, addr, length = (int(x, 0) for x in s.split(","))
+    return off, addr, length
+
+
+def make_hot(fw, ranges):
+    if len(ranges) > HOT_MAX_RANGES:
+        raise ValueError("too many hot ranges (max %d)" % HOT_MAX_RANGES)
+    data = b""
+    for off, addr, length in ranges:
+        if length == 0 or off + length > len(fw):
+            raise ValueError("hot range 0x%x+%d is outside the firmware" %
+                             (off, length))
+        data += struct.pack(HOT_FMT, off, addr, length)
+    return make_ext(EXT_HOT, data)
+
+
+def parse_image(img):
+    """Returns (fw, ext, flags) or None if there is no valid trailer."""
+    img = img.rstrip(b"\xff")
+    if len(img) < TRAILER_LEN or len(img) % 4 != 0:
+        return None
+    magic, fw_len, ext_len, flags, crc, _, _, magic2 = struct.unpack(
+        TRAILER_FMT, img[-TRAILER_LEN:])
+    if (magic != IMG_MAGIC or magic2 != IMG_MAGIC2 or
+            fw_len + ext_len + TRAILER_LEN != len(img)):
+        return None
+    fw, ext = img[:fw_len], img[fw_len:fw_len + ext_len]
+    if zlib.crc32(fw + ext) != crc:
+        return None
+    return fw, ext, flags
+
+
+def _delta_extend(old, new, i, j):
+    """Approximate match extension, as in bsdiff: find the length that
+    maximizes 2 * matches - length, stop when it's clearly not improving."""
+    best_len, best_score, score, n = 0, 0, 0, 0
+    max_n = min(len(new) - i, len(old) - j)
+    while n < max_n:
+        score += 1 if new[i + n] == old[j + n] else -1
+        n += 1
+        if score > best_score:
+            best_len, best_score = n, score
+        elif score < best_score - 64:
+            break
+    return best_len
+
+
+def _delta_match_ops(old, new, i, j, length):
+    """Split a matched region into COPY (exact) and ADD (approximate) ops."""
+    ops = []
+    start = 0
+    k = 0
+    while k < length:
+        if new[i + k] != old[j + k]:
+            k += 1
+            continue
+        e = k
+        while e < length and new[i + e] == old[j + e]:
+            e += 1
+        if e - k >= DELTA_MIN_COPY or (k == 0 and e == length):
+            if k > start:
+                ops.append((DELTA_OP_ADD, j + start, new[i + start:i + k],
+                            old[j + start:j + k]))
+            ops.append((DELTA_OP_COPY, j + k, e - k))
+            start = e
+        k = e
+    if start < length:
+        ops.append((DELTA_OP_ADD, j + start, new[i + start:i + length],
+                    old[j + start:j + length]))
+    return ops
+
+
+def make_delta(old, new):
+    index = {}
+    for j in range(0, len(old) - DELTA_BLOCK + 1, 4):
+        index.setdefault(old[j:j + DELTA_BLOCK], j)
+    ops = []
+    ins_start = 0
+    i = 0
+    while i <= len(new) - DELTA_BLOCK:
+        j = index.get(new[i:i + DELTA_BLOCK])
+        if j is None:
+            i += 1
+            continue
+        # Extend back into the unmatched data.
+        while i > ins_start and j > 0 and new[i - 1] == old[j - 1]:
+            i -= 1
+            j -= 1
+        length = _delta_extend(old, new, i, j)
+        if i > ins_start:
+            ops.append((DELTA_OP_INSERT, new[ins_start:i]))
+        ops.extend(_delta_match_ops(old, new, i, j, length))
+        i += length
+        ins_start = i
+    if ins_start < len(new):
+        ops.append((DELTA_OP_INSERT, new[ins_start:]))
+    out = [struct.pack(DELTA_HDR_FMT, DELTA_MAGIC, len(old), zlib.crc32(old),
+                       len(new), zlib.crc32(new))]
+    for op in ops:
+        if op[0] == DELTA_OP_COPY:
+            out.append(struct.pack(DELTA_OP_FMT, DELTA_OP_COPY, op[1], op[2]))
+        elif op[0] == DELTA_OP_INSERT:
+            out.append(struct.pack(DELTA_OP_FMT, DELTA_OP_INSERT, 0,
+                                   len(op[1])))
+            out.append(op[1])
+        else:
+            _, off, nd, od = op
+            out.append(struct.pack(DELTA_OP_FMT, DELTA_OP_ADD, off, len(nd)))
+            out.append(bytes((a - b) & 0xff for a, b in zip(nd, od)))
+    return b"".join(out)
+
+
+def apply_delta(old, patch):
+    magic, base_len, base_crc, out_len, out_crc = struct.unpack_from(
+        DELTA_HDR_FMT, patch)
+    if magic != DELTA_MAGIC:
+        raise ValueError("not a patch")
+    if base_len != len(old) or base_crc != zlib.crc32(old):
+        raise ValueError("base mismatch")
+    pos = struct.calcsize(DELTA_HDR_FMT)
+    op_len = struct.calcsize(DELTA_OP_FMT)
+    out = bytearray()
+    while len(out) < out_len:
+        op, off, n = struct.unpack_from(DELTA_OP_FMT, patch, pos)
+        pos += op_len
+        if op == DELTA_OP_COPY:
+            out += old[off:off + n]
+        elif op == DELTA_OP_INSERT:
+            out += patch[pos:pos + n]
+            pos += n
+        elif op == DELTA_OP_ADD:
+            out += bytes((a + b) & 0xff
+                         for a, b in zip(old[off:off + n], patch[pos:pos + n]))
+            pos += n
+        else:
+            raise ValueError("invalid op %d" % op)
+    if len(out) != out_len or zlib.crc32(out) != out_crc:
+        raise ValueError("result mismatch")
+    return bytes(out)
+
+
+class BitWriter(object):
+
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.n = 0
+
+    def put(self, v, nbits):
+        self.acc = (self.acc << nbits) | v
+        self.n += nbits
+        while self.n >= 8:
+            self.n -= 8
+            self.out.append((self.acc >> self.n) & 0xff)
+        self.acc &= (1 << self.n) - 1
+
+    def finish(self):
+        if self.n > 0:
+            self.out.append((self.acc << (8 - self.n)) & 0xff)
+            self.n = 0
+        return bytes(self.out)
+
+
+def lz_compress(data, wb=LZ_WINDOW_BITS, lb=LZ_LOOKAHEAD_BITS):
+    """LZSS, same bit stream as heatshrink."""
+    window, max_len = 1 << wb, 1 << lb
+    # Backref must be shorter than the same data as literals.
+    min_len = (1 + wb + lb) // 9 + 1
+    chains = {}
+    bw = BitWriter()
+    i = 0
+    while i < len(data):
+        best_len, best_off = 0, 0
+        key = data[i:i + 3]
+        cands = chains.get(key, ())
+        for j in reversed(cands[-LZ_MAX_CHAIN:]):
+            if i - j > window:
+                break
+            n = 0
+            while (n < max_len and i + n < len(data) and
+                   data[j + n] == data[i + n]):
+                n += 1
+            if n > best_len:
+                best_len, best_off = n, i - j
+                if n == max_len:
+                    break
+        if best_len >= max(min_len, 3):
+            bw.put(0, 1)
+            bw.put(best_off - 1, wb)
+            bw.put(best_len - 1, lb)
+            step = best_len
+        else:
+            bw.put(1, 1)
+            bw.put(data[i], 8)
+            step = 1
+        for k in range(i, i + step):
+            chains.setdefault(data[k:k + 3], []).append(k)
+        i += step
+    return bw.finish()
+
+
+def lz_decompress(comp, out_len, wb=LZ_WINDOW_BITS, lb=LZ_LOOKAHEAD_BITS):
+    out = bytearray()
+    bits = 0
+    nbits = 0
+    pos = 0
+
+    def get(n):
+        nonlocal bits, nbits, pos
+        while nbits < n:
+            bits = (bits << 8) | comp[pos]
+            pos += 1
+            nbits += 8
+        nbits -= n
+        v = (bits >> nbits) & ((1 << n) - 1)
+        bits &= (1 << nbits) - 1
+        return v
+
+    while len(out) < out_len:
+        if get(1):
+            out.append(get(8))
+        else:
+            off = get(wb) + 1
+            n = get(lb) + 1
+            for _ in range(n):
+                out.append(out[-off])
+    return bytes(out[:out_len])
+
+
+def make_lz(data):
+    flags = 0
+    if len(data) >= 4 and struct.unpack_from("<I", data)[0] == DELTA_MAGIC:
+        flags |= APP_F_DELTA
+    hdr = struct.pack(LZ_HDR_FMT, LZ_MAGIC, len(data), zlib.crc32(data),
+                      LZ_WINDOW_BITS, LZ_LOOKAHEAD_BITS, 0, flags)
+    return hdr + lz_compress(data)
+
+
+def parse_lz(comp):
+    magic, out_len, out_crc, wb, lb, _, flags = struct.unpack_from(
+        LZ_HDR_FMT, comp)
+    if magic != LZ_MAGIC:
+        raise ValueError("not compressed")
+    data = lz_decompress(comp[struct.calcsize(LZ_HDR_FMT):], out_len, wb, lb)
+    if zlib.crc32(data) != out_crc:
+        raise ValueError("CRC mismatch")
+    return data, flags
+
+
+def cmd_create(args):
+    with open(args.fw, "rb") as f:
+        fw = f.read()
+    ext = b""
+    if args.manifest:
+        ext = make_manifest(pad(fw), args.manifest_block_size)
+    if args.reloc:
+        if args.org is None or args.alt_org is None:
+            raise ValueError("--reloc requires --org and --alt-org")
+        with open(args.reloc, "rb") as f:
+            fw_alt = f.read()
+        ext += make_reloc(pad(fw), pad(fw_alt), args.org, args.alt_org)
+    if args.hot:
+        ext += make_hot(fw, args.hot)
+    img = create_image(fw, ext)
+    with open(args.out, "wb") as f:
+        f.write(img)
+    print("%s: fw %d, image %d, crc32 0x%08x" %
+          (args.out, len(fw), len(img), zlib.crc32(img)))
+
+
+def cmd_info(args):
+    with open(args.img, "rb") as f:
+        img = f.read()
+    r = parse_image(img)
+    if r is None:
+        print("%s: no valid trailer" % args.img)
+        return 1
+    fw, ext, flags = r
+    img_len = len(fw) + len(ext) + TRAILER_LEN
+    print("fw_len %d ext_len %d flags 0x%x img_len %d app_crc32 0x%08x" %
+          (len(fw), len(ext), flags, img_len, zlib.crc32(img[:img_len])))
+    res = 0
+    for typ, data in parse_ext(ext):
+        if typ == EXT_MANIFEST:
+            block_size, bad = check_manifest(fw, data)
+            print("ext manifest: block_size %d, %d bad blocks" %
+                  (block_size, bad))
+            if bad:
+                res = 1
+        elif typ == EXT_RELOC:
+            org = struct.unpack_from(RELOC_HDR_FMT, data)[0]
+            n = (len(data) - struct.calcsize(RELOC_HDR_FMT)) // 4
+            print("ext reloc: org 0x%x, %d entries" % (org, n))
+        elif typ == EXT_HOT:
+            hot = list(struct.iter_unpack(HOT_FMT, data))
+            print("ext hot: %d ranges" % len(hot))
+            for off, addr, length in hot:
+                print("  0x%x -> 0x%x, %d" % (off, addr, length))
+        else:
+            print("ext type %d len %d" % (typ, len(data)))
+    return res
+
+
+def cmd_delta(args):
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+    patch = make_delta(old, new)
+    # Make sure it works.
+    apply_delta(old, patch)
+    with open(args.out, "wb") as f:
+        f.write(patch)
+    print("%s: %d -> %d, patch %d (%.1f%%)" %
+          (args.out, len(old), len(new), len(patch),
+           100.0 * len(patch) / len(new)))
+
+
+def cmd_apply(args):
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.patch, "rb") as f:
+        patch = f.read()
+    with open(args.out, "wb") as f:
+        f.write(apply_delta(old, patch))
+
+
+def cmd_compress(args):
+    with open(args.inp, "rb") as f:
+        data = f.read()
+    comp = make_lz(data)
+    if parse_lz(comp)[0] != data:
+        raise RuntimeError("compression failed")
+    with open(args.out, "wb") as f:
+        f.write(comp)
+    print("%s: %d -> %d (%.1f%%)" %
+          (args.out, len(data), len(comp), 100.0 * len(comp) / len(data)))
+
+
+def cmd_decompress(args):
+    with open(args.inp, "rb") as f:
+        comp = f.read()
+    with open(args.out, "wb") as f:
+        f.write(parse_lz(comp)[0])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Boot loader image tool")
+    sub = parser.add_subparsers(dest="cmd")
+    sub.required = True
+    p = sub.add_parser("create", help="create image from raw firmware")
+    p.add_argument("--manifest", action="store_true",
+                   help="add per-block checksums")
+    p.add_argument("--manifest-block-size", type=int,
+                   default=MANIFEST_BLOCK_SIZE)
+    p.add_argument("--reloc", metavar="FW_ALT",
+                   help="add relocation table, FW_ALT is linked at ALT_ORG")
+    p.add_argument("--org", type=lambda x: int(x, 0))
+    p.add_argument("--alt-org", type=lambda x: int(x, 0))
+    p.add_argument("--hot", metavar="OFFSET,ADDR,LEN", type=parse_hot,
+                   action="append", help="range to load to RAM at ADDR")
+    p.add_argument("fw")
+    p.add_argument("out")
+    p.set_defaults(func=cmd_create)
+    p = sub.add_parser("info", help="print image info")
+    p.add_argument("img")
+    p.set_defaults(func=cmd_info)
+    p = sub.add_parser("delta", help="create a patch from old to new image")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("out")
+    p.set_defaults(func=cmd_delta)
+    p = sub.add_parser("apply", help="apply a patch")
+    p.add_argument("old")
+    p.add_argument("patch")
+    p.add_argument("out")
+    p.set_defaults(func=cmd_apply)
+    p = sub.add_parser("compress", help="compress an image or a patch")
+    p.add_argument("inp")
+    p.add_argument("out")
+    p.set_defaults(func=cmd_compress)
+    p = sub.add_parser("decompress", help="decompress")
+    p.add_argument("inp")
+    p.add_argument("out")
+    p.set_defaults(func=cmd_decompress)
+    args = parser.parse_args()
+    return args.func(args) or 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2014-2019 Cesanta Software Limited
+# All rights reserved
+#
+# Licensed under the Apache License, Version 2.0 (the ""License"");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an ""AS IS"" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Serial recovery client, see src/mgos_boot_recover.h for the protocol.
+# Writes an image (plain, compressed or a patch) to a slot of a unit whose
+# loader failed to boot, the slot becomes active and the unit restarts.
+#
+#   mgos_boot_recover.py --port /dev/ttyUSB0 [--slot 0] [--org ORG] app.img
+#
+# Loader output is passed through to stdout. The port may be a pty, e.g.
+# of the host build of the loader (--pty).
+
+import argparse
+import os
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+import zlib
+
+MAGIC = 0x4352424d  # "MBRC"
+VERSION = 1
+# magic, type, reserved, len, seq, crc32
+HDR_FMT = "<IBBHII"
+HDR_LEN = struct.calcsize(HDR_FMT)
+MAX_PAYLOAD = 65535
+T_HELLO = 1
+T_BEGIN = 2
+T_DATA = 3
+T_SACK = 4
+T_STATUS = 5
+# version, frame_size, window, num_slots, reserved
+HELLO_FMT = "<HHBBH"
+# slot, reserved[3], len, crc32, org
+BEGIN_FMT = "<B3xIII"
+# base, mask, credit
+SACK_FMT = "<III"
+# status, crc32
+STATUS_FMT = "<II"
+STATUS_NAMES = {
+    0: "ok",
+    1: "invalid slot or size",
+    2: "write failed",
+    3: "checksum mismatch",
+    4: "config write failed",
+}
+
+
+class Link:
+    def __init__(self, port, baud):
+        self.fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        if baud:
+            attrs = termios.tcgetattr(self.fd)
+            attrs[4] = attrs[5] = getattr(termios, "B%d" % baud)
+            termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+        self.rx = bytearray()
+        self.magic = struct.pack("<I", MAGIC)
+
+    def send(self, type, seq=0, payload=b""):
+        hdr = struct.pack(HDR_FMT, MAGIC, type, 0, len(payload), seq, 0)
+        crc = zlib.crc32(hdr + payload)
+        data = memoryview(hdr[:-4] + struct.pack("<I", crc) + payload)
+        while data:
+            _, w, _ = select.select([], [self.fd], [])
+            data = data[os.write(self.fd, data):]
+
+    def _log(self, data):
+        if data:
+            sys.stdout.buffer.write(data)
+            sys.stdout.flush()
+
+    def _frame(self):
+        """Extracts the next frame from the buffer, passing the rest on."""
+        while True:
+            i = self.rx.find(self.magic)
+            if i < 0:
+                # Keep what may be the start of the magic.
+                n = max(0, len(self.rx) - len(self.magic) + 1)
+                self._log(self.rx[:n])
+                del self.rx[:n]
+                return None
+            self._log(self.rx[:i])
+            del self.rx[:i]
+            if len(self.rx) < HDR_LEN:
+                return None
+            _, type, _, plen, seq, crc = struct.unpack_from(HDR_FMT, self.rx)
+            if len(self.rx) < HDR_LEN + plen:
+                return None
+            hdr = bytes(self.rx[:HDR_LEN - 4]) + b"\0\0\0\0"
+            payload = bytes(self.rx[HDR_LEN:HDR_LEN + plen])
+            if zlib.crc32(hdr + payload) != crc:
+                # Not a frame after all.
+                self._log(self.rx[:1])
+                del self.rx[:1]
+                continue
+            del self.rx[:HDR_LEN + plen]
+            return (type, seq, payload)
+
+    def recv(self, timeout):
+        """Returns the next frame, or None if there was none in time."""
+        deadline = time.monotonic() + timeout
+        while True:
+            f = self._frame()
+            if f is not None:
+                return f
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            r, _, _ = select.select([self.fd], [], [], left)
+            if r:
+                try:
+                    self.rx += os.read(self.fd, 65536)
+                except OSError:
+                    # pty with no other end, loader restarting.
+                    time.sleep(0.1)
+
+
+def hello(link, wait):
+    deadline = time.monotonic() + wait
+    while time.monotonic() < deadline:
+        link.send(T_HELLO)
+        f = link.recv(0.5)
+        while f is not None and f[0] != T_HELLO:
+            f = link.recv(0.5)
+        if f is not None:
+            return struct.unpack_from(HELLO_FMT, f[2])
+    raise SystemExit("No response from the loader")
+
+
+def progress(done, total, start):
+    if not sys.stderr.isatty():
+        return
+    rate = done / max(time.monotonic() - start, 1e-6) / 1024
+    sys.stderr.write("\r%d/%d (%.1f KB/s)" % (done, total, rate))
+    sys.stderr.flush()
+
+
+def transfer(link, data, frame_size, begin, timeout):
+    nframes = (len(data) + frame_size - 1) // frame_size
+    start = last = time.monotonic()
+    sacked = False
+    retx = 0
+    sent = set()
+    link.send(T_BEGIN, 0, begin)
+    while True:
+        f = link.recv(1.0)
+        now = time.monotonic()
+        if f is None:
+            if now - last > timeout:
+                raise SystemExit("Timed out")
+            if not sacked:
+                link.send(T_BEGIN, 0, begin)
+            continue
+        last = now
+        type, _, payload = f
+        if type == T_STATUS:
+            status, crc = struct.unpack_from(STATUS_FMT, payload)
+            if sys.stderr.isatty():
+                sys.stderr.write("\n")
+            return status, crc, now - start, retx
+        if type != T_SACK:
+            continue
+        sacked = True
+        base, mask, credit = struct.unpack_from(SACK_FMT, payload)
+        progress(min(base * frame_size, len(data)), len(data), start)
+        for seq in range(base, min(credit, nframes)):
+            if seq > base and (mask >> (seq - base - 1)) & 1:
+                continue
+            if seq in sent:
+                retx += 1
+            sent.add(seq)
+            link.send(T_DATA, seq,
+                      data[seq * frame_size:(seq + 1) * frame_size])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Serial recovery client")
+    parser.add_argument("--port", required=True, help="serial port or pty")
+    parser.add_argument("--baud", type=int, default=0,
+                        help="baud rate, default is to leave as is")
+    parser.add_argument("--slot", type=int, default=0)
+    parser.add_argument("--org", type=lambda x: int(x, 0), default=0,
+                        help="address the image is built for, "
+                        "default is that of the slot")
+    parser.add_argument("--wait", type=float, default=30,
+                        help="how long to wait for the loader, seconds")
+    parser.add_argument("--timeout", type=float, default=10,
+                        help="give up after this long with no response")
+    parser.add_argument("img")
+    args = parser.parse_args()
+    with open(args.img, "rb") as f:
+        data = f.read()
+    link = Link(args.port, args.baud)
+    version, frame_size, window, num_slots, _ = hello(link, args.wait)
+    print("Loader: version %d, %d slots, %d x %d byte window" %
+          (version, num_slots, window, frame_size), file=sys.stderr)
+    if version != VERSION or not 0 < frame_size <= MAX_PAYLOAD:
+        raise SystemExit("Unsupported protocol version %d" % version)
+    crc = zlib.crc32(data)
+    begin = struct.pack(BEGIN_FMT, args.slot, len(data), crc, args.org)
+    status, dev_crc, elapsed, retx = transfer(link, data, frame_size, begin,
+                                              args.timeout)
+    if status != 0:
+        raise SystemExit("Failed: %s (0x%08x)" %
+                         (STATUS_NAMES.get(status, status), dev_crc))
+    print("Wrote %d bytes to slot %d in %.2fs (%.1f KB/s, %d frames resent)"
+          % (len(data), args.slot, elapsed, len(data) / elapsed / 1024, retx),
+          file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())